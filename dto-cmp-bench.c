@@ -0,0 +1,127 @@
+/*******************************************************************************
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+
+/* Compares memcmp() offloaded by DTO with the std library memcmp() on equal
+ * buffers and on buffers that differ early (at 1% of the length) or at the
+ * last byte. The first compare is also the first offloaded call, which must
+ * select its WQs itself.
+ *
+ * usage: dto-cmp-bench [buffer size [iterations]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#define DEFAULT_BUF_SIZE (64*1024*1024UL)
+#define DEFAULT_ITERS 20
+
+typedef int (*memcmp_fn)(const void *, const void *, size_t);
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sign(int v)
+{
+	return (v > 0) - (v < 0);
+}
+
+/* Times iters compares and returns the sign of the last result */
+static int run(const char *name, memcmp_fn fn, const uint8_t *s1, const uint8_t *s2,
+	size_t size, int iters)
+{
+	volatile int result = 0;
+	double st, secs;
+
+	st = now();
+	for (int it = 0; it < iters; it++)
+		result = fn(s1, s2, size);
+	secs = now() - st;
+
+	printf("  %-12s %10.1f us/op %10.2f GB/s\n", name, secs * 1e6 / iters,
+		(double)size * iters / secs / 1e9);
+	return sign(result);
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = DEFAULT_BUF_SIZE;
+	int iters = DEFAULT_ITERS;
+	size_t offsets[3];
+	const char *names[3] = { "equal", "early mismatch", "last byte mismatch" };
+	memcmp_fn libc_memcmp;
+	void *libc;
+	uint8_t *s1, *s2;
+
+	if (argc > 1)
+		size = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		iters = atoi(argv[2]);
+	if (size == 0 || iters <= 0) {
+		printf("usage: %s [buffer size [iterations]]\n", argv[0]);
+		return 1;
+	}
+
+	/* memcmp is interposed by DTO, look up the std library one directly */
+	libc = dlopen("libc.so.6", RTLD_LAZY | RTLD_NOLOAD);
+	libc_memcmp = libc ? (memcmp_fn)dlsym(libc, "memcmp") : NULL;
+	if (!libc_memcmp) {
+		printf("can't find the std library memcmp\n");
+		return 1;
+	}
+
+	s1 = malloc(size);
+	s2 = malloc(size);
+	if (!s1 || !s2) {
+		printf("out of memory\n");
+		return 1;
+	}
+	for (size_t i = 0; i < size; i++) {
+		s1[i] = (uint8_t)(i * 31 + (i >> 12));
+		s2[i] = (uint8_t)(i * 31 + (i >> 12));
+	}
+
+	/* the thread's first offloaded call is a large compare */
+	if (memcmp(s1, s2, size) != 0) {
+		printf("memcmp failed on equal buffers\n");
+		return 1;
+	}
+
+	offsets[0] = size;
+	offsets[1] = size / 100;
+	offsets[2] = size - 1;
+
+	printf("%lu bytes, %d iterations\n", size, iters);
+
+	for (int t = 0; t < 3; t++) {
+		int expected, result;
+
+		memcpy(s2, s1, size);
+		if (offsets[t] < size)
+			s2[offsets[t]] = s1[offsets[t]] + 1;
+
+		printf("%s:\n", names[t]);
+		expected = run("std memcmp", libc_memcmp, s1, s2, size, iters);
+		result = run("dto memcmp", memcmp, s1, s2, size, iters);
+		if (result != expected) {
+			printf("memcmp failed: result %d expected %d\n", result, expected);
+			return 1;
+		}
+	}
+
+	free(s2);
+	free(s1);
+
+	return 0;
+}
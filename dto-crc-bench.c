@@ -0,0 +1,130 @@
+/*******************************************************************************
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+
+/* Compares dto_memcpy_crc() and dto_crc32c() with memcpy() followed by a
+ * table driven software CRC32C.
+ *
+ * usage: dto-crc-bench [buffer size [iterations]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "dto.h"
+
+#define DEFAULT_BUF_SIZE (4*1024*1024UL)
+#define DEFAULT_ITERS 100
+#define CRC32C_POLY 0x82F63B78U
+#define CRC32C_CHECK 0xE3069283U	/* CRC32C of "123456789" */
+
+static uint32_t crc_table[256];
+
+static void init_crc_table(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc_table[i] = crc;
+	}
+}
+
+static uint32_t sw_crc32c(uint32_t crc, const void *buf, size_t n)
+{
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+	for (size_t i = 0; i < n; i++)
+		crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double secs, size_t size, int iters)
+{
+	printf("%-24s %10.1f us/op %10.2f GB/s\n", name, secs * 1e6 / iters,
+		(double)size * iters / secs / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = DEFAULT_BUF_SIZE;
+	int iters = DEFAULT_ITERS;
+	uint32_t expected, crc = 0;
+	uint8_t *src, *dest;
+	double st;
+
+	if (argc > 1)
+		size = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		iters = atoi(argv[2]);
+	if (size == 0 || iters <= 0) {
+		printf("usage: %s [buffer size [iterations]]\n", argv[0]);
+		return 1;
+	}
+
+	init_crc_table();
+	if (dto_crc32c(0, "123456789", 9) != CRC32C_CHECK || sw_crc32c(0, "123456789", 9) != CRC32C_CHECK) {
+		printf("CRC32C check value mismatch\n");
+		return 1;
+	}
+
+	src = malloc(size);
+	dest = malloc(size);
+	if (!src || !dest) {
+		printf("out of memory\n");
+		return 1;
+	}
+	for (size_t i = 0; i < size; i++)
+		src[i] = (uint8_t)(i * 31 + (i >> 12));
+	memset(dest, 0, size);
+
+	printf("%lu bytes, %d iterations\n", size, iters);
+
+	st = now();
+	for (int it = 0; it < iters; it++) {
+		memcpy(dest, src, size);
+		expected = sw_crc32c(0, dest, size);
+	}
+	report("memcpy + software crc", now() - st, size, iters);
+
+	memset(dest, 0, size);
+
+	st = now();
+	for (int it = 0; it < iters; it++)
+		crc = dto_memcpy_crc(0, dest, src, size);
+	report("dto_memcpy_crc", now() - st, size, iters);
+
+	if (crc != expected || memcmp(dest, src, size) != 0) {
+		printf("dto_memcpy_crc failed: crc 0x%x expected 0x%x\n", crc, expected);
+		return 1;
+	}
+
+	st = now();
+	for (int it = 0; it < iters; it++)
+		crc = dto_crc32c(0, src, size);
+	report("dto_crc32c", now() - st, size, iters);
+
+	if (crc != expected) {
+		printf("dto_crc32c failed: crc 0x%x expected 0x%x\n", crc, expected);
+		return 1;
+	}
+
+	free(dest);
+	free(src);
+
+	return 0;
+}
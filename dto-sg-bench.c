@@ -0,0 +1,111 @@
+/*******************************************************************************
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+
+/* Compares dto_memcpy_sg() with a loop of memcpy() calls on a vector of
+ * small buffers, e.g. the payloads of a message batch.
+ *
+ * usage: dto-sg-bench [element size [elements [iterations]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "dto.h"
+
+#define DEFAULT_ELEM_SIZE (8*1024UL)
+#define DEFAULT_ELEMS 1024
+#define DEFAULT_ITERS 100
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double secs, size_t elem_size, size_t elems, int iters)
+{
+	double ops = (double)elems * iters;
+
+	printf("%-16s %10.1f ns/elem %10.2f GB/s\n", name, secs * 1e9 / ops,
+		ops * elem_size / secs / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	size_t elem_size = DEFAULT_ELEM_SIZE;
+	size_t elems = DEFAULT_ELEMS;
+	int iters = DEFAULT_ITERS;
+	uint8_t *src_buf, *dest_buf;
+	void **dest;
+	const void **src;
+	size_t *len;
+	double st;
+
+	if (argc > 1)
+		elem_size = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		elems = strtoul(argv[2], NULL, 0);
+	if (argc > 3)
+		iters = atoi(argv[3]);
+	if (elem_size == 0 || elems == 0 || iters <= 0) {
+		printf("usage: %s [element size [elements [iterations]]]\n", argv[0]);
+		return 1;
+	}
+
+	/* the elements are spread with a gap, like separately allocated payloads */
+	src_buf = malloc(elems * (elem_size + 64));
+	dest_buf = malloc(elems * (elem_size + 64));
+	dest = malloc(elems * sizeof(*dest));
+	src = malloc(elems * sizeof(*src));
+	len = malloc(elems * sizeof(*len));
+	if (!src_buf || !dest_buf || !dest || !src || !len) {
+		printf("out of memory\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < elems; i++) {
+		src[i] = src_buf + i * (elem_size + 64);
+		dest[i] = dest_buf + i * (elem_size + 64);
+		len[i] = elem_size;
+	}
+	memset(src_buf, 'a', elems * (elem_size + 64));
+	memset(dest_buf, 0, elems * (elem_size + 64));
+
+	printf("%lu elements of %lu bytes, %d iterations\n", elems, elem_size, iters);
+
+	st = now();
+	for (int it = 0; it < iters; it++) {
+		for (size_t i = 0; i < elems; i++)
+			memcpy(dest[i], src[i], len[i]);
+	}
+	report("memcpy loop", now() - st, elem_size, elems, iters);
+
+	memset(dest_buf, 0, elems * (elem_size + 64));
+
+	st = now();
+	for (int it = 0; it < iters; it++)
+		dto_memcpy_sg(dest, src, len, elems);
+	report("dto_memcpy_sg", now() - st, elem_size, elems, iters);
+
+	for (size_t i = 0; i < elems; i++) {
+		if (memcmp(dest[i], src[i], len[i]) != 0) {
+			printf("dto_memcpy_sg failed for element %lu\n", i);
+			return 1;
+		}
+	}
+
+	free(len);
+	free(src);
+	free(dest);
+	free(dest_buf);
+	free(src_buf);
+
+	return 0;
+}
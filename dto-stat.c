@@ -0,0 +1,251 @@
+/*******************************************************************************
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+
+/* dto-stat: show the live statistics of a process using DTO with
+ * DTO_COLLECT_STATS=1 and DTO_STATS_SHM=1.
+ *
+ * usage: dto-stat [-w] [-H] <pid> [interval [count]]
+ *
+ * The first line shows averages since the process started, following lines
+ * the rates during each interval (like vmstat).
+ *   -w  also show failures by reason, per-WQ usage and the auto tuned size
+ *       classes that differ from the configured knobs for each interval
+ *   -H  print the per-second history kept by DTO and exit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "dto-stat.h"
+
+#define MB (1024.0 * 1024.0)
+
+static const char * const fail_names[DTO_SHM_MAX_FAILS] = { "retry", "pf", "other", "backoff", "failover" };
+static const char * const op_names[DTO_SHM_MAX_OP] = { "set", "cpy", "mov", "cmp" };
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-w] [-H] <pid> [interval [count]]\n", prog);
+	exit(1);
+}
+
+/* Copy a consistent snapshot of the segment */
+static void read_stats(const struct dto_shm_stats *shm, struct dto_shm_stats *out)
+{
+	uint64_t seq;
+
+	do {
+		seq = shm->seq;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		memcpy(out, (const void *)shm, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != shm->seq);
+}
+
+static uint64_t total_ops(const struct dto_shm_stats *s, int g)
+{
+	uint64_t ops = 0;
+
+	for (int o = 0; o < DTO_SHM_MAX_OP; o++)
+		ops += s->ops[g][o];
+	return ops;
+}
+
+static uint64_t total_fails(const struct dto_shm_stats *s)
+{
+	uint64_t fails = 0;
+
+	for (int f = 0; f < DTO_SHM_MAX_FAILS; f++)
+		fails += s->fails[f];
+	return fails;
+}
+
+static void print_header(void)
+{
+	printf("%10s %10s %10s %10s %10s %6s %6s %5s %8s\n", "cpu-ops/s", "dsa-ops/s", "fail-ops/s",
+		"cpu-MB/s", "dsa-MB/s", "dsa%", "fails", "csf%", "min-size");
+}
+
+/* Print the rates between snapshots prev and cur, secs apart */
+static void print_line(const struct dto_shm_stats *prev, const struct dto_shm_stats *cur, double secs)
+{
+	uint64_t ops[DTO_SHM_MAX_GROUP], bytes[DTO_SHM_MAX_GROUP], dsa_bytes;
+
+	for (int g = 0; g < DTO_SHM_MAX_GROUP; g++) {
+		ops[g] = total_ops(cur, g) - (prev ? total_ops(prev, g) : 0);
+		bytes[g] = cur->bytes[g] - (prev ? prev->bytes[g] : 0);
+	}
+	dsa_bytes = bytes[DTO_SHM_DSA_SUCCESS] + bytes[DTO_SHM_DSA_FAILED];
+
+	printf("%10.0f %10.0f %10.0f %10.1f %10.1f %6.1f %6lu %5lu %8lu\n",
+		ops[DTO_SHM_STDC] / secs, ops[DTO_SHM_DSA_SUCCESS] / secs, ops[DTO_SHM_DSA_FAILED] / secs,
+		bytes[DTO_SHM_STDC] / secs / MB, dsa_bytes / secs / MB,
+		bytes[DTO_SHM_STDC] + dsa_bytes ? 100.0 * dsa_bytes / (bytes[DTO_SHM_STDC] + dsa_bytes) : 0.0,
+		total_fails(cur) - (prev ? total_fails(prev) : 0),
+		cur->cpu_size_fraction, cur->dsa_min_size);
+}
+
+static void print_wqs(const struct dto_shm_stats *prev, const struct dto_shm_stats *cur, double secs)
+{
+	printf("    fails:");
+	for (int f = 0; f < DTO_SHM_MAX_FAILS; f++)
+		printf(" %s %lu", fail_names[f], cur->fails[f] - (prev ? prev->fails[f] : 0));
+	printf("\n");
+
+	for (uint32_t i = 0; i < cur->num_wqs && i < DTO_SHM_MAX_WQS; i++) {
+		uint64_t descs = cur->wqs[i].descs - (prev ? prev->wqs[i].descs : 0);
+		uint64_t bytes = cur->wqs[i].bytes - (prev ? prev->wqs[i].bytes : 0);
+
+		printf("    %-24s dsa%-4d %10.0f descs/s %10.1f MB/s\n", cur->wqs[i].name,
+			cur->wqs[i].dev_id, descs / secs, bytes / secs / MB);
+	}
+}
+
+/* Print the CPU fraction of the size classes that auto tuning has moved away
+ * from the configured one, "cpu" for the classes that aren't offloaded
+ */
+static void print_tune(const struct dto_shm_stats *cur)
+{
+	if (!cur->auto_tuned)
+		return;
+
+	for (int o = 0; o < DTO_SHM_MAX_OP; o++) {
+		bool tuned = false;
+
+		for (int c = 0; c < DTO_SHM_TUNE_CLASSES; c++) {
+			unsigned long size = 1UL << (c + DTO_SHM_TUNE_MIN_SHIFT);
+
+			if (!cur->tune_cpu_only[o][c] && cur->tune_cpu_fraction[o][c] == cur->cpu_size_fraction)
+				continue;
+			if (!tuned)
+				printf("    tune %s:", op_names[o]);
+			tuned = true;
+			printf(" >=%lu%c", size >= 1024 * 1024 ? size / (1024 * 1024) : size / 1024,
+				size >= 1024 * 1024 ? 'M' : 'K');
+			if (cur->tune_cpu_only[o][c])
+				printf(" cpu");
+			else
+				printf(" %u%%", cur->tune_cpu_fraction[o][c]);
+		}
+		if (tuned)
+			printf("\n");
+	}
+}
+
+static void print_history(const struct dto_shm_stats *s)
+{
+	uint64_t first = s->num_samples > DTO_SHM_SAMPLES ? s->num_samples - DTO_SHM_SAMPLES : 0;
+
+	printf("%-10s %10s %10s %10s %10s %10s %10s\n", "time", "cpu-ops", "dsa-ops", "fail-ops",
+		"cpu-MB", "dsa-MB", "fail-MB");
+	for (uint64_t i = first; i < s->num_samples; i++) {
+		const struct dto_shm_sample *sample = &s->samples[i % DTO_SHM_SAMPLES];
+
+		printf("%-10lu %10lu %10lu %10lu %10.1f %10.1f %10.1f\n", sample->time,
+			sample->ops[DTO_SHM_STDC], sample->ops[DTO_SHM_DSA_SUCCESS], sample->ops[DTO_SHM_DSA_FAILED],
+			sample->bytes[DTO_SHM_STDC] / MB, sample->bytes[DTO_SHM_DSA_SUCCESS] / MB,
+			sample->bytes[DTO_SHM_DSA_FAILED] / MB);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct dto_shm_stats *shm, prev, cur;
+	char name[NAME_MAX];
+	bool show_wqs = false, history = false;
+	int interval = 1, count = -1, opt, fd;
+	double secs;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "wH")) != -1) {
+		switch (opt) {
+		case 'w':
+			show_wqs = true;
+			break;
+		case 'H':
+			history = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv[0]);
+	pid = atoi(argv[optind++]);
+	if (optind < argc)
+		interval = atoi(argv[optind++]);
+	if (optind < argc)
+		count = atoi(argv[optind++]);
+	if (pid <= 0 || interval <= 0)
+		usage(argv[0]);
+
+	snprintf(name, sizeof(name), DTO_SHM_NAME_FMT, pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "can't open %s, is pid %d running with DTO_COLLECT_STATS=1 DTO_STATS_SHM=1?\n",
+			name, pid);
+		return 1;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (shm->magic != DTO_SHM_MAGIC || shm->version != DTO_SHM_VERSION) {
+		fprintf(stderr, "%s: unknown stats format\n", name);
+		return 1;
+	}
+
+	read_stats(shm, &cur);
+
+	if (history) {
+		print_history(&cur);
+		return 0;
+	}
+
+	/* first line: averages since start */
+	secs = cur.update_time > cur.start_time ? cur.update_time - cur.start_time : 1;
+	print_header();
+	print_line(NULL, &cur, secs);
+	if (show_wqs) {
+		print_wqs(NULL, &cur, secs);
+		print_tune(&cur);
+	}
+
+	for (int i = 1; count < 0 || i < count; i++) {
+		prev = cur;
+		sleep(interval);
+		read_stats(shm, &cur);
+
+		if (kill(pid, 0) != 0 && cur.update_time == prev.update_time) {
+			printf("process %d exited\n", pid);
+			break;
+		}
+
+		secs = cur.update_time > prev.update_time ? cur.update_time - prev.update_time : interval;
+		if (i % 20 == 0)
+			print_header();
+		print_line(&prev, &cur, secs);
+		if (show_wqs) {
+			print_wqs(&prev, &cur, secs);
+			print_tune(&cur);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*******************************************************************************
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+
+/* Layout of the shared memory segment that DTO publishes its statistics to
+ * (DTO_STATS_SHM=1) and that dto-stat reads. The segment is named
+ * DTO_SHM_NAME_FMT with the pid of the process using DTO.
+ */
+
+#ifndef DTO_STAT_H
+#define DTO_STAT_H
+
+#include <stdint.h>
+
+#define DTO_SHM_NAME_FMT "/dto-stats.%d"
+#define DTO_SHM_MAGIC 0x534f5444	/* "DTOS" */
+#define DTO_SHM_VERSION 3
+
+#define DTO_SHM_MAX_WQS 32
+#define DTO_SHM_WQ_NAME_LEN 64
+#define DTO_SHM_SAMPLES 120	/* seconds of history */
+#define DTO_SHM_TUNE_MIN_SHIFT 12	/* smallest auto tuning size class is 4 KB */
+#define DTO_SHM_TUNE_CLASSES 20	/* last class includes all larger sizes */
+
+/* call groups and APIs, in the same order as DTO's stats */
+enum dto_shm_group {
+	DTO_SHM_STDC,
+	DTO_SHM_DSA_SUCCESS,
+	DTO_SHM_DSA_FAILED,
+	DTO_SHM_MAX_GROUP
+};
+
+enum dto_shm_op {
+	DTO_SHM_MEMSET,
+	DTO_SHM_MEMCPY,
+	DTO_SHM_MEMMOVE,
+	DTO_SHM_MEMCMP,
+	DTO_SHM_MAX_OP
+};
+
+/* failure reasons, in the same order as DTO's stats: retry, page fault,
+ * others, and the submissions retried after a backoff and failed over to
+ * another WQ
+ */
+#define DTO_SHM_MAX_FAILS 5
+
+/* throughput during one second */
+struct dto_shm_sample {
+	uint64_t time;		/* CLOCK_REALTIME, seconds */
+	uint64_t ops[DTO_SHM_MAX_GROUP];
+	uint64_t bytes[DTO_SHM_MAX_GROUP];
+};
+
+struct dto_shm_wq {
+	char name[DTO_SHM_WQ_NAME_LEN];
+	int32_t dev_id;
+	uint32_t pad;
+	uint64_t descs;
+	uint64_t bytes;
+};
+
+/* The writer increments seq before and after each update, so readers retry
+ * while seq is odd or changed during the read.
+ */
+struct dto_shm_stats {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t num_wqs;
+	volatile uint64_t seq;
+	uint64_t start_time;	/* CLOCK_REALTIME, seconds */
+	uint64_t update_time;	/* CLOCK_REALTIME, seconds */
+
+	/* totals since start (or since fork) */
+	uint64_t ops[DTO_SHM_MAX_GROUP][DTO_SHM_MAX_OP];
+	uint64_t bytes[DTO_SHM_MAX_GROUP];
+	uint64_t fails[DTO_SHM_MAX_FAILS];
+
+	/* configured knobs (DTO_CPU_SIZE_FRACTION, DTO_MIN_BYTES) */
+	uint64_t cpu_size_fraction;	/* percent */
+	uint64_t dsa_min_size;
+
+	/* current values of the auto tuned knobs per API and size class, valid
+	 * if auto_tuned is set (DTO_AUTO_ADJUST_KNOBS=1)
+	 */
+	uint32_t auto_tuned;
+	uint32_t pad2;
+	uint8_t tune_cpu_fraction[DTO_SHM_MAX_OP][DTO_SHM_TUNE_CLASSES];	/* percent */
+	uint8_t tune_cpu_only[DTO_SHM_MAX_OP][DTO_SHM_TUNE_CLASSES];
+
+	struct dto_shm_wq wqs[DTO_SHM_MAX_WQS];
+
+	/* samples[(num_samples - 1) % DTO_SHM_SAMPLES] is the latest */
+	uint64_t num_samples;
+	struct dto_shm_sample samples[DTO_SHM_SAMPLES];
+};
+
+#endif
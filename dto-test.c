@@ -10,6 +10,7 @@
 #include <string.h>
 #include <threads.h>
 #include <stdatomic.h>
+#include <time.h>
 
 #define NUM_BUFS (4*1024UL)
 #define BUF_SIZE (128*1024UL)
@@ -17,7 +18,8 @@
 #define MEMSET_PATTERN 'a'
 
 #define MAX_ITERS 100000
-#define MAX_THREADS 10
+#define DEFAULT_THREADS 10
+#define MAX_THREADS 128
 #define LOG_COUNT 10000
 
 atomic_int no_ops = 0;
@@ -54,13 +56,33 @@ int thread_func(void *thr_data)
 int main(int argc, char **argv)
 {
  	thrd_t threads[MAX_THREADS];
+	int num_threads = DEFAULT_THREADS;
+	struct timespec st, et;
+	double secs;
 
-	for(int t = 0; t < MAX_THREADS; ++t)
+	/* optional number of threads, e.g., to compare the overhead of
+	 * DTO_COLLECT_STATS=1 with DTO_COLLECT_STATS=0 at different thread counts
+	 */
+	if (argc > 1) {
+		num_threads = atoi(argv[1]);
+		if (num_threads < 1 || num_threads > MAX_THREADS) {
+			printf("usage: %s [threads (1-%d)]\n", argv[0], MAX_THREADS);
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &st);
+
+	for(int t = 0; t < num_threads; ++t)
 		thrd_create(&threads[t], thread_func, NULL);
 
-	for(int t = 0; t < MAX_THREADS; ++t)
+	for(int t = 0; t < num_threads; ++t)
 		thrd_join(threads[t], NULL);
-	
+
+	clock_gettime(CLOCK_MONOTONIC, &et);
+	secs = (et.tv_sec - st.tv_sec) + (et.tv_nsec - st.tv_nsec) / 1e9;
+
 	printf("all threads completed execution\n");
+	printf("%d threads, %d ops in %.3f s, %.0f ops/s\n", num_threads, no_ops, secs, no_ops / secs);
 	return 0;
 }
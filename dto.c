@@ -5,24 +5,32 @@
  ******************************************************************************/
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <wchar.h>
 #include <sys/mman.h>
 #include <cpuid.h>
 #include <linux/idxd.h>
 #include <x86intrin.h>
 #include <sched.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <unistd.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <dlfcn.h>
+#include <malloc.h>
 #include <accel-config/libaccel_config.h>
 #include <numaif.h>
 #include <numa.h>
+#include "dto-stat.h"
+#include "dto.h"
 
 #define likely(x)       __builtin_expect((x), 1)
 #define unlikely(x)     __builtin_expect((x), 0)
@@ -39,17 +47,89 @@
 #define USE_ORIG_FUNC(n, use_dsa) (use_std_lib_calls == 1 || !use_dsa || n < dsa_min_size)
 #define TS_NS(s, e) (((e.tv_sec*1000000000) + e.tv_nsec) - ((s.tv_sec*1000000000) + s.tv_nsec))
 
-/* Maximum WQs that DTO will use. It is rather an arbitrary limit
- * to keep things simple and avoid having to dynamically allocate memory.
- * Allocating memory dynamically may create cyclic dependency and may cause
- * a hang (e.g., memset --> malloc --> alloc library calls memset --> memset)
+/* The WQ topology (the WQs, the WQ tables of each numa node and the per WQ
+ * counters) is sized at init for dto_max_wqs WQs: DTO_MAX_WQS if set, else
+ * all the WQs that the DSA devices support (or the WQs of DTO_WQ_LIST), but
+ * at least DTO_MIN_WQS so that rescans can add WQs. It is mmap'ed rather
+ * than malloc'ed. Allocating memory dynamically may create cyclic dependency
+ * and may cause a hang (e.g., memset --> malloc --> alloc library calls
+ * memset --> memset)
  */
-#define MAX_WQS 32
-#define MAX_NUMA_NODES 32
+#define DTO_MIN_WQS 32
 #define DTO_DEFAULT_MIN_SIZE 65536
+#define DTO_DEFAULT_ALLOC_MIN_SIZE (1024 * 1024)
 #define DTO_INITIALIZED 0
 #define DTO_INITIALIZING 1
 
+/* Maximum descriptors DTO puts in a single DSA batch. The device may support
+ * larger batches, but the descriptor list lives in TLS so keep it bounded.
+ * When a job is striped, the descriptors are shared between the stripes.
+ */
+#define DTO_MAX_BATCH_SIZE 32
+#define DTO_MAX_STRIPES 8
+
+/* Dedicated WQs (DWQs) are leased to one thread at a time, see
+ * dto_dwq_lease(). MOVDIR64B doesn't report a full WQ, so the thread tracks
+ * the completion records of the descriptors it submitted to its DWQ and
+ * doesn't submit more than the WQ size (at most DTO_DWQ_MAX_SIZE).
+ */
+#define DTO_DWQ_MAX_SIZE 128
+#define DTO_DWQ_THREADS_LEN 256
+
+/* The WQs can be rescanned at run time (dto_rescan_wqs(), DTO_WQ_RESCAN_MS),
+ * adding the WQs that were enabled and retiring the ones that are gone. The
+ * WQs that operations are submitted to are read from a table that rescans
+ * replace with an atomic pointer swap, RCU style: a table is only rebuilt
+ * DTO_WQ_TABLES - 1 rescans after it was replaced, and rescans are at least
+ * DTO_WQ_RESCAN_MIN_MS apart, so threads that still read an old table find
+ * it intact. The slot of a retired WQ is reused once no table refers to it
+ * and no operation is in flight on it.
+ */
+#define DTO_WQ_TABLES 4
+#define DTO_WQ_RESCAN_MIN_MS 1000
+
+/* Page fault recovery. A job that faults is resumed on DSA after faulting in
+ * the remaining pages, at most DTO_PF_MAX_RESUMES times. Buffers that faulted
+ * recently are remembered in a small table so that later jobs on the same
+ * buffers are pre-faulted before they are submitted.
+ */
+#define DTO_PF_MAX_RESUMES 4
+#define DTO_PF_TABLE_SIZE 256
+#define DTO_PF_TTL_MS 1000
+#define DTO_PAGE_SHIFT 12
+#define DTO_PAGE_SIZE (1UL << DTO_PAGE_SHIFT)
+
+/* Overlapping memmoves are split into sub-chunks no larger than the distance
+ * between src and dest, executed in order with fenced batch descriptors.
+ * Moves by less than DTO_OVERLAP_MIN_DISTANCE would need too many descriptors
+ * and are left to the CPU. A CPU portion needs a bounce buffer of the
+ * distance, so it is only used for distances up to DTO_OVERLAP_BOUNCE_SIZE.
+ */
+#define DTO_OVERLAP_MIN_DISTANCE 4096
+#define DTO_OVERLAP_BOUNCE_SIZE (64 * 1024)
+
+/* Adaptive cache control (DTO_DSA_CC=2). The destinations written by DSA are
+ * remembered in cc_written for DTO_CC_REUSE_MS. If one of them is the source
+ * of a later intercepted call within that time, its data was consumed right
+ * away: the page is remembered in cc_hot for DTO_CC_HOT_TTL_MS and counted for
+ * the call site that wrote it (with DTO_CALLSITE_POLICY=1). Operations on hot
+ * destinations, or from call sites whose writes are consumed at least
+ * DTO_CC_SITE_REUSE_PCT of the time, use CC=1 unless they are larger than
+ * half the LLC. Others use CC=0 from dto_cc_max_size bytes, or when the LLC
+ * occupancy (read from resctrl every DTO_CC_LLC_CHECK_MS) is above
+ * DTO_CC_LLC_PRESSURE_PCT of the LLC.
+ */
+#define DTO_CC_ADAPTIVE 2
+#define DTO_DEFAULT_CC_MAX_SIZE (2 * 1024 * 1024)
+#define DTO_CC_TABLE_SIZE 256
+#define DTO_CC_REUSE_MS 100
+#define DTO_CC_HOT_TTL_MS 1000
+#define DTO_CC_SITE_REUSE_PCT 25
+#define DTO_CC_SITE_MIN_WRITES 16
+#define DTO_CC_LLC_CHECK_MS 100
+#define DTO_CC_LLC_PRESSURE_PCT 75
+#define DTO_CC_LLC_OCCUPANCY "/sys/fs/resctrl/mon_data/mon_L3_00/llc_occupancy"
+
 
 #define NSEC_PER_SEC (1000000000)
 #define MSEC_PER_SEC (1000)
@@ -58,13 +138,41 @@
 // thread specific variables
 static __thread struct dsa_hw_desc thr_desc;
 static __thread struct dsa_completion_record thr_comp __attribute__((aligned(32)));
+/* CRC descriptors use fields that the other operations leave zero */
+static __thread struct dsa_hw_desc thr_crc_desc;
 static __thread uint64_t thr_bytes_completed;
+static __thread uint64_t thr_fault_addr;
+
+/* descriptor list and completion records used for batch (and striped) submissions */
+struct dto_batch {
+	struct dsa_hw_desc descs[DTO_MAX_BATCH_SIZE] __attribute__((aligned(64)));
+	struct dsa_completion_record comps[DTO_MAX_BATCH_SIZE] __attribute__((aligned(32)));
+	/* one batch descriptor per stripe */
+	struct dsa_hw_desc desc[DTO_MAX_STRIPES] __attribute__((aligned(64)));
+	struct dsa_completion_record comp[DTO_MAX_STRIPES] __attribute__((aligned(32)));
+	struct dto_wq *wq[DTO_MAX_STRIPES];
+	uint32_t first[DTO_MAX_STRIPES];
+	uint32_t count[DTO_MAX_STRIPES];
+	size_t stripe_cap;
+	int num_stripes;
+	int num_submitted;
+};
+
+static __thread struct dto_batch thr_batch;
 
 // original std memory functions
 static void * (*orig_memset)(void *s, int c, size_t n);
 static void * (*orig_memcpy)(void *dest, const void *src, size_t n);
 static void * (*orig_memmove)(void *dest, const void *src, size_t n);
 static int (*orig_memcmp)(const void *s1, const void *s2, size_t n);
+static int (*orig_munmap)(void *addr, size_t length);
+static wchar_t *(*orig_wmemset)(wchar_t *s, wchar_t c, size_t n);
+static void *(*orig_calloc)(size_t nmemb, size_t size);
+static void *(*orig_realloc)(void *ptr, size_t size);
+static long (*orig_mbind)(void *addr, unsigned long len, int mode, const unsigned long *nodemask,
+	unsigned long maxnode, unsigned int flags);
+
+struct dto_device;
 
 struct dto_wq {
 	struct accfg_wq *acc_wq;
@@ -72,22 +180,106 @@ struct dto_wq {
 	uint64_t dsa_gencap;
 	int wq_size;
 	uint32_t max_transfer_size;
+	uint32_t max_batch_size;
+	bool block_on_fault;
 	int wq_fd;
 	void *wq_portal;
 	bool wq_mmapped;
+	int dev_id;
+	int numa_node;
+	int group_id;		// engine group of the WQ on its device
+	int num_engines;	// engines of the group
+	/* rescan state */
+	bool retired;		// not in the WQ table anymore
+	uint32_t scan_gen;	// last scan that found the WQ
+	uint32_t retire_gen;	// generation of the first WQ table without it
+	/* load of the WQ, see select_wq(). inflight is kept with any WQ
+	 * selection, as it also tells when a retired WQ's slot can be reused
+	 */
+	atomic_ullong inflight;	// bytes submitted and not waited for yet
+	bool untracked;		// a submission didn't fit in thr_wqs, the slot is never reused
+	float cost;		// TSC cycles per byte from submission to wait, 0 until measured
+	float retry_rate;	// fraction of submissions rejected with retry
+	/* dedicated WQ state */
+	bool dedicated;
+	atomic_bool leased;
+	uint32_t num_pending;
+	const volatile uint8_t *pending[DTO_DWQ_MAX_SIZE];	// completion status of submitted descriptors
 };
 
+/* WQs of a numa node, interleaved by engine group for striping */
 struct dto_device {
-	struct dto_wq* wqs[MAX_WQS];
-	uint8_t num_wqs;
-	atomic_uchar next_wq;
+	struct dto_wq **wqs;
+	uint32_t num_wqs;
+	atomic_uint next_wq;
+	uint32_t num_stripe_groups;
+};
+
+/* The SWQs in use, see DTO_WQ_TABLES */
+struct dto_wq_table {
+	struct dto_device all;
+	struct dto_device *nodes;	// dto_num_nodes entries
+	/* nodes without a device share the list of another node */
+	struct dto_device **devices;
+	uint32_t gen;
 };
 
 enum wait_options {
 	WAIT_BUSYPOLL = 0,
 	WAIT_UMWAIT,
 	WAIT_YIELD,
-	WAIT_TPAUSE
+	WAIT_TPAUSE,
+	WAIT_HYBRID
+};
+
+/* Hybrid wait. The completion time of a descriptor is predicted from the
+ * time it was submitted, its size and the DSA throughput measured by earlier
+ * waits. The waiter yields while the completion is more than
+ * dto_wait_yield_ns away, then sleeps in C0.2 with umwait until
+ * dto_wait_spin_ns before it and busy polls for the rest. Operations that
+ * are late by more than dto_wait_yield_ns yield again. Waits that end in the
+ * spin or umwait phase, which detect the completion precisely, are used to
+ * measure the throughput, and so are yields that detect it before the
+ * predicted time so that a pessimistic prediction is corrected.
+ */
+#define DTO_DEFAULT_WAIT_SPIN_NS 2000
+#define DTO_DEFAULT_WAIT_YIELD_NS 50000
+
+enum wait_phase {
+	WAIT_PHASE_SPIN = 0,
+	WAIT_PHASE_UMWAIT,
+	WAIT_PHASE_YIELD,
+	MAX_WAIT_PHASE
+};
+
+/* WQ selection. With load aware selection each operation goes to the less
+ * loaded of two WQs (power of two choices): the next one in round robin
+ * order and a random other one. The load of a WQ is the time its bytes in
+ * flight plus the new operation would take at the cost per byte observed
+ * on it, scaled up by its recent rate of rejected submissions. Every
+ * DTO_WQ_PROBE_INTERVAL'th selection (on average) takes the round robin WQ
+ * as is, so that the cost of WQs that are being avoided is measured again.
+ * The retry rate of a WQ decays with its successful submissions. To keep the
+ * WQ's cache line from being written by every submission, each thread
+ * decays it once every DTO_WQ_RETRY_DECAY_INTERVAL of its submissions, by
+ * as much as that many EWMA steps, and it is flushed to 0 once negligible.
+ */
+#define DTO_WQ_PROBE_INTERVAL 32
+#define DTO_WQ_RETRY_WEIGHT 4
+#define DTO_WQ_EWMA_WEIGHT 8
+#define DTO_WQ_RETRY_DECAY_INTERVAL 8
+#define DTO_WQ_RETRY_DECAY 0.344f	// (1 - 1 / DTO_WQ_EWMA_WEIGHT) ^ DTO_WQ_RETRY_DECAY_INTERVAL
+#define DTO_WQ_RETRY_MIN_RATE 0.001f
+
+enum wq_selection {
+	WQ_SELECT_RR = 0,
+	WQ_SELECT_LOAD,
+	WQ_SELECT_LAST_ENTRY
+};
+
+static const char * const wq_selection_names[] = {
+	[WQ_SELECT_RR] = "round-robin",
+	[WQ_SELECT_LOAD] = "load"
 };
 
 enum numa_aware {
@@ -109,11 +301,63 @@ static const char * const numa_aware_names[] = {
 	[NA_CPU_CENTRIC] = "cpu-centric"
 };
 
+/* Work submission backends. A backend discovers the WQs (filling wqs[], see
+ * wq_find()) and finds them again when they are rescanned, accepts
+ * descriptors and writes completion records to memory, so the wait methods
+ * and the rest of DTO work the same with any backend.
+ */
+struct dto_backend {
+	const char *name;
+	int (*max_wqs)(void);	// WQs the backend may find, to size the topology
+	int (*init)(void);
+	int (*rescan)(void);
+	int (*submit)(struct dto_wq *wq, struct dsa_hw_desc *hw);
+	void (*cleanup)(void);
+};
+
+static const struct dto_backend dsa_backend;
+static const struct dto_backend emul_backend;
+static const struct dto_backend *dto_backend = &dsa_backend;
+
 // global workqueue variables
-static struct dto_wq wqs[MAX_WQS];
-static struct dto_device* devices[MAX_NUMA_NODES];
-static uint8_t num_wqs;
-static atomic_uchar next_wq;
+static struct dto_wq *wqs;	// dto_max_wqs entries
+static uint32_t dto_max_wqs;
+static int dto_num_nodes;
+static int *wq_scratch;		// for build_stripe_order()
+static struct dto_wq **wq_order;	// for publish_wq_table()
+static uint32_t num_wqs;
+/* DWQs are stored at the end of wqs[], see dwq_at() */
+static uint32_t num_dwqs;
+static char dto_dwq_threads[DTO_DWQ_THREADS_LEN];
+static __thread struct dto_wq *thr_dwq;
+static __thread bool thr_dwq_checked;
+static atomic_uint next_stripe;
+static struct dto_wq_table wq_tables[DTO_WQ_TABLES];
+static struct dto_wq_table *_Atomic wq_table = &wq_tables[0];
+static uint32_t wq_table_gen;
+static uint32_t wq_scan_gen;
+static uint32_t wq_scan_changes;	// WQs added or retired by the current scan
+static pthread_mutex_t wq_rescan_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t wq_rescan_last_ms;
+static bool wq_rescan_enabled;	// DSA offload was configured, see dsa_init()
+static bool wq_rescan_stop;
+static bool dto_no_wqs;	// offload is disabled until a rescan finds a shared WQ
+static uint64_t dto_wq_rescan_ms;	// period of background rescans, 0 - disabled
+static atomic_bool wq_rescan_running;
+
+/* The SWQs are wqs[0..num_wqs) and the DWQs are stored from the end of wqs[].
+ * Both include the retired WQs.
+ */
+static __always_inline struct dto_wq *dwq_at(int i)
+{
+	return &wqs[dto_max_wqs - 1 - i];
+}
+
+/* Index in wqs[] of the i-th of the num_wqs + num_dwqs WQs, SWQs first */
+static __always_inline int wq_index(int i)
+{
+	return i < num_wqs ? i : dto_max_wqs - 1 - (i - num_wqs);
+}
 static atomic_uchar dto_initialized;
 static atomic_uchar dto_initializing;
 static uint8_t use_std_lib_calls;
@@ -121,6 +365,24 @@ static enum numa_aware is_numa_aware;
 static size_t dsa_min_size = DTO_DEFAULT_MIN_SIZE;
 static int wait_method = WAIT_BUSYPOLL;
 static size_t cpu_size_fraction;   // range of values is 0 to 99
+static uint32_t dto_batch_size = DTO_MAX_BATCH_SIZE;
+static size_t dto_stripe_min_size;  // 0 disables striping
+static int dto_max_stripes = DTO_MAX_STRIPES;
+static bool dto_pf_resume = true;
+static size_t dto_bof_min_size;  // 0 disables block on fault
+static bool dto_alloc_offload;
+static size_t dto_alloc_min_size = DTO_DEFAULT_ALLOC_MIN_SIZE;
+static bool dto_alloc_glibc;	// malloc is glibc's, so its chunk headers can be read
+static atomic_ullong pf_table[DTO_PF_TABLE_SIZE];
+static atomic_bool pf_table_used;
+
+static size_t dto_cc_max_size = DTO_DEFAULT_CC_MAX_SIZE;
+static size_t dto_llc_size;
+static int llc_occupancy_fd = -1;
+static atomic_uint llc_checked_ms;
+static atomic_bool llc_pressure;
+static atomic_ullong cc_written[DTO_CC_TABLE_SIZE];
+static atomic_ullong cc_hot[DTO_CC_TABLE_SIZE];
 
 static uint8_t dto_dsa_memcpy = 1;
 static uint8_t dto_dsa_memmove = 1;
@@ -143,6 +405,51 @@ static uint64_t tpause_wait_time = TPAUSE_C02_DELAY_NS;
 
 static unsigned long dto_umwait_delay = UMWAIT_DELAY_DEFAULT;
 
+static uint64_t dto_wait_spin_ns = DTO_DEFAULT_WAIT_SPIN_NS;
+static uint64_t dto_wait_yield_ns = DTO_DEFAULT_WAIT_YIELD_NS;
+static uint64_t wait_spin_cycles;
+static uint64_t wait_yield_cycles;
+static float dto_wait_rate;	// bytes per TSC cycle, 0 until measured
+static __thread uint64_t thr_wait_submit;
+static __thread uint64_t thr_wait_bytes;
+
+static uint8_t dto_wq_selection = WQ_SELECT_LOAD;
+
+/* Submission policy when a WQ is full: retry up to dto_submit_retries times
+ * on the same WQ, pausing DTO_SUBMIT_BACKOFF_PAUSES times before the first
+ * retry and twice as long before each next one, then try the other WQs
+ * (those of the same NUMA node first) if dto_submit_failover is set. Only
+ * then the operation is done on CPU.
+ */
+#define DTO_DEFAULT_SUBMIT_RETRIES 3
+#define DTO_SUBMIT_BACKOFF_PAUSES 32
+#define DTO_MAX_SUBMIT_RETRIES 16
+
+static unsigned int dto_submit_retries = DTO_DEFAULT_SUBMIT_RETRIES;
+static bool dto_submit_failover = true;
+#ifdef DTO_STATS_SUPPORT
+/* counted for the stats of the current operation */
+static __thread unsigned int thr_submit_backoffs;
+static __thread unsigned int thr_submit_failovers;
+#endif
+/* The WQs this thread has bytes in flight on, with the submission time of
+ * the oldest of them. Free entries have no bytes. A thread waits for its
+ * operations (or has at most DTO_ASYNC_MAX_OPS of them in flight), so it
+ * rarely uses more than a few WQs at a time; bytes that don't fit aren't
+ * accounted to the WQ load and mark the WQ untracked.
+ */
+#define DTO_THR_WQS 16
+
+struct dto_thr_wq {
+	struct dto_wq *wq;
+	uint64_t bytes;
+	uint64_t submit;
+};
+
+static __thread struct dto_thr_wq thr_wqs[DTO_THR_WQS];
+static __thread uint32_t thr_wq_seed;
+static __thread uint32_t thr_wq_retry_decay;	// submissions until the next retry rate decay
+
 static uint8_t dto_overlapping_memmove_action = OVERLAPPING_CPU;
 
 static uint8_t fork_handler_registered;
@@ -162,9 +469,66 @@ static const char * const memop_names[] = {
 	[MEMCMP] = "cmp"
 };
 
+/* Other entry points: variants that are routed to the memset, memcpy and
+ * memmove dispatch, the CRC APIs, and the calloc zeroing and realloc copies
+ * that are offloaded. They are counted separately in addition to the memop
+ * stats.
+ */
+enum entry_point {
+	ENTRY_MEMSET_CHK = 0x0,
+	ENTRY_BZERO,
+	ENTRY_EXPLICIT_BZERO,
+	ENTRY_EXPLICIT_BZERO_CHK,
+	ENTRY_WMEMSET,
+	ENTRY_WMEMSET_CHK,
+	ENTRY_MEMCPY_CHK,
+	ENTRY_MEMPCPY,
+	ENTRY_MEMPCPY_CHK,
+	ENTRY_WMEMCPY,
+	ENTRY_WMEMCPY_CHK,
+	ENTRY_MEMMOVE_CHK,
+	ENTRY_BCOPY,
+	ENTRY_WMEMMOVE,
+	ENTRY_WMEMMOVE_CHK,
+	ENTRY_CRC32C,
+	ENTRY_MEMCPY_CRC,
+	ENTRY_CALLOC,
+	ENTRY_REALLOC,
+	MAX_ENTRY,
+};
+
+#ifdef DTO_STATS_SUPPORT
+static const char * const entry_names[] = {
+	[ENTRY_MEMSET_CHK] = "__memset_chk",
+	[ENTRY_BZERO] = "bzero",
+	[ENTRY_EXPLICIT_BZERO] = "explicit_bzero",
+	[ENTRY_EXPLICIT_BZERO_CHK] = "__explicit_bzero_chk",
+	[ENTRY_WMEMSET] = "wmemset",
+	[ENTRY_WMEMSET_CHK] = "__wmemset_chk",
+	[ENTRY_MEMCPY_CHK] = "__memcpy_chk",
+	[ENTRY_MEMPCPY] = "mempcpy",
+	[ENTRY_MEMPCPY_CHK] = "__mempcpy_chk",
+	[ENTRY_WMEMCPY] = "wmemcpy",
+	[ENTRY_WMEMCPY_CHK] = "__wmemcpy_chk",
+	[ENTRY_MEMMOVE_CHK] = "__memmove_chk",
+	[ENTRY_BCOPY] = "bcopy",
+	[ENTRY_WMEMMOVE] = "wmemmove",
+	[ENTRY_WMEMMOVE_CHK] = "__wmemmove_chk",
+	[ENTRY_CRC32C] = "dto_crc32c",
+	[ENTRY_MEMCPY_CRC] = "dto_memcpy_crc",
+	[ENTRY_CALLOC] = "calloc",
+	[ENTRY_REALLOC] = "realloc"
+};
+#endif
+
 // memory stats
-#define HIST_BUCKET_SIZE 4096
-#define HIST_NO_BUCKETS 512
+/* Sizes and latencies are counted in log-linear histograms: each power of
+ * two range is split into HIST_SUB_BUCKETS linear buckets, so a bucket is
+ * at most 1/HIST_SUB_BUCKETS (12.5%) wide relative to its values.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_NO_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
 enum stat_group {
 	STDC_CALL = 0x0,
 	DSA_CALL_SUCCESS,
@@ -185,22 +549,41 @@ enum return_code {
 	RETRY,
 	PAGE_FAULT,
 	FAIL_OTHERS,
+	/* not returned: counted in fail_counter for submissions that were
+	 * retried after a backoff and that failed over to another WQ
+	 */
+	SUBMIT_BACKOFF,
+	SUBMIT_FAILOVER,
 	MAX_FAILURES,
 };
 
+/* fail_counter without SUCCESS is published to shared memory */
+_Static_assert(DTO_SHM_MAX_FAILS == MAX_FAILURES - 1, "DTO_SHM_MAX_FAILS doesn't match the failure reasons");
+
 static const char * const failure_names[] = {
 	[SUCCESS] = "Success",
 	[RETRY] = "Retry",
 	[PAGE_FAULT] = "PFs",
 	[FAIL_OTHERS] = "Others",
+	[SUBMIT_BACKOFF] = "Backoff",
+	[SUBMIT_FAILOVER] = "Failover",
 };
 
 static const char * const wait_names[] = {
 	[WAIT_BUSYPOLL] = "busypoll",
 	[WAIT_UMWAIT] = "umwait",
 	[WAIT_YIELD] = "yield",
-        [WAIT_TPAUSE] = "tpause"
+        [WAIT_TPAUSE] = "tpause",
+	[WAIT_HYBRID] = "hybrid"
+};
+
+#ifdef DTO_STATS_SUPPORT
+static const char * const wait_phase_names[] = {
+	[WAIT_PHASE_SPIN] = "spin",
+	[WAIT_PHASE_UMWAIT] = "umwait",
+	[WAIT_PHASE_YIELD] = "yield"
 };
+#endif
 
 static int collect_stats;
 static char dto_log_path[PATH_MAX];
@@ -231,6 +614,12 @@ static struct timespec dto_start_time;
 		}									\
 	} while (0)									\
 
+#define DTO_COLLECT_ENTRY_STATS(cs, e, n)		\
+	do {						\
+		if (unlikely(cs))			\
+			update_entry_stats(e, n);	\
+	} while (0)					\
+
 #define DTO_COLLECT_STATS_CPU_END(cs, st, et, op, n, orig_n)			\
 	do {									\
 		if (unlikely(cs)) {						\
@@ -242,10 +631,223 @@ static struct timespec dto_start_time;
 		}								\
 	} while (0)								\
 
-static atomic_int op_counter[HIST_NO_BUCKETS][MAX_STAT_GROUP][MAX_MEMOP];
-static atomic_ullong bytes_counter[HIST_NO_BUCKETS][MAX_STAT_GROUP];
-static atomic_ullong lat_counter[HIST_NO_BUCKETS][MAX_STAT_GROUP][MAX_MEMOP];
-static atomic_int fail_counter[HIST_NO_BUCKETS][MAX_FAILURES];
+/* Stats are counted in per-thread shards so that threads don't contend on
+ * shared counters. A shard is merged into dto_stats_total when its thread
+ * exits and then reused by a new thread. print_stats() sums the total and
+ * the live shards.
+ */
+struct dto_stats {
+	struct dto_stats *next;
+	/* per WQ counters, dto_max_wqs of each in one block, see stats_set_wqs() */
+	unsigned long long *wq_descs;
+	unsigned long long *wq_bytes;
+	unsigned long long *wq_retries;
+	unsigned long long op_counter[HIST_NO_BUCKETS][MAX_STAT_GROUP][MAX_MEMOP];
+	unsigned long long bytes_counter[HIST_NO_BUCKETS][MAX_STAT_GROUP];
+	unsigned long long lat_counter[HIST_NO_BUCKETS][MAX_STAT_GROUP][MAX_MEMOP];
+	unsigned long long fail_counter[HIST_NO_BUCKETS][MAX_FAILURES];
+	unsigned long long lat_hist[MAX_STAT_GROUP][MAX_MEMOP][HIST_NO_BUCKETS];
+	unsigned long long pf_resumes;
+	unsigned long long pf_pretouches;
+	unsigned long long pf_dsa_bytes;
+	unsigned long long pf_cpu_bytes;
+	unsigned long long entry_calls[MAX_ENTRY];
+	unsigned long long entry_bytes[MAX_ENTRY];
+	unsigned long long overlap_calls[MAX_STAT_GROUP];
+	unsigned long long overlap_bytes[MAX_STAT_GROUP];
+	unsigned long long cc_ops[MAX_MEMOP][2];
+	unsigned long long cc_bytes[MAX_MEMOP][2];
+	unsigned long long wait_phases[MAX_WAIT_PHASE];
+	unsigned long long wait_cycles[MAX_WAIT_PHASE];
+	/* not a counter, merged by taking the maximum */
+	unsigned long long lat_max[MAX_STAT_GROUP][MAX_MEMOP];
+} __attribute__((aligned(64)));
+
+/* all the counters of a shard, as a flat array */
+#define DTO_STATS_COUNTERS ((offsetof(struct dto_stats, lat_max) - offsetof(struct dto_stats, op_counter)) / \
+				sizeof(unsigned long long))
+
+static struct dto_stats dto_stats_total;
+static struct dto_stats *live_stats;
+static struct dto_stats *free_stats;
+static atomic_flag stats_lock = ATOMIC_FLAG_INIT;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread struct dto_stats *thr_stats;
+
+static int dto_stats_shm;
+static struct dto_shm_stats *shm_stats;
+static char shm_name[NAME_MAX];
+static atomic_bool shm_running;
+
+static void stats_lock_acquire(void)
+{
+	while (atomic_flag_test_and_set_explicit(&stats_lock, memory_order_acquire))
+		_mm_pause();
+}
+
+static void stats_lock_release(void)
+{
+	atomic_flag_clear_explicit(&stats_lock, memory_order_release);
+}
+
+/* Point the per WQ counters of st to block, of DTO_STATS_WQ_COUNTERS */
+#define DTO_STATS_WQ_COUNTERS (3 * (size_t)dto_max_wqs)
+
+static void stats_set_wqs(struct dto_stats *st, unsigned long long *block)
+{
+	st->wq_descs = block;
+	st->wq_bytes = block + dto_max_wqs;
+	st->wq_retries = block + 2 * (size_t)dto_max_wqs;
+}
+
+/* The per WQ counters of the shards that aren't mmap'ed with their block */
+static void stats_alloc_wqs(struct dto_stats *st)
+{
+	void *block;
+
+	if (st->wq_descs != NULL || dto_max_wqs == 0)
+		return;
+
+	block = mmap(NULL, DTO_STATS_WQ_COUNTERS * sizeof(unsigned long long), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (block != MAP_FAILED)
+		stats_set_wqs(st, block);
+}
+
+/* The shards of threads that started before the WQ topology was sized have
+ * no per WQ counters yet. sum_stats() may be reading the shard.
+ */
+static void stats_alloc_thr_wqs(struct dto_stats *st)
+{
+	stats_lock_acquire();
+	stats_alloc_wqs(st);
+	stats_lock_release();
+}
+
+/* Add the counters of src to dst. src is cleared if clear is set. */
+static void merge_stats(struct dto_stats *dst, struct dto_stats *src, bool clear)
+{
+	unsigned long long *d = &dst->op_counter[0][0][0];
+	unsigned long long *s = &src->op_counter[0][0][0];
+
+	for (size_t i = 0; i < DTO_STATS_COUNTERS; i++) {
+		d[i] += s[i];
+		if (clear)
+			s[i] = 0;
+	}
+
+	if (dst->wq_descs != NULL && src->wq_descs != NULL) {
+		for (size_t i = 0; i < DTO_STATS_WQ_COUNTERS; i++) {
+			dst->wq_descs[i] += src->wq_descs[i];
+			if (clear)
+				src->wq_descs[i] = 0;
+		}
+	}
+
+	for (int g = 0; g < MAX_STAT_GROUP; g++) {
+		for (int o = 0; o < MAX_MEMOP; o++) {
+			if (src->lat_max[g][o] > dst->lat_max[g][o])
+				dst->lat_max[g][o] = src->lat_max[g][o];
+			if (clear)
+				src->lat_max[g][o] = 0;
+		}
+	}
+}
+
+static void clear_stats(struct dto_stats *st)
+{
+	unsigned long long *s = &st->op_counter[0][0][0];
+
+	for (size_t i = 0; i < DTO_STATS_COUNTERS; i++)
+		s[i] = 0;
+
+	if (st->wq_descs != NULL) {
+		for (size_t i = 0; i < DTO_STATS_WQ_COUNTERS; i++)
+			st->wq_descs[i] = 0;
+	}
+
+	for (int g = 0; g < MAX_STAT_GROUP; g++)
+		for (int o = 0; o < MAX_MEMOP; o++)
+			st->lat_max[g][o] = 0;
+}
+
+/* Sum up the exited threads and the live shards into st */
+static void sum_stats(struct dto_stats *st)
+{
+	stats_alloc_wqs(st);
+	clear_stats(st);
+	stats_lock_acquire();
+	merge_stats(st, &dto_stats_total, false);
+	for (struct dto_stats *t = live_stats; t != NULL; t = t->next)
+		merge_stats(st, t, false);
+	stats_lock_release();
+}
+
+static void put_thr_stats(void *arg)
+{
+	struct dto_stats *st = arg;
+	struct dto_stats **p;
+
+	stats_lock_acquire();
+	for (p = &live_stats; *p != NULL; p = &(*p)->next) {
+		if (*p == st) {
+			*p = st->next;
+			break;
+		}
+	}
+	stats_alloc_wqs(&dto_stats_total);
+	merge_stats(&dto_stats_total, st, true);
+	st->next = free_stats;
+	free_stats = st;
+	stats_lock_release();
+
+	thr_stats = NULL;
+}
+
+static void create_stats_key(void)
+{
+	pthread_key_create(&stats_key, put_thr_stats);
+}
+
+/* Shards are mmap'ed rather than malloc'ed since this can be called from
+ * within the intercepted mem* APIs.
+ */
+static struct dto_stats *get_thr_stats(void)
+{
+	struct dto_stats *st = thr_stats;
+
+	if (likely(st != NULL))
+		return st;
+
+	pthread_once(&stats_key_once, create_stats_key);
+
+	stats_lock_acquire();
+	st = free_stats;
+	if (st != NULL)
+		free_stats = st->next;
+	stats_lock_release();
+
+	if (st == NULL) {
+		/* the per WQ counters follow the shard */
+		st = mmap(NULL, sizeof(*st) + DTO_STATS_WQ_COUNTERS * sizeof(unsigned long long),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (st == MAP_FAILED)
+			return NULL;
+		if (dto_max_wqs != 0)
+			stats_set_wqs(st, (unsigned long long *)(st + 1));
+	}
+
+	stats_lock_acquire();
+	st->next = live_stats;
+	live_stats = st;
+	stats_lock_release();
+
+	thr_stats = st;
+	pthread_setspecific(stats_key, st);
+
+	return st;
+}
 #endif
 
 /* call initialize/cleanup functions when library is loaded/unloaded */
@@ -253,6 +855,7 @@ static int init_dto(void) __attribute__((constructor));
 static void cleanup_dto(void) __attribute__((destructor));
 
 static int waitpkg_support;
+static int crc32_support;
 
 static enum {
 	LOG_LEVEL_FATAL,
@@ -267,34 +870,100 @@ static enum {
 static unsigned int log_level = LOG_LEVEL_FATAL;
 
 /* Auto tune heuristics magic numbers */
-#define DESCS_PER_RUN 0xF0
-#define NUM_DESCS 16
-#define MIN_AVG_YIELD_WAITS 1.0
-#define MAX_AVG_YIELD_WAITS 2.0
-#define MIN_AVG_POLL_WAITS 5.0
-#define MAX_AVG_POLL_WAITS 20.0
-#define MAX_CPU_SIZE_FRACTION 90  // specified in percent (e.g., 90 is 0.90)
-#define CSF_STEP_INCREMENT 1
-#define CSF_STEP_DECREMENT 1
-#define MAX_DSA_MIN_SIZE 65536
-#define MIN_DSA_MIN_SIZE 6144
-#define DMS_STEP_INCREMENT 1024
-#define DMS_STEP_DECREMENT 1024
-
-/* Auto tuning variables */
-static atomic_ullong num_descs;
-static atomic_ullong adjust_num_descs;
-static atomic_ullong adjust_num_waits;
-/* default waits are for yield because yield is default waiting method */
-static double min_avg_waits = MIN_AVG_YIELD_WAITS;
-static double max_avg_waits = MAX_AVG_YIELD_WAITS;
+/* Auto tuning. The CPU fraction is tuned separately for each memop and
+ * power of two size class. Each thread measures one out of
+ * DTO_TUNE_SAMPLE_INTERVAL of its operations with the TSC: the time the CPU
+ * takes for its part of the job and the time DSA takes for the rest. From
+ * these, the class's CPU and DSA rates are estimated, and the CPU fraction is
+ * set so that both parts complete at the same time. Classes where the whole
+ * operation is slower than doing it on CPU alone are marked cpu_only; one out
+ * of DTO_TUNE_PROBE_INTERVAL of their sampled operations is still offloaded to
+ * keep measuring.
+ */
+#define DTO_TUNE_MIN_SHIFT 12		// smallest size class is 4 KB
+#define DTO_TUNE_CLASSES 20		// last class includes all larger sizes
+#define DTO_TUNE_SAMPLE_INTERVAL 16
+#define DTO_TUNE_PROBE_INTERVAL 16
+#define DTO_TUNE_PROBE_FRACTION 5	// minimum CPU fraction when the CPU rate needs to be measured
+#define DTO_TUNE_HYSTERESIS 10		// in percent, for switching to/from cpu_only
+#define MAX_CPU_SIZE_FRACTION 90	// specified in percent (e.g., 90 is 0.90)
+
+struct dto_tune {
+	uint32_t cpu_fraction;	// in percent
+	bool cpu_only;
+	float cpu_rate;		// bytes per TSC cycle, 0 until measured
+	float dsa_rate;
+	uint64_t samples;
+} __attribute__((aligned(64)));
+
+struct dto_tune_sample {
+	bool active;
+	bool probe;
+	bool dsa_done_first;
+	uint64_t start;
+	uint64_t cpu_end;
+};
+
+static struct dto_tune dto_tune[MAX_MEMOP][DTO_TUNE_CLASSES];
+static __thread struct dto_tune_sample thr_tune;
+
+/* dto_tune is published to shared memory */
+_Static_assert(DTO_SHM_MAX_OP == (int)MAX_MEMOP && DTO_SHM_TUNE_CLASSES == DTO_TUNE_CLASSES &&
+	DTO_SHM_TUNE_MIN_SHIFT == DTO_TUNE_MIN_SHIFT, "dto_tune doesn't match the shared memory layout");
+static __thread uint32_t thr_tune_ops;
+static __thread uint32_t thr_tune_cpu_ops;
 static uint8_t auto_adjust_knobs = 1;
 
+/* Call site policy. With DTO_CALLSITE_POLICY=1 the offload decision is also
+ * learned per call site (the return address of the intercepted function).
+ * One out of DTO_CALLSITE_SAMPLE_INTERVAL operations of a site is timed
+ * with the TSC, including any CPU fallback, to estimate the site's cost per
+ * byte on DSA and on CPU. Sites where DSA costs more than the CPU, or where
+ * more than DTO_CALLSITE_MAX_FAULT_PCT of the offloaded operations fault,
+ * are done on CPU. One out of DTO_CALLSITE_PROBE_INTERVAL samples of a site
+ * uses the path that is currently not chosen, to keep measuring it.
+ * The table is fixed size and open addressed; sites are inserted with a CAS
+ * and never removed. Sites that don't fit use the size based policy only.
+ */
+#define DTO_CALLSITE_TABLE_SIZE 1024	// power of two
+#define DTO_CALLSITE_MAX_PROBES 8
+#define DTO_CALLSITE_SAMPLE_INTERVAL 8
+#define DTO_CALLSITE_PROBE_INTERVAL 8
+#define DTO_CALLSITE_MAX_FAULT_PCT 25
+#define DTO_CALLSITE_MIN_DSA_CALLS 16	// before the fault rate is considered
+
+#define DTO_CALLER __builtin_return_address(0)
+
+struct dto_callsite {
+	_Atomic uintptr_t site;
+	uint8_t op;
+	bool cpu_only;
+	float cpu_cost;		// TSC cycles per byte, 0 until measured
+	float dsa_cost;
+	uint64_t calls;
+	uint64_t dsa_calls;
+	uint64_t faults;
+	uint64_t samples;
+	uint64_t cc_writes;	// operations that went through the adaptive cache control policy
+	uint64_t cc_reused;	// ... whose destination was the source of a call soon after
+} __attribute__((aligned(64)));
+
+struct dto_callsite_sample {
+	struct dto_callsite *cs;
+	bool dsa;
+	uint64_t start;
+	size_t n;
+};
+
+static uint8_t dto_callsite_policy;
+static struct dto_callsite dto_callsites[DTO_CALLSITE_TABLE_SIZE];
+static __thread struct dto_callsite_sample thr_callsite;
+
 extern char *__progname;
 
 static void dto_log(int req_log_level, const char *fmt, ...)
 {
-	char buf[512];
+	char buf[1024];
 	va_list args;
 
 	if (req_log_level > log_level)
@@ -314,21 +983,53 @@ static void dto_log(int req_log_level, const char *fmt, ...)
 static void child (void)
 {
 #ifdef DTO_STATS_SUPPORT
-	int i, j, k;
-
-	/* Reset the counters */
-	for (i = 0; i < HIST_NO_BUCKETS; i++) {
-		for (j = 0; j < MAX_STAT_GROUP; j++) {
-			for (k = 0; k < MAX_MEMOP; k++) {
-				op_counter[i][j][k] = 0;
-				lat_counter[i][j][k] = 0;
-			}
-			bytes_counter[i][j] = 0;
+	struct dto_stats *st, *next;
+
+	/* Reset the counters. Only the calling thread exists in the child,
+	 * so the other threads' shards can be reused.
+	 */
+	atomic_flag_clear(&stats_lock);
+	clear_stats(&dto_stats_total);
+	for (st = live_stats; st != NULL; st = next) {
+		next = st->next;
+		clear_stats(st);
+		if (st != thr_stats) {
+			st->next = free_stats;
+			free_stats = st;
 		}
-		for (j = 0; j < MAX_FAILURES; j++)
-			fail_counter[i][j] = 0;
 	}
+	live_stats = thr_stats;
+	if (thr_stats != NULL)
+		thr_stats->next = NULL;
+
+	/* The publisher thread doesn't exist in the child. init_dto()
+	 * creates a new segment for the child's pid.
+	 */
+	if (shm_stats != NULL) {
+		munmap(shm_stats, sizeof(*shm_stats));
+		shm_stats = NULL;
+	}
+	shm_running = false;
 #endif
+	/* operations in flight in the parent don't complete in the child, and
+	 * DWQ leases are taken again
+	 */
+	for (int j = 0; j < num_wqs + num_dwqs; j++) {
+		int i = wq_index(j);
+
+		wqs[i].inflight = 0;
+		wqs[i].leased = false;
+	}
+	for (int i = 0; i < DTO_THR_WQS; i++)
+		thr_wqs[i].bytes = 0;
+	thr_dwq = NULL;
+	thr_dwq_checked = false;
+
+	/* the rescan thread doesn't exist in the child, and may have held the lock */
+	pthread_mutex_init(&wq_rescan_lock, NULL);
+	wq_rescan_running = false;
+	wq_rescan_enabled = false;
+
 	dto_initializing = 0;
 	dto_initialized = 0;
 	log_fd = -1;
@@ -378,7 +1079,7 @@ static __always_inline void __dsa_wait_umwait(const volatile uint8_t *comp)
 {
 	_umonitor((void*)comp);
 
-        uint64_t delay = _rdtsc() + UMWAIT_DELAY_DEFAULT;
+        uint64_t delay = _rdtsc() + dto_umwait_delay;
 	_umwait(C02_STATE, delay);
 }
 
@@ -389,6 +1090,67 @@ static __always_inline void dsa_wait_umwait(const volatile uint8_t *comp)
         }
 }
 
+static void dsa_wait_hybrid(const volatile uint8_t *comp)
+{
+	uint64_t phase_cycles[MAX_WAIT_PHASE] = {0};
+	uint64_t now, end;
+	int phase = WAIT_PHASE_SPIN;
+
+	if (*comp != 0)
+		return;
+
+	now = _rdtsc();
+	end = dto_wait_rate ? thr_wait_submit + (uint64_t)(thr_wait_bytes / dto_wait_rate) : 0;
+
+	while (*comp == 0) {
+		int64_t remaining = (int64_t)(end - now);
+
+		if (end == 0) {
+			/* nothing measured yet */
+			phase = WAIT_PHASE_SPIN;
+			_mm_pause();
+		} else if (remaining > (int64_t)wait_yield_cycles || -remaining > (int64_t)wait_yield_cycles) {
+			phase = WAIT_PHASE_YIELD;
+			sched_yield();
+		} else if (remaining > (int64_t)wait_spin_cycles && waitpkg_support) {
+			phase = WAIT_PHASE_UMWAIT;
+			_umonitor((void *)comp);
+			if (*comp == 0)
+				_umwait(C02_STATE, end - wait_spin_cycles);
+		} else {
+			phase = WAIT_PHASE_SPIN;
+			_mm_pause();
+		}
+		phase_cycles[phase] += _rdtsc() - now;
+		now = _rdtsc();
+	}
+
+	/* the last phase noticed the completion without delay, or a yield
+	 * noticed it before the predicted time, which was too late then
+	 */
+	if ((phase != WAIT_PHASE_YIELD || (int64_t)(end - now) > 0) && thr_wait_bytes &&
+			now > thr_wait_submit) {
+		float rate = thr_wait_bytes / (float)(now - thr_wait_submit);
+
+		dto_wait_rate = dto_wait_rate ? (3 * dto_wait_rate + rate) / 4 : rate;
+	}
+
+#ifdef DTO_STATS_SUPPORT
+	if (unlikely(collect_stats)) {
+		struct dto_stats *st = get_thr_stats();
+
+		if (st != NULL) {
+			for (int p = 0; p < MAX_WAIT_PHASE; p++) {
+				if (phase_cycles[p]) {
+					++st->wait_phases[p];
+					st->wait_cycles[p] += phase_cycles[p];
+				}
+			}
+		}
+	}
+#endif
+}
+
 static __always_inline void __dsa_wait(const volatile uint8_t *comp)
 {
         switch(wait_method) {
@@ -421,1559 +1183,5735 @@ static __always_inline void dsa_wait_no_adjust(const volatile uint8_t *comp)
         case WAIT_TPAUSE:
             dsa_wait_tpause(comp);
             break;
+        case WAIT_HYBRID:
+            dsa_wait_hybrid(comp);
+            break;
         default:
             dsa_wait_busy_poll(comp);
     }
 }
 
-/* A simple auto-tuning heuristic.
- * Goal of the Heuristic:
- *   - CPU and DSA should complete their fraction of the job roughly simultaneously.
- *     This minimizes the thread's wait time for DSA while maximizing DSA utilization
- *  Approximating the goal:
- *   - Threads waiting for DSA completion (e.g., by yielding), keep avg. no. of
- *     waits (i.e., yields) between min_avg_waits and max_avg_waits
- *     (see local_num_waits variable below)
- * Heuristic
- *   1) Sample number of waits (local_num_waits) for NUM_DESCS descriptors
- *   every DESCS_PER_RUN descriptors
- *   2) If the avg. number of waits per descriptor > max_avg_waits, decrease load on DSA
- *      - If cpu_size_fraction not too high, increase it by CSF_STEP_INCREMENT
- *      - else if dsa_min_size not too high, increase it by DMS_STEP_INCREMENT
- *   3) If the avg. number of waits per descriptor < min_avg_waits, increase load on DSA
- *      - If cpu_size_fraction not too low, decrease it by CSF_STEP_DECREMENT
- *      - else if dsa_min_size not too low, decrease it by DMS_STEP_DECREMENT
- */
-static __always_inline void dsa_wait_and_adjust(const volatile uint8_t *comp)
-{
-	uint64_t local_num_waits = 0;
-
-	if ((++num_descs & DESCS_PER_RUN) != DESCS_PER_RUN) {
-		while (*comp == 0) {
-			__dsa_wait(comp);
-                }
+static __always_inline int tune_class(size_t n)
+{
+	int c = 63 - __builtin_clzll(n | 1) - DTO_TUNE_MIN_SHIFT;
 
-		return;
-	}
+	if (c < 0)
+		return 0;
+	return c < DTO_TUNE_CLASSES ? c : DTO_TUNE_CLASSES - 1;
+}
 
-	/* Run the heuristics as well as wait for DSA */
-	while (*comp == 0) {
-		__dsa_wait(comp);
-		local_num_waits++;
-	}
+/* Returns true if the operation should be done on CPU only */
+static __always_inline bool tune_use_cpu(int op, size_t n)
+{
+	if (!auto_adjust_knobs || !dto_tune[op][tune_class(n)].cpu_only)
+		return false;
 
-	// operations that have failed (mostly due to page fault) return very quickly and cause the algorithm
-	// to think that the DSA operation was faster than it really was. We exclude them from the calculation.
-	if (*comp != DSA_COMP_SUCCESS) {
-		return;
-	}
+	if (++thr_tune_cpu_ops % (DTO_TUNE_SAMPLE_INTERVAL * DTO_TUNE_PROBE_INTERVAL))
+		return true;
+
+	/* offload this one to see whether DSA has become faster */
+	thr_tune.probe = true;
+	return false;
+}
 
-	adjust_num_descs++;
-	adjust_num_waits += local_num_waits;
+/* Returns the CPU fraction (in percent) for an operation, and starts
+ * measuring it if it is sampled.
+ */
+static __always_inline size_t tune_cpu_fraction(int op, size_t n)
+{
+	struct dto_tune *t;
 
-	if (adjust_num_descs >= NUM_DESCS) {
-		unsigned long long temp = adjust_num_descs;
+	if (!auto_adjust_knobs)
+		return cpu_size_fraction;
 
-		if (temp && atomic_compare_exchange_strong(&adjust_num_descs, &temp, 0)) {
-			double avg_num_waits = (double)adjust_num_waits / temp;
+	t = &dto_tune[op][tune_class(n)];
+	if (likely(!thr_tune.probe && ++thr_tune_ops % DTO_TUNE_SAMPLE_INTERVAL))
+		return t->cpu_fraction;
 
-			adjust_num_waits = 0;
-			if (avg_num_waits > max_avg_waits) {
-				if (cpu_size_fraction < MAX_CPU_SIZE_FRACTION)
-					cpu_size_fraction += CSF_STEP_INCREMENT;
-				else if (dsa_min_size < MAX_DSA_MIN_SIZE)
-					dsa_min_size += DMS_STEP_INCREMENT;
-			} else if (avg_num_waits < min_avg_waits) {
-				if (cpu_size_fraction >= CSF_STEP_DECREMENT)
-					cpu_size_fraction -= CSF_STEP_DECREMENT;
-				else if (dsa_min_size > MIN_DSA_MIN_SIZE)
-					dsa_min_size -= DMS_STEP_DECREMENT;
-			}
-		}
+	thr_tune.active = true;
+	thr_tune.dsa_done_first = false;
+	thr_tune.cpu_end = 0;
+	thr_tune.start = _rdtsc();
+
+	if ((thr_tune.probe || t->cpu_rate == 0) && t->cpu_fraction < DTO_TUNE_PROBE_FRACTION)
+		return DTO_TUNE_PROBE_FRACTION;
+	return t->cpu_fraction;
+}
+
+/* The CPU part of the operation is done. dsa_done tells if DSA already completed */
+static __always_inline void tune_cpu_done(bool dsa_done)
+{
+	if (unlikely(thr_tune.active)) {
+		thr_tune.cpu_end = _rdtsc();
+		thr_tune.dsa_done_first = dsa_done;
 	}
 }
 
-static __always_inline int dsa_wait(struct dto_wq *wq,
-	struct dsa_hw_desc *hw, volatile uint8_t *comp)
+/* Update the size class of a sampled operation of n bytes. The measured part
+ * of the operation did cpu_bytes on CPU and dsa_bytes on DSA.
+ */
+static void tune_update(int op, size_t n, size_t cpu_bytes, size_t dsa_bytes, int result)
 {
-	if (auto_adjust_knobs)
-		dsa_wait_and_adjust(comp);
-	else
-		dsa_wait_no_adjust(comp);
+	struct dto_tune *t = &dto_tune[op][tune_class(n)];
+	uint64_t end = _rdtsc();
+	float rate, time, cpu_time;
+	uint32_t fraction;
 
-	if (likely(*comp == DSA_COMP_SUCCESS)) {
-		thr_bytes_completed += hw->xfer_size;
-		return SUCCESS;
-	} else if ((*comp & DSA_COMP_STATUS_MASK) == DSA_COMP_PAGE_FAULT_NOBOF) {
-		thr_bytes_completed += thr_comp.bytes_completed;
-		return PAGE_FAULT;
+	thr_tune.active = false;
+	thr_tune.probe = false;
+
+	// operations that have failed (mostly due to page fault) return very quickly and would make
+	// DSA look faster than it really is. We exclude them.
+	if (result != SUCCESS || dsa_bytes == 0 || end <= thr_tune.start)
+		return;
+
+	if (cpu_bytes && thr_tune.cpu_end > thr_tune.start) {
+		rate = cpu_bytes / (float)(thr_tune.cpu_end - thr_tune.start);
+		t->cpu_rate = t->cpu_rate ? (3 * t->cpu_rate + rate) / 4 : rate;
 	}
-	LOG_ERROR("failed status %x xfersz %x\n", *comp, hw->xfer_size);
-	return FAIL_OTHERS;
+	if (t->cpu_rate == 0)
+		return;
+
+	if (thr_tune.dsa_done_first) {
+		/* Only a lower bound of the DSA rate is known. Assume DSA is
+		 * twice as fast so the fraction converges in a few samples.
+		 */
+		rate = 2 * dsa_bytes / (float)(thr_tune.cpu_end - thr_tune.start);
+	} else {
+		rate = dsa_bytes / (float)(end - thr_tune.start);
+	}
+	t->dsa_rate = t->dsa_rate ? (t->dsa_rate + rate) / 2 : rate;
+
+	/* CPU and DSA complete at the same time when the CPU does cpu_rate / (cpu_rate + dsa_rate) of the job */
+	fraction = (uint32_t)(100 * t->cpu_rate / (t->cpu_rate + t->dsa_rate));
+	t->cpu_fraction = fraction < MAX_CPU_SIZE_FRACTION ? fraction : MAX_CPU_SIZE_FRACTION;
+
+	/* offloading pays off if the operation took less time than the CPU alone would */
+	time = end - thr_tune.start;
+	cpu_time = (cpu_bytes + dsa_bytes) / t->cpu_rate;
+	if (t->cpu_only)
+		t->cpu_only = time * (100 + DTO_TUNE_HYSTERESIS) > cpu_time * 100;
+	else
+		t->cpu_only = time * 100 > cpu_time * (100 + DTO_TUNE_HYSTERESIS);
+	t->samples++;
 }
 
-static __always_inline int dsa_submit(struct dto_wq *wq,
-	struct dsa_hw_desc *hw)
+static void init_tune(void)
 {
-	int ret;
-	//LOG_TRACE("desc flags: 0x%x, opcode: 0x%x\n", hw->flags, hw->opcode);
-	__builtin_ia32_sfence();
+	for (int op = 0; op < MAX_MEMOP; op++) {
+		for (int c = 0; c < DTO_TUNE_CLASSES; c++) {
+			dto_tune[op][c].cpu_fraction = cpu_size_fraction;
+			dto_tune[op][c].cpu_only = false;
+			dto_tune[op][c].cpu_rate = 0;
+			dto_tune[op][c].dsa_rate = 0;
+			dto_tune[op][c].samples = 0;
+		}
+	}
+}
 
-	if (wq->wq_mmapped) {
-		ret = enqcmd(hw, wq->wq_portal);
-		if (!ret)
-			return SUCCESS;
-	} else {
-		ret = write(wq->wq_fd, hw, sizeof(*hw));
-		if (ret == sizeof(*hw))
-			return SUCCESS;
-		else
-			return FAIL_OTHERS;
+static struct dto_callsite *callsite_lookup(const void *caller, int op)
+{
+	uintptr_t site = (uintptr_t)caller;
+	uint32_t h = (uint32_t)((site * 0x9E3779B97F4A7C15ULL) >> 32);
+
+	for (int i = 0; i < DTO_CALLSITE_MAX_PROBES; i++) {
+		struct dto_callsite *cs = &dto_callsites[(h + i) & (DTO_CALLSITE_TABLE_SIZE - 1)];
+		uintptr_t cur = atomic_load_explicit(&cs->site, memory_order_acquire);
+
+		if (cur == site)
+			return cs;
+		if (cur == 0) {
+			if (atomic_compare_exchange_strong(&cs->site, &cur, site)) {
+				cs->op = op;
+				return cs;
+			}
+			if (cur == site)
+				return cs;
+		}
 	}
-	return RETRY;
+	return NULL;
 }
 
-static __always_inline int dsa_execute(struct dto_wq *wq,
-	struct dsa_hw_desc *hw, volatile uint8_t *comp)
+/* Returns true if the operation of n bytes called from caller should be done
+ * on CPU according to the call site's policy. The operation is tracked until
+ * callsite_done().
+ */
+static __always_inline bool callsite_use_cpu(const void *caller, int op, size_t n)
 {
-	int ret;
-	*comp = 0;
-	//LOG_TRACE("desc flags: 0x%x, opcode: 0x%x\n", hw->flags, hw->opcode);
-	__builtin_ia32_sfence();
+	struct dto_callsite *cs = callsite_lookup(caller, op);
+	bool use_cpu;
 
-	if (wq->wq_mmapped)
-		ret = enqcmd(hw, wq->wq_portal);
+	if (cs == NULL)
+		return false;
 
-	else {
-		ret = write(wq->wq_fd, hw, sizeof(*hw));
-		if (ret != sizeof(*hw))
-			return FAIL_OTHERS;
-		else
-			ret = 0;
+	/* the counters are updated without atomics, they only need to be approximate */
+	use_cpu = cs->cpu_only;
+	thr_callsite.start = 0;
+	if (unlikely(++cs->calls % DTO_CALLSITE_SAMPLE_INTERVAL == 0)) {
+		if (cs->cpu_cost == 0)
+			use_cpu = true;
+		else if (cs->dsa_cost == 0)
+			use_cpu = false;
+		else if (++cs->samples % DTO_CALLSITE_PROBE_INTERVAL == 0)
+			use_cpu = !use_cpu;
+		thr_callsite.n = n;
+		thr_callsite.start = _rdtsc();
 	}
-	if (!ret) {
-		dsa_wait_no_adjust(comp);
 
-		if (*comp == DSA_COMP_SUCCESS) {
-			thr_bytes_completed += hw->xfer_size;
-			return SUCCESS;
-		} else if ((*comp & DSA_COMP_STATUS_MASK) == DSA_COMP_PAGE_FAULT_NOBOF) {
-			thr_bytes_completed += thr_comp.bytes_completed;
-			return PAGE_FAULT;
-		}
-		LOG_ERROR("failed status %x xfersz %x\n", *comp, hw->xfer_size);
-		return FAIL_OTHERS;
+	if (!use_cpu) {
+		cs->dsa_calls++;
+		thr_fault_addr = 0;
 	}
-	return RETRY;
+	thr_callsite.cs = cs;
+	thr_callsite.dsa = !use_cpu;
+	return use_cpu;
 }
 
-#ifdef DTO_STATS_SUPPORT
-static void update_stats(int op, size_t n, bool overlapping, size_t bytes_completed,
-		uint64_t elapsed_ns, int group, int error_code)
+static __always_inline void callsite_done(void)
 {
-	// dto_memcpymove didn't actually submit the request to DSA, so there is nothing to log. This will be captured by a second call
-	if (op == MEMMOVE && overlapping && dto_overlapping_memmove_action == OVERLAPPING_CPU && group == DSA_CALL_SUCCESS) {
+	struct dto_callsite *cs = thr_callsite.cs;
+	float cost;
+
+	if (likely(cs == NULL))
 		return;
-	}
+	thr_callsite.cs = NULL;
 
-	int bucket = (n / HIST_BUCKET_SIZE);
+	if (thr_callsite.dsa && thr_fault_addr)
+		cs->faults++;
 
-	if (bucket >= HIST_NO_BUCKETS)  /* last bucket includes remaining sizes */
-		bucket = HIST_NO_BUCKETS-1;
-	++op_counter[bucket][group][op];
-	bytes_counter[bucket][group] += bytes_completed;
-	lat_counter[bucket][group][op] += elapsed_ns;
-	if (group == DSA_CALL_FAILED)
-		++fail_counter[bucket][error_code];
+	if (thr_callsite.start == 0)
+		return;
 
+	cost = (_rdtsc() - thr_callsite.start) / (float)thr_callsite.n;
+	if (thr_callsite.dsa)
+		cs->dsa_cost = cs->dsa_cost ? (3 * cs->dsa_cost + cost) / 4 : cost;
+	else
+		cs->cpu_cost = cs->cpu_cost ? (3 * cs->cpu_cost + cost) / 4 : cost;
+
+	if (cs->dsa_calls >= DTO_CALLSITE_MIN_DSA_CALLS &&
+		cs->faults * 100 > cs->dsa_calls * DTO_CALLSITE_MAX_FAULT_PCT) {
+		cs->cpu_only = true;
+		return;
+	}
+	if (cs->cpu_cost == 0 || cs->dsa_cost == 0)
+		return;
+
+	/* same hysteresis as the size based policy */
+	if (cs->cpu_only)
+		cs->cpu_only = cs->dsa_cost * (100 + DTO_TUNE_HYSTERESIS) > cs->cpu_cost * 100;
+	else
+		cs->cpu_only = cs->dsa_cost * 100 > cs->cpu_cost * (100 + DTO_TUNE_HYSTERESIS);
 }
 
-static void print_stats(void)
+/* Log the learned decision of each call site, with the call site symbolized */
+static void print_callsites(void)
 {
-	struct timespec dto_end_time;
+	LOG_TRACE("\n******** Call Site Policy ********\n");
+	LOG_TRACE("%-48s %-4s %-12s %-12s %-10s %-12s %-12s %-8s\n", "Call site", "Op", "Calls",
+		"DSA calls", "Faults", "cpu cyc/B", "dsa cyc/B", "Policy");
 
-	if (likely(!collect_stats))
-		return;
+	for (int i = 0; i < DTO_CALLSITE_TABLE_SIZE; i++) {
+		struct dto_callsite *cs = &dto_callsites[i];
+		uintptr_t site = atomic_load(&cs->site);
+		char name[128];
+		Dl_info info;
 
-	clock_gettime(CLOCK_BOOTTIME, &dto_end_time);
+		if (site == 0 || cs->calls == 0)
+			continue;
 
-	LOG_TRACE("DTO Run Time: %ld ms\n", TS_NS(dto_start_time, dto_end_time)/1000000);
+		if (dladdr((void *)site, &info) && info.dli_sname != NULL)
+			snprintf(name, sizeof(name), "%s+0x%lx", info.dli_sname,
+				site - (uintptr_t)info.dli_saddr);
+		else if (info.dli_fname != NULL)
+			snprintf(name, sizeof(name), "%s+0x%lx", basename(info.dli_fname),
+				site - (uintptr_t)info.dli_fbase);
+		else
+			snprintf(name, sizeof(name), "0x%lx", site);
 
-	// display stats
-	for (int t = 0; t < 2; ++t) {
-		if (t == 0)
-			LOG_TRACE("\n******** Number of Memory Operations ********\n");
-		else
-			LOG_TRACE("\n******** Average Memory Operation Latency (us)  ********\n");
-
-		LOG_TRACE("%17s    ", "");
-		for (int g = 0; g < MAX_STAT_GROUP; ++g) {
-			if (t == 0) {
-				if (g == DSA_FAIL_CODES)
-					LOG_TRACE("<***** %-13s *****> ", stat_group_names[g]);
-				else
-					LOG_TRACE("<*************** %-13s ***************> ", stat_group_names[g]);
-			} else {
-				if (g != DSA_FAIL_CODES)
-					LOG_TRACE("<******** %-13s ********> ", stat_group_names[g]);
-
-			}
-		}
-		LOG_TRACE("\n");
-
-		LOG_TRACE("%-17s -- ", "Byte Range");
-		for (int g = 0; g < MAX_STAT_GROUP - 1; ++g) {
-			for (int o = 0; o < MAX_MEMOP; ++o)
-				LOG_TRACE("%-8s ", memop_names[o]);
-			if (t == 0)
-				LOG_TRACE("%-12s ", "bytes");
-		}
-		if (t == 0)
-			for (int o = 1; o < MAX_FAILURES; ++o)
-				LOG_TRACE("%-6s ", failure_names[o]);
-		LOG_TRACE("\n");
-
-		for (int b = 0; b < HIST_NO_BUCKETS; ++b) {
-			bool empty = true;
+		LOG_TRACE("%-48s %-4s %-12lu %-12lu %-10lu %-12.3f %-12.3f %-8s\n", name, memop_names[cs->op],
+			cs->calls, cs->dsa_calls, cs->faults, cs->cpu_cost, cs->dsa_cost,
+			cs->cpu_only ? "cpu" : "dsa");
+	}
+}
 
-			for (int g = 0; g < MAX_STAT_GROUP; ++g) {
-				for (int o = 0; o < MAX_MEMOP; ++o) {
-					if (op_counter[b][g][o] != 0) {
-						empty = false;
-						break;
-					}
-				}
-				if (!empty)
-					break;
-			}
-			if (empty)
-				continue;
+/* Bytes processed by a descriptor, or by all descriptors of a batch */
+static __always_inline uint64_t desc_bytes(const struct dsa_hw_desc *hw)
+{
+	const struct dsa_hw_desc *list;
+	uint64_t bytes = 0;
 
-			if (b < (HIST_NO_BUCKETS-1))
-				LOG_TRACE("% 8d-%-8d -- ", b*4096, ((b+1)*4096)-1);
-			else
-				LOG_TRACE("   >=%-12d -- ", b*4096);
+	if (hw->opcode != DSA_OPCODE_BATCH)
+		return hw->xfer_size;
 
-			for (int g = 0; g < MAX_STAT_GROUP - 1; ++g) {
-				for (int o = 0; o < MAX_MEMOP; ++o) {
-					if (t == 0) {
-						LOG_TRACE("%-8d ", op_counter[b][g][o]);
-						continue;
-					}
-					if (op_counter[b][g][o] != 0) {
-						double avg_us = ((double) lat_counter[b][g][o])/(((double) op_counter[b][g][o]) * 1000.0);
+	list = (const struct dsa_hw_desc *)hw->desc_list_addr;
+	for (uint32_t i = 0; i < hw->desc_count; i++)
+		bytes += list[i].xfer_size;
+	return bytes;
+}
 
-						LOG_TRACE("%-8.2f ", avg_us);
-					} else {
-						LOG_TRACE("%-8d ", 0);
-					}
-				}
-				if (t == 0)
-					LOG_TRACE("%-12lld ", bytes_counter[b][g]);
-			}
-			if (t == 0)
-				for (int o = 1; o < MAX_FAILURES; ++o)
-					LOG_TRACE("%-6d ", fail_counter[b][o]);
-			LOG_TRACE("\n");
+/* A batch counts as one descriptor */
+static __always_inline void update_wq_stats(struct dto_wq *wq, const struct dsa_hw_desc *hw)
+{
+#ifdef DTO_STATS_SUPPORT
+	if (unlikely(collect_stats)) {
+		struct dto_stats *st = get_thr_stats();
+
+		if (st != NULL && unlikely(st->wq_descs == NULL))
+			stats_alloc_thr_wqs(st);
+		if (st != NULL && st->wq_descs != NULL) {
+			++st->wq_descs[wq - wqs];
+			st->wq_bytes[wq - wqs] += desc_bytes(hw);
 		}
 	}
-}
 #endif
+}
 
-#define DTO_MAX_PARAM_LEN 16
-static void dto_get_param_string(int dir_fd, char *path, char *out)
+static __always_inline void update_wq_retry_stats(struct dto_wq *wq)
 {
-	int fd;
-	char buffer[DTO_MAX_PARAM_LEN];
-	int bytes;
-
-	out[0] = '\0';
-	fd = openat(dir_fd, path, O_RDONLY);
-
-	if (fd < 0)
-		return;
-
-	bytes = read(fd, buffer, DTO_MAX_PARAM_LEN - 1);
+#ifdef DTO_STATS_SUPPORT
+	if (unlikely(collect_stats)) {
+		struct dto_stats *st = get_thr_stats();
 
-	if (bytes <= 0) {
-		close(fd);
-		return;
+		if (st != NULL && unlikely(st->wq_descs == NULL))
+			stats_alloc_thr_wqs(st);
+		if (st != NULL && st->wq_descs != NULL)
+			++st->wq_retries[wq - wqs];
 	}
-
-	if (buffer[bytes - 1] == '\n')
-		buffer[bytes - 1] = '\0';
-	else
-		buffer[bytes] = '\0';
-
-	strncpy(out, buffer, DTO_MAX_PARAM_LEN);
-	close(fd);
+#endif
 }
 
-static unsigned long long dto_get_param_ullong(int dir_fd, char *path, int *err)
+/* Account a successful submission of bytes to wq, started at TSC start
+ * (0 unless the WQ selection is load aware), to the bytes in flight on wq
+ */
+static __always_inline void wq_load_submit(struct dto_wq *wq, uint64_t bytes, uint64_t start)
 {
-	int fd;
-	char buffer[DTO_MAX_PARAM_LEN];
-	int bytes;
-	unsigned long long val;
+	struct dto_thr_wq *e = NULL;
 
-	fd = openat(dir_fd, path, O_RDONLY);
+	if (unlikely(wq->retry_rate != 0) && thr_wq_retry_decay++ % DTO_WQ_RETRY_DECAY_INTERVAL == 0) {
+		float rate = wq->retry_rate * DTO_WQ_RETRY_DECAY;
 
-	if (fd < 0) {
-		*err = -errno;
-		return -errno;
+		wq->retry_rate = rate < DTO_WQ_RETRY_MIN_RATE ? 0 : rate;
 	}
 
-	bytes = read(fd, buffer, DTO_MAX_PARAM_LEN - 1);
+	for (int i = 0; i < DTO_THR_WQS; i++) {
+		if (thr_wqs[i].bytes == 0) {
+			if (e == NULL)
+				e = &thr_wqs[i];
+		} else if (thr_wqs[i].wq == wq) {
+			e = &thr_wqs[i];
+			break;
+		}
+	}
+	if (bytes == 0)
+		return;
+	if (unlikely(e == NULL)) {
+		if (!wq->untracked)
+			wq->untracked = true;
+		return;
+	}
 
-	if (bytes <= 0) {
-		*err = -errno;
-		close(fd);
-		return -errno;
+	if (e->bytes == 0) {
+		e->wq = wq;
+		e->submit = start;
 	}
+	e->bytes += bytes;
+	atomic_fetch_add_explicit(&wq->inflight, bytes, memory_order_relaxed);
+}
 
-	errno = 0;
-	val = strtoull(buffer, NULL, 0);
+/* Called once the thread has waited for a submission to wq. All bytes the
+ * thread has in flight on wq are released (with the async API one wait may
+ * release a few operations early), and with load aware WQ selection the time
+ * since the oldest of them was submitted updates the cost per byte of wq.
+ */
+static __always_inline void wq_load_done(struct dto_wq *wq)
+{
+	struct dto_thr_wq *e = NULL;
+	uint64_t bytes;
+	float cost;
 
-	*err = -errno;
-	close(fd);
+	for (int i = 0; i < DTO_THR_WQS; i++) {
+		if (thr_wqs[i].wq == wq && thr_wqs[i].bytes != 0) {
+			e = &thr_wqs[i];
+			break;
+		}
+	}
+	if (e == NULL)
+		return;
 
-	return val;
+	bytes = e->bytes;
+	e->bytes = 0;
+	atomic_fetch_sub_explicit(&wq->inflight, bytes, memory_order_relaxed);
+	if (dto_wq_selection != WQ_SELECT_LOAD)
+		return;
+
+	cost = (float)(_rdtsc() - e->submit) / bytes;
+	if (wq->cost == 0)
+		wq->cost = cost;
+	else
+		wq->cost += (cost - wq->cost) / DTO_WQ_EWMA_WEIGHT;
 }
 
-static struct dto_device* get_dto_device(int dev_numa_node) {
-	struct dto_device* dev = NULL;
+static __always_inline int dsa_wait(struct dto_wq *wq,
+	struct dsa_hw_desc *hw, struct dsa_completion_record *comp)
+{
+	dsa_wait_no_adjust(&comp->status);
+	wq_load_done(wq);
 
-	if (devices[dev_numa_node] == NULL) {
-		dev = calloc(1, sizeof(struct dto_device));
-		devices[dev_numa_node] = dev;
-	} else {
-		dev = devices[dev_numa_node];
+	if (likely(comp->status == DSA_COMP_SUCCESS)) {
+		thr_bytes_completed += hw->xfer_size;
+		return SUCCESS;
+	} else if ((comp->status & DSA_COMP_STATUS_MASK) == DSA_COMP_PAGE_FAULT_NOBOF) {
+		thr_bytes_completed += comp->bytes_completed;
+		thr_fault_addr = comp->fault_addr;
+		return PAGE_FAULT;
 	}
-
-	return dev;
+	LOG_ERROR("failed status %x xfersz %x\n", comp->status, hw->xfer_size);
+	return FAIL_OTHERS;
 }
 
-static void correct_devices_list() {
-	struct dto_device* dev = NULL;
-	for (uint8_t i = 0; i < MAX_NUMA_NODES; i++) {
-		if (devices[i] != NULL) {
-			dev = devices[i];
-		} else {
-			devices[i] = dev;
+/* Submit a descriptor to a DSA WQ portal (or through write() if the
+ * driver doesn't support mmap of the portal).
+ */
+static __always_inline int dsa_portal_submit(struct dto_wq *wq,
+	struct dsa_hw_desc *hw)
+{
+	int ret;
+
+	if (wq->wq_mmapped) {
+		/* occupancy of DWQs is tracked by dsa_submit_once() */
+		if (wq->dedicated) {
+			movdir64b(hw, wq->wq_portal);
+			return SUCCESS;
 		}
+		ret = enqcmd(hw, wq->wq_portal);
+		if (!ret)
+			return SUCCESS;
+	} else {
+		ret = write(wq->wq_fd, hw, sizeof(*hw));
+		if (ret == sizeof(*hw))
+			return SUCCESS;
+		else
+			return FAIL_OTHERS;
 	}
+	return RETRY;
 }
 
-static __always_inline  int get_numa_node(void* buf) {
-	int numa_node = -1;
-
-	switch (is_numa_aware) {
-        case NA_BUFFER_CENTRIC: {
-			if (buf != NULL) {
-				int status[1] = {-1};
+/* Check if a DWQ has room for a descriptor that writes its completion
+ * record to status. The completion records of descriptors that completed
+ * are dropped from the pending list, and so are entries of status itself:
+ * the caller doesn't reuse a completion record whose descriptor is still
+ * in flight, so these descriptors have completed and status was reset.
+ * Records that are reused within a batch are dropped by dwq_add_pending().
+ */
+static bool dwq_has_room(struct dto_wq *wq, const volatile uint8_t *status)
+{
+	uint32_t size = wq->wq_size < DTO_DWQ_MAX_SIZE ? wq->wq_size : DTO_DWQ_MAX_SIZE;
+	uint32_t n = 0;
 
-				// get numa node of memory pointed by buf
-				if (move_pages(0, 1, &buf, NULL, status, 0) == 0) {
-					numa_node = status[0];
-				} else {
-					LOG_ERROR("move_pages call error: %d - %s", errno, strerror(errno));
-				}
+	if (wq->num_pending < size)
+		return true;
 
-				// alternatively get_mempolicy can be used
-				// if (get_mempolicy(&numa_node, NULL, 0, (void *)buf, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
-				// 	LOG_ERROR("get_mempolicy call error: %d - %s", errno, strerror(errno));
-				// }
-			} else {
-				LOG_ERROR("NULL buffer delivered. Unable to detect numa node");
-			}
-		}
-		break;
-		case NA_CPU_CENTRIC: {
-			const int cpu = sched_getcpu();
-			if (cpu != -1) {
-				numa_node = numa_node_of_cpu(sched_getcpu());
-			}
-			else {
-				LOG_ERROR("sched_getcpu call error: %d - %s", errno, strerror(errno));
-			}
-		}
-		break;
-        default:
-		break;
-        }
+	for (uint32_t i = 0; i < wq->num_pending; i++) {
+		if (*wq->pending[i] == 0 && wq->pending[i] != status)
+			wq->pending[n++] = wq->pending[i];
+	}
+	wq->num_pending = n;
 
-        return numa_node;
+	return n < size;
 }
 
-static void cleanup_devices() {
-	struct dto_device* dev = NULL;
-	for (uint i = 0; i < MAX_NUMA_NODES; i++) {
-		if (devices[i] != dev) {
-			dev = devices[i];
-			free(devices[i]);
+/* Add the completion record of hw, submitted to a DWQ, to the pending list.
+ * A record that was submitted on its own and is then reset for a descriptor
+ * of a batch wouldn't be written again, so the entries of the batch's records
+ * are dropped. The records of a batch are contiguous.
+ */
+static void dwq_add_pending(struct dto_wq *wq, const struct dsa_hw_desc *hw,
+	const volatile uint8_t *status)
+{
+	if (hw->opcode == DSA_OPCODE_BATCH) {
+		const struct dsa_hw_desc *list = (const struct dsa_hw_desc *)hw->desc_list_addr;
+		uintptr_t lo = UINTPTR_MAX, hi = 0;
+		uint32_t n = 0;
+
+		for (uint32_t i = 0; i < hw->desc_count; i++) {
+			if (list[i].completion_addr < lo)
+				lo = list[i].completion_addr;
+			if (list[i].completion_addr > hi)
+				hi = list[i].completion_addr;
+		}
+		for (uint32_t i = 0; i < wq->num_pending; i++) {
+			uintptr_t addr = (uintptr_t)wq->pending[i];
+
+			if (addr < lo || addr > hi)
+				wq->pending[n++] = wq->pending[i];
 		}
-		devices[i] = NULL;
+		wq->num_pending = n;
 	}
+	wq->pending[wq->num_pending++] = status;
 }
 
-static bool test_write_syscall(struct dto_wq *wq)
+/* One submission attempt of hw to wq */
+static __always_inline int dsa_submit_once(struct dto_wq *wq,
+	struct dsa_hw_desc *hw)
 {
-	struct dsa_hw_desc desc = {0};
-	struct dsa_completion_record comp __attribute__((aligned(32)));
-	int retry = 0;
-
-	desc.opcode = DSA_OPCODE_NOOP;
-	desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
-	comp.status = 0;
-
-	desc.completion_addr = (unsigned long)&comp;
+	const volatile uint8_t *status = (const volatile uint8_t *)hw->completion_addr;
+	int ret;
 
-	if (dsa_submit(wq, &desc) == SUCCESS) {
-		while (comp.status == 0 && retry++ < 10000)
-			_mm_pause();
+	/* a full DWQ would drop the descriptor */
+	if (unlikely(wq->dedicated) && !dwq_has_room(wq, status)) {
+		update_wq_retry_stats(wq);
+		return RETRY;
+	}
 
-		if (comp.status == DSA_COMP_SUCCESS)
-			return true;
+	/* keep the hardware submission path inlined */
+	if (likely(dto_backend == &dsa_backend))
+		ret = dsa_portal_submit(wq, hw);
+	else
+		ret = dto_backend->submit(wq, hw);
+
+	if (ret == SUCCESS) {
+		if (unlikely(wq->dedicated))
+			dwq_add_pending(wq, hw, status);
+		update_wq_stats(wq, hw);
+	} else if (ret == RETRY) {
+		if (dto_wq_selection == WQ_SELECT_LOAD)
+			wq->retry_rate += (1.0f - wq->retry_rate) / DTO_WQ_EWMA_WEIGHT;
+		update_wq_retry_stats(wq);
 	}
 
-	return false;
+	return ret;
 }
 
-static int dsa_init_from_wq_list(char *wq_list)
+/* Whether hw, prepared for wq, can be submitted to alt as is */
+static bool wq_can_take(struct dto_wq *alt, struct dto_wq *wq,
+	const struct dsa_hw_desc *hw)
 {
-	char *wq;
-	char file_path[PATH_MAX];
-	int dsa_id, wq_id;
-	int dir_fd;
-	int rc;
+	const struct dsa_hw_desc *d = hw;
 
-	num_wqs = 0;
+	if (alt == wq || alt->max_transfer_size < wq->max_transfer_size)
+		return false;
 
-	wq = strtok(wq_list, ";");
-	while (wq != NULL) {
-		char wq_mode[DTO_MAX_PARAM_LEN];
+	if (hw->opcode == DSA_OPCODE_BATCH) {
+		if (hw->desc_count > alt->max_batch_size)
+			return false;
+		/* the descriptors of a batch share their flags */
+		d = (const struct dsa_hw_desc *)hw->desc_list_addr;
+	}
+	if ((d->flags & IDXD_OP_FLAG_CC) && !(alt->dsa_gencap & GENCAP_CC_MEMORY))
+		return false;
+	if ((d->flags & IDXD_OP_FLAG_BOF) && !alt->block_on_fault)
+		return false;
 
-		if (sscanf(wq, "wq%d.%d", &dsa_id, &wq_id) != 2) {
-			LOG_ERROR("Invalid WQ format %s\n", wq);
-			rc = -EINVAL;
-			goto fail_wq;
-		}
+	return true;
+}
 
-		snprintf(file_path, PATH_MAX, "/sys/bus/dsa/devices/dsa%d", dsa_id);
+static __always_inline struct dto_wq_table *get_wq_table(void)
+{
+	return atomic_load_explicit(&wq_table, memory_order_acquire);
+}
 
-		dir_fd = open(file_path, O_PATH);
-		if (dir_fd == -1) {
-			LOG_ERROR("dir %s open failed: %s\n", file_path, strerror(errno));
-			rc = -errno;
-			goto fail_wq;
-		}
+/* The WQs of the numa node of wq in t, NULL if numa awareness is disabled */
+static __always_inline struct dto_device *wq_node(struct dto_wq_table *t, struct dto_wq *wq)
+{
+	if (!is_numa_aware || wq->numa_node < 0 || wq->numa_node >= dto_num_nodes)
+		return NULL;
 
-		wqs[num_wqs].dsa_gencap = dto_get_param_ullong(dir_fd, "gen_cap", &rc);
-		if (rc) {
-			close(dir_fd);
-			goto fail_wq;
-		}
+	return t->devices[wq->numa_node];
+}
 
-		const int dev_numa_node = (int)dto_get_param_ullong(dir_fd, "numa_node", &rc);
-		if (rc) {
-			close(dir_fd);
-			goto fail_wq;
-		}
+/* Resubmit hw after wq reported that it is full, see dto_submit_retries.
+ * The caller keeps waiting for the completion record and accounting the
+ * submission to wq, whichever WQ took it.
+ */
+static __attribute__((noinline)) int dsa_submit_retry(struct dto_wq *wq,
+	struct dsa_hw_desc *hw)
+{
+	struct dto_wq_table *t;
+	struct dto_device *dev, *list;
+	int ret = RETRY;
 
-		close(dir_fd);
+	for (unsigned int r = 0; r < dto_submit_retries; r++) {
+		for (unsigned int p = 0; p < (DTO_SUBMIT_BACKOFF_PAUSES << r); p++)
+			_mm_pause();
 
-		snprintf(file_path, PATH_MAX, "/sys/bus/dsa/devices/%s", wq);
+#ifdef DTO_STATS_SUPPORT
+		if (collect_stats)
+			++thr_submit_backoffs;
+#endif
+		ret = dsa_submit_once(wq, hw);
+		if (ret != RETRY)
+			return ret;
+	}
 
-		dir_fd = open(file_path, O_PATH);
-		if (dir_fd == -1) {
-			LOG_ERROR("dir %s open failed: %s\n", file_path, strerror(errno));
-			rc = -errno;
-			goto fail_wq;
-		}
+	if (!dto_submit_failover)
+		return ret;
 
-		wqs[num_wqs].max_transfer_size = dto_get_param_ullong(dir_fd, "max_transfer_size", &rc);
-		if (rc) {
-			close(dir_fd);
-			goto fail_wq;
+	/* the WQs of the NUMA node first, then the others */
+	t = get_wq_table();
+	dev = wq_node(t, wq);
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass == 0) {
+			if (dev == NULL)
+				continue;
+			list = dev;
+		} else {
+			list = &t->all;
 		}
 
-		dto_get_param_string(dir_fd, "mode", wq_mode);
+		for (int i = 0; i < list->num_wqs; i++) {
+			struct dto_wq *alt = list->wqs[i];
 
-		if (wq_mode[0] == '\0') {
-			close(dir_fd);
-			rc = -ENOTSUP;
-			goto fail_wq;
-		}
+			if (pass == 1 && dev != NULL && wq_node(t, alt) == dev)
+				continue;
+			if (!wq_can_take(alt, wq, hw))
+				continue;
 
-		if (strcmp(wq_mode, "shared") != 0) {
-			continue;
+#ifdef DTO_STATS_SUPPORT
+			if (collect_stats)
+				++thr_submit_failovers;
+#endif
+			ret = dsa_submit_once(alt, hw);
+			if (ret != RETRY)
+				return ret;
 		}
+	}
 
-		wqs[num_wqs].wq_size = dto_get_param_ullong(dir_fd, "size", &rc);
-		close(dir_fd);
-
-		if (rc)
-			goto fail_wq;
-
-		snprintf(wqs[num_wqs].wq_path, PATH_MAX, "/dev/dsa/%s", wq);
-
-		// open DSA WQ
-		wqs[num_wqs].wq_fd = open(wqs[num_wqs].wq_path, O_RDWR);
-		if (wqs[num_wqs].wq_fd < 0) {
-			LOG_ERROR("DSA WQ %s open error: %s\n", wqs[num_wqs].wq_path, strerror(errno));
-			rc = -errno;
-			goto fail_wq;
-		}
+	return ret;
+}
 
-		// map DSA WQ portal
-		wqs[num_wqs].wq_portal = mmap(NULL, 0x1000, PROT_WRITE, MAP_SHARED | MAP_POPULATE,
-				wqs[num_wqs].wq_fd, 0);
+static __always_inline int dsa_submit(struct dto_wq *wq,
+	struct dsa_hw_desc *hw)
+{
+	uint64_t start = 0;
+	int ret;
+	//LOG_TRACE("desc flags: 0x%x, opcode: 0x%x\n", hw->flags, hw->opcode);
+	__builtin_ia32_sfence();
 
-		if (wqs[num_wqs].wq_portal == MAP_FAILED) {
-			/* In case the driver doesn't support mmap, test if it
-			 * supports write system call for work submission, and
-			 * if yes, fallback to using write syscall.
-			 */
+	if (wait_method == WAIT_HYBRID) {
+		thr_wait_submit = start = _rdtsc();
+		thr_wait_bytes = desc_bytes(hw);
+	} else if (dto_wq_selection == WQ_SELECT_LOAD) {
+		start = _rdtsc();
+	}
 
-			rc = -errno;
-			if (test_write_syscall(&wqs[num_wqs]))
-				wqs[num_wqs].wq_mmapped = false;
-			else {
-				LOG_ERROR("mmap error for DSA wq: %s, error: %s\n", wqs[num_wqs].wq_path, strerror(errno));
-				goto fail_wq;
-			}
-		} else {
-			wqs[num_wqs].wq_mmapped = true;
-			close(wqs[num_wqs].wq_fd);
-		}
+	ret = dsa_submit_once(wq, hw);
+	if (unlikely(ret == RETRY))
+		ret = dsa_submit_retry(wq, hw);
 
-		if (is_numa_aware) {
-			struct dto_device* dev = get_dto_device(dev_numa_node);
-			if (dev != NULL &&
-				dev->num_wqs < MAX_WQS) {
-				dev->wqs[dev->num_wqs++] = &wqs[num_wqs];
-			}
-		}
+	if (ret == SUCCESS)
+		wq_load_submit(wq, wait_method == WAIT_HYBRID ? thr_wait_bytes : desc_bytes(hw), start);
 
-		++num_wqs;
-		if (num_wqs == MAX_WQS)
-			break;
+	return ret;
+}
 
-		wq = strtok(NULL, ";");
-	}
+static __always_inline int dsa_execute(struct dto_wq *wq,
+	struct dsa_hw_desc *hw, struct dsa_completion_record *comp)
+{
+	int ret;
+	comp->status = 0;
 
-	if (num_wqs == 0) {
-		rc = -EINVAL;
-		goto fail;
-	}
+	ret = dsa_submit(wq, hw);
+	if (ret == SUCCESS) {
+		dsa_wait_no_adjust(&comp->status);
+		wq_load_done(wq);
 
-	if (is_numa_aware) {
-		correct_devices_list();
+		if (comp->status == DSA_COMP_SUCCESS) {
+			thr_bytes_completed += hw->xfer_size;
+			return SUCCESS;
+		} else if ((comp->status & DSA_COMP_STATUS_MASK) == DSA_COMP_PAGE_FAULT_NOBOF) {
+			thr_bytes_completed += comp->bytes_completed;
+			thr_fault_addr = comp->fault_addr;
+			return PAGE_FAULT;
+		}
+		LOG_ERROR("failed status %x xfersz %x\n", comp->status, hw->xfer_size);
+		return FAIL_OTHERS;
 	}
+	return ret;
+}
 
-	return 0;
-
-fail_wq:
-	for (int j = 0; j < num_wqs; j++)
-		munmap(wqs[j].wq_portal, 0x1000);
-	num_wqs = 0;
+/* Number of descriptors to put in one batch on this wq. 1 means no batching. */
+static __always_inline uint32_t get_batch_size(struct dto_wq *wq)
+{
+	uint32_t batch_size = dto_batch_size;
 
-	cleanup_devices();
+	if (wq->max_batch_size < batch_size)
+		batch_size = wq->max_batch_size;
 
-fail:
-	return rc;
+	/* a batch must contain at least two descriptors */
+	return batch_size < 2 ? 1 : batch_size;
 }
 
-static int dsa_init_from_accfg(void)
+/* Select the WQs for a job of n bytes into thr_batch. Jobs of at least
+ * dto_stripe_min_size bytes are striped across WQs of different engine groups
+ * (of the NUMA node of wq if numa awareness is enabled). Other jobs use wq only.
+ * Returns the number of stripes.
+ */
+static __always_inline int get_stripes(struct dto_wq *wq, size_t n)
 {
-	int used_devids[MAX_WQS];
-	struct accfg_device *device;
-	struct accfg_wq *wq;
-	struct accfg_ctx *dto_ctx = NULL;
-	int rc;
-	int i;
+	struct dto_wq_table *t;
+	struct dto_device *list;
+	unsigned int start;
+	int ns;
 
-	for (i = 0; i < MAX_WQS; i++) {
-		wqs[i].acc_wq = NULL;
-		used_devids[i] = -1;
-	}
+	thr_batch.wq[0] = wq;
+	thr_batch.num_stripes = 1;
 
-	rc = accfg_new(&dto_ctx);
-	if (rc < 0)
-		return rc;
-	num_wqs = 0;
+	if (dto_stripe_min_size == 0 || n < dto_stripe_min_size)
+		return 1;
 
-	accfg_device_foreach(dto_ctx, device) {
-		enum accfg_device_state dstate;
+	t = get_wq_table();
+	list = wq_node(t, wq);
+	if (list == NULL)
+		list = &t->all;
 
-		/* use dsa devices only*/
-		if (strncmp(accfg_device_get_devname(device), "dsa", 3)!= 0)
-			continue;
+	ns = list->num_stripe_groups < dto_max_stripes ? list->num_stripe_groups : dto_max_stripes;
+	if (ns <= 1)
+		return 1;
 
-		/* Make sure that the device is enabled */
-		dstate = accfg_device_get_state(device);
-		if (dstate != ACCFG_DEVICE_ENABLED)
-			continue;
+	start = next_stripe++;
+	for (int i = 0; i < ns; i++)
+		thr_batch.wq[i] = list->wqs[(start + i) % list->num_wqs];
 
-		/* Check if we have already used a wq on this device */
-		for (i = 0; i < num_wqs; i++)
-			if (accfg_device_get_id(device) == used_devids[i])
-				break;
-		if (i != num_wqs)
-			continue;
+	thr_batch.num_stripes = ns;
+	return ns;
+}
 
-		struct dto_device* dev = NULL;
+/* Maximum number of bytes one submission of the selected stripes can carry.
+ * The per-thread descriptor list is shared evenly between the stripes.
+ */
+static __always_inline size_t get_job_capacity(void)
+{
+	int ns = thr_batch.num_stripes;
+	uint32_t max_descs = DTO_MAX_BATCH_SIZE / ns;
+	size_t stripe_cap = SIZE_MAX;
 
-		if (is_numa_aware) {
-			const int dev_numa_node = accfg_device_get_numa_node(device);
-			dev = get_dto_device(dev_numa_node);
-		}
+	for (int i = 0; i < ns; i++) {
+		struct dto_wq *wq = thr_batch.wq[i];
+		uint32_t batch_size = get_batch_size(wq);
+		size_t cap;
 
-		accfg_wq_foreach(device, wq) {
-			enum accfg_wq_state wstate;
-			enum accfg_wq_mode mode;
-			enum accfg_wq_type type;
+		if (batch_size > max_descs)
+			batch_size = max_descs;
 
-			/* Get a workqueue that's enabled */
-			wstate = accfg_wq_get_state(wq);
-			if (wstate != ACCFG_WQ_ENABLED)
-				continue;
+		cap = (size_t) wq->max_transfer_size * batch_size;
+		if (cap < stripe_cap)
+			stripe_cap = cap;
+	}
+	thr_batch.stripe_cap = stripe_cap;
 
-			/* The wq type should be user */
-			type = accfg_wq_get_type(wq);
-			if (type != ACCFG_WQT_USER)
-				continue;
+	return stripe_cap * ns;
+}
 
-			/* the wq mode should be shared work queue */
-			mode = accfg_wq_get_mode(wq);
-			if (mode != ACCFG_WQ_SHARED)
-				continue;
+/* Split n bytes of stripe s into max_transfer_size descriptors and submit
+ * them as one batch. thr_desc is used as the template for opcode, flags and
+ * fill pattern. If the stripe fits in a single descriptor, it is submitted as is.
+ */
+static __always_inline int dsa_submit_stripe(int s, uint64_t src, uint64_t dst, size_t n)
+{
+	struct dto_wq *wq = thr_batch.wq[s];
+	uint32_t first = s * (DTO_MAX_BATCH_SIZE / thr_batch.num_stripes);
+	uint32_t i = first;
+	size_t off = 0;
+
+	while (off < n) {
+		struct dsa_hw_desc *hw = &thr_batch.descs[i];
+		size_t len = n - off;
+
+		if (len > wq->max_transfer_size)
+			len = wq->max_transfer_size;
+
+		hw->opcode = thr_desc.opcode;
+		hw->flags = thr_desc.flags;
+		if (!(wq->dsa_gencap & GENCAP_CC_MEMORY))
+			hw->flags &= ~IDXD_OP_FLAG_CC;
+		if (!wq->block_on_fault)
+			hw->flags &= ~IDXD_OP_FLAG_BOF;
+		hw->completion_addr = (uint64_t)&thr_batch.comps[i];
+		if (thr_desc.opcode == DSA_OPCODE_MEMFILL)
+			hw->pattern = thr_desc.pattern;
+		else
+			hw->src_addr = src + off;
+		hw->dst_addr = dst + off;
+		hw->xfer_size = (uint32_t) len;
+		thr_batch.comps[i].status = 0;
 
-			wqs[num_wqs].wq_size = accfg_wq_get_size(wq);
-			wqs[num_wqs].max_transfer_size = accfg_wq_get_max_transfer_size(wq);
+		off += len;
+		++i;
+	}
+	thr_batch.first[s] = first;
+	thr_batch.count[s] = i - first;
 
-			wqs[num_wqs].acc_wq = wq;
-			wqs[num_wqs].dsa_gencap = accfg_device_get_gen_cap(device);
+	if (thr_batch.count[s] == 1)
+		return dsa_submit(wq, &thr_batch.descs[first]);
 
-			used_devids[num_wqs] = accfg_device_get_id(device);
+	thr_batch.desc[s].opcode = DSA_OPCODE_BATCH;
+	thr_batch.desc[s].flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	thr_batch.desc[s].completion_addr = (uint64_t)&thr_batch.comp[s];
+	thr_batch.desc[s].desc_list_addr = (uint64_t)&thr_batch.descs[first];
+	thr_batch.desc[s].desc_count = thr_batch.count[s];
+	thr_batch.comp[s].status = 0;
 
-			if (is_numa_aware &&
-				dev != NULL &&
-				dev->num_wqs < MAX_WQS) {
-				dev->wqs[dev->num_wqs++] = &wqs[num_wqs];
-			}
+	return dsa_submit(wq, &thr_batch.desc[s]);
+}
 
-			num_wqs++;
-		}
+static __always_inline const volatile uint8_t *stripe_status(int s)
+{
+	if (thr_batch.count[s] == 1)
+		return &thr_batch.comps[thr_batch.first[s]].status;
+	return &thr_batch.comp[s].status;
+}
 
-		if (num_wqs == MAX_WQS)
-			break;
-	}
+/* Add the leading successfully completed bytes of stripe s (plus the partial
+ * bytes of its first page-faulted descriptor) to thr_bytes_completed.
+ */
+static __always_inline int dsa_complete_stripe(int s)
+{
+	uint32_t end = thr_batch.first[s] + thr_batch.count[s];
+	uint32_t i;
 
-	if (num_wqs == 0) {
-		rc = -EINVAL;
-		goto fail;
+	if (likely(*stripe_status(s) == DSA_COMP_SUCCESS)) {
+		for (i = thr_batch.first[s]; i < end; i++)
+			thr_bytes_completed += thr_batch.descs[i].xfer_size;
+		return SUCCESS;
 	}
 
-	for (i = 0; i < num_wqs; i++) {
-		struct accfg_wq *acc_wq = wqs[i].acc_wq;
-
-		rc = accfg_wq_get_user_dev_path(acc_wq, wqs[i].wq_path, PATH_MAX);
-		if (rc) {
-			LOG_ERROR("Error getting device path\n");
-			goto fail_wq;
-		}
-
-		// open DSA WQ
-		wqs[i].wq_fd = open(wqs[i].wq_path, O_RDWR);
-		if (wqs[i].wq_fd < 0) {
-			LOG_ERROR("DSA WQ %s open error: %s\n", wqs[i].wq_path, strerror(errno));
-			rc = -errno;
-			goto fail_wq;
-		}
-
-		// map DSA WQ portal
-		wqs[i].wq_portal = mmap(NULL, 0x1000, PROT_WRITE, MAP_SHARED | MAP_POPULATE, wqs[i].wq_fd, 0);
+	for (i = thr_batch.first[s]; i < end; i++) {
+		struct dsa_completion_record *comp = &thr_batch.comps[i];
 
-		if (wqs[i].wq_portal == MAP_FAILED) {
-			/* In case the driver doesn't support mmap, test if it
-			 * supports write system call for work submission, and
-			 * if yes, fallback to using write syscall.
-			 */
-			rc = -errno;
-			if (test_write_syscall(&wqs[i]))
-				wqs[num_wqs].wq_mmapped = false;
-			else {
-				LOG_ERROR("mmap error for DSA wq: %s, error: %s\n", wqs[i].wq_path, strerror(errno));
-				goto fail_wq;
-			}
-		} else {
-			wqs[i].wq_mmapped = true;
-			close(wqs[i].wq_fd);
-		}
+		if (comp->status == DSA_COMP_SUCCESS) {
+			thr_bytes_completed += thr_batch.descs[i].xfer_size;
+		} else if ((comp->status & DSA_COMP_STATUS_MASK) == DSA_COMP_PAGE_FAULT_NOBOF) {
+			thr_bytes_completed += comp->bytes_completed;
+			thr_fault_addr = comp->fault_addr;
+			return PAGE_FAULT;
+		} else
+			break;
 	}
+	LOG_ERROR("stripe %d failed status %x desc %u status %x\n", s, *stripe_status(s),
+		i, i < end ? thr_batch.comps[i].status : 0);
+	return FAIL_OTHERS;
+}
 
-	if (is_numa_aware) {
-		correct_devices_list();
+/* Submit the DSA portion of a job on the stripes selected by get_stripes().
+ * Caller must ensure n <= get_job_capacity(). thr_batch.num_submitted is set
+ * to the number of stripes actually submitted, even on failure, and these
+ * must always be waited for with dsa_wait_job().
+ */
+static __always_inline int dsa_submit_job(uint64_t src, uint64_t dst, size_t n)
+{
+	int ns = thr_batch.num_stripes;
+	size_t stripe_len = n;
+	size_t off = 0;
+	int ret = SUCCESS;
+	int s;
+
+	if (ns > 1) {
+		/* page aligned stripes of roughly equal size */
+		stripe_len = ((n + ns - 1) / ns + 0xFFF) & ~0xFFFUL;
+		if (stripe_len > thr_batch.stripe_cap)
+			stripe_len = thr_batch.stripe_cap;
 	}
 
-	accfg_unref(dto_ctx);
-	return 0;
+	for (s = 0; s < ns && off < n; s++) {
+		size_t len = n - off < stripe_len ? n - off : stripe_len;
 
-fail_wq:
-	for (int j = 0; j < i; j++)
-		munmap(wqs[j].wq_portal, 0x1000);
-	num_wqs = 0;
+		ret = dsa_submit_stripe(s, src ? src + off : 0, dst + off, len);
+		if (ret != SUCCESS)
+			break;
+		off += len;
+	}
+	thr_batch.num_submitted = s;
 
-	cleanup_devices();
-fail:
-	accfg_unref(dto_ctx);
-	return rc;
+	return ret;
 }
 
-static int dsa_init(void)
+/* Check if all stripes submitted by dsa_submit_job() have completed */
+static __always_inline bool dsa_job_done(void)
 {
-	unsigned int unused[2];
-	unsigned int leaf, waitpkg;
-	const char *env_str;
-	char wq_list[256];
+	for (int s = 0; s < thr_batch.num_submitted; s++)
+		if (*stripe_status(s) == 0)
+			return false;
+	return true;
+}
 
-	/* detect waitpkg support */
-	leaf = 7;
-	waitpkg = 0;
-	if (__get_cpuid(0, &leaf, unused, &waitpkg, unused + 1)) {
-		if (waitpkg & 0x20) {
-			LOG_TRACE("waitpkg supported\n");
-			waitpkg_support = 1;
+/* Wait for all stripes submitted by dsa_submit_job(). The stripes cover
+ * consecutive ranges of the job, so bytes are only accounted up to the first
+ * stripe that didn't complete. The remainder of the job is left for the
+ * caller to finish on CPU. Returns the first failure, or result (the return
+ * value of dsa_submit_job()) if all submitted stripes succeeded.
+ */
+static __always_inline int dsa_wait_job(int result)
+{
+	bool completed = true;
+
+	for (int s = 0; s < thr_batch.num_submitted; s++) {
+		const volatile uint8_t *status = stripe_status(s);
+		int ret;
+
+		dsa_wait_no_adjust(status);
+		wq_load_done(thr_batch.wq[s]);
+
+		if (!completed)
+			continue;
+
+		ret = dsa_complete_stripe(s);
+		if (ret != SUCCESS) {
+			completed = false;
+			result = ret;
 		}
 	}
 
-	env_str = getenv("DTO_WAIT_METHOD");
-	if (env_str != NULL) {
-		if (!strncmp(env_str, wait_names[WAIT_BUSYPOLL], strlen(wait_names[WAIT_BUSYPOLL]))) {
-			wait_method = WAIT_BUSYPOLL;
-			min_avg_waits = MIN_AVG_POLL_WAITS;
-			max_avg_waits = MAX_AVG_POLL_WAITS;
-		} else if (!strncmp(env_str, wait_names[WAIT_UMWAIT], strlen(wait_names[WAIT_UMWAIT]))) {
-			if (waitpkg_support) {
-				wait_method = WAIT_UMWAIT;
-				/* Use the same waits as busypoll for now */
-				min_avg_waits = MIN_AVG_POLL_WAITS;
-				max_avg_waits = MAX_AVG_POLL_WAITS;
-			} else
-				LOG_ERROR("umwait not supported. Falling back to default wait method\n");
-		} else if (!strncmp(env_str, wait_names[WAIT_TPAUSE], strlen(wait_names[WAIT_TPAUSE]))) {
-		    if (waitpkg_support) {
-			wait_method = WAIT_TPAUSE;
-                    } else {
-			LOG_ERROR("tpause not supported. Falling back to busypoll\n");
-                        wait_method = WAIT_BUSYPOLL;
-                    }
-                }
-	}
+	return result;
+}
 
-	env_str = getenv("DTO_WQ_LIST");
-	if (env_str == NULL)
-		return dsa_init_from_accfg();
+#ifdef DTO_STATS_SUPPORT
+static __always_inline int hist_bucket(uint64_t v)
+{
+	int shift;
 
-	strncpy(wq_list, env_str, sizeof(wq_list) - 1);
-	/* ensure wq_list is null terminated */
-	wq_list[sizeof(wq_list) - 1] = '\0';
+	if (v < HIST_SUB_BUCKETS)
+		return (int)v;
 
-	return dsa_init_from_wq_list(wq_list);
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & (HIST_SUB_BUCKETS - 1));
 }
 
-static int init_dto(void)
+/* Smallest value counted in bucket b */
+static uint64_t hist_bucket_start(int b)
 {
-	uint8_t init_notcomplete = 0;
+	int shift;
 
-	if (atomic_compare_exchange_strong(&dto_initializing, &init_notcomplete, 1)) {
-		char *env_str;
+	if (b < HIST_SUB_BUCKETS)
+		return b;
 
-		env_str = getenv("DTO_LOG_FILE");
-		if (env_str != NULL) {
-			char temp[PATH_MAX];
-			struct stat st;
+	shift = (b >> HIST_SUB_BITS) - 1;
+	return (uint64_t)(HIST_SUB_BUCKETS + (b & (HIST_SUB_BUCKETS - 1))) << shift;
+}
 
-			strncpy(dto_log_path, env_str, PATH_MAX - 1);
-			/* ensure dto_log_path is null terminated */
-			dto_log_path[PATH_MAX - 1] = '\0';
+static void update_stats(int op, size_t n, bool overlapping, size_t bytes_completed,
+		uint64_t elapsed_ns, int group, int error_code)
+{
+	int bucket = hist_bucket(n);
+	struct dto_stats *st = get_thr_stats();
 
-			snprintf(temp, sizeof(temp), ".%s.%d", __progname, getpid());
-			strncat(dto_log_path, temp, PATH_MAX - strlen(dto_log_path) - 1);
+	if (unlikely(st == NULL))
+		return;
 
-			/* Open the log file only if it doesn't exist or if it is a regular file */
-			if (lstat(dto_log_path, &st) == -1 ||
-					(st.st_mode & S_IFMT) == S_IFREG)
-				log_fd = open(dto_log_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
-			/* No need to handle the open() error. It will automatically fallback
-			 * to using standard output if log file open failed
-			 */
+	if (op == MEMMOVE && overlapping) {
+		// dto_memcpymove didn't actually submit the request to DSA, so there is nothing else to log.
+		// This will be captured by a second call
+		if (group == DSA_CALL_SUCCESS && bytes_completed == 0) {
+			++st->overlap_calls[STDC_CALL];
+			st->overlap_bytes[STDC_CALL] += n;
+			return;
 		}
+		++st->overlap_calls[group];
+		st->overlap_bytes[group] += bytes_completed;
+	}
 
-		env_str = getenv("DTO_LOG_LEVEL");
-		if (env_str != NULL) {
-			errno = 0;
-			log_level = strtoul(env_str, NULL, 10);
-			if (errno)
-				log_level = LOG_LEVEL_FATAL;
+	++st->op_counter[bucket][group][op];
+	st->bytes_counter[bucket][group] += bytes_completed;
+	st->lat_counter[bucket][group][op] += elapsed_ns;
+	++st->lat_hist[group][op][hist_bucket(elapsed_ns)];
+	if (elapsed_ns > st->lat_max[group][op])
+		st->lat_max[group][op] = elapsed_ns;
+	if (group == DSA_CALL_FAILED)
+		++st->fail_counter[bucket][error_code];
+	st->fail_counter[bucket][SUBMIT_BACKOFF] += thr_submit_backoffs;
+	st->fail_counter[bucket][SUBMIT_FAILOVER] += thr_submit_failovers;
+	thr_submit_backoffs = 0;
+	thr_submit_failovers = 0;
 
-			if (log_level > LOG_LEVEL_TRACE)
-				log_level = LOG_LEVEL_TRACE;
-		}
+}
 
-		// save std c lib function pointers
-		orig_memset = dlsym(RTLD_NEXT, "memset");
-		orig_memcpy = dlsym(RTLD_NEXT, "memcpy");
-		orig_memmove = dlsym(RTLD_NEXT, "memmove");
-		orig_memcmp = dlsym(RTLD_NEXT, "memcmp");
+static void update_entry_stats(int entry, size_t n)
+{
+	struct dto_stats *st = get_thr_stats();
 
-		env_str = getenv("DTO_USESTDC_CALLS");
-		if (env_str != NULL) {
-			errno = 0;
-			use_std_lib_calls = strtoul(env_str, NULL, 10);
-			if (errno)
-				use_std_lib_calls = 0;
+	if (unlikely(st == NULL))
+		return;
 
-			use_std_lib_calls = !!use_std_lib_calls;
-		}
+	++st->entry_calls[entry];
+	st->entry_bytes[entry] += n;
+}
 
-		env_str = getenv("DTO_DSA_MEMCPY");
-		if (env_str != NULL) {
-			errno = 0;
-			dto_dsa_memcpy = strtoul(env_str, NULL, 10);
-			if (errno)
-				dto_dsa_memcpy = 0;
+/* Upper bound of the latency percentile pct (0-100) of op in group */
+static uint64_t lat_percentile(struct dto_stats *st, int group, int op, uint64_t count, double pct)
+{
+	uint64_t target = (uint64_t)(count * pct / 100.0 + 0.5);
+	uint64_t sum = 0;
 
-			dto_dsa_memcpy = !!dto_dsa_memcpy;
-		}
+	if (target == 0)
+		target = 1;
 
-		env_str = getenv("DTO_DSA_CC");
-		if (env_str != NULL) {
-			errno = 0;
-			dto_dsa_cc = strtoul(env_str, NULL, 10);
-			if (errno)
-				dto_dsa_cc = 0;
+	for (int b = 0; b < HIST_NO_BUCKETS - 1; b++) {
+		sum += st->lat_hist[group][op][b];
+		if (sum >= target) {
+			uint64_t upper = hist_bucket_start(b + 1) - 1;
 
-			dto_dsa_cc = !!dto_dsa_cc;
+			return upper < st->lat_max[group][op] ? upper : st->lat_max[group][op];
 		}
+	}
+	return st->lat_max[group][op];
+}
 
-		env_str = getenv("DTO_DSA_MEMMOVE");
-		if (env_str != NULL) {
-			errno = 0;
-			dto_dsa_memmove = strtoul(env_str, NULL, 10);
-			if (errno)
-				dto_dsa_memmove = 0;
+static void print_stats(void)
+{
+	static struct dto_stats report;
+	struct dto_stats *st = &report;
+	struct timespec dto_end_time;
 
-			dto_dsa_memmove = !!dto_dsa_memmove;
-		}
+	if (likely(!collect_stats))
+		return;
 
-		env_str = getenv("DTO_DSA_MEMSET");
-		if (env_str != NULL) {
-			errno = 0;
-			dto_dsa_memset = strtoul(env_str, NULL, 10);
-			if (errno)
-				dto_dsa_memset = 0;
+	sum_stats(st);
 
-			dto_dsa_memset = !!dto_dsa_memset;
-		}
+	clock_gettime(CLOCK_BOOTTIME, &dto_end_time);
 
-		env_str = getenv("DTO_DSA_MEMCMP");
-		if (env_str != NULL) {
-			errno = 0;
-			dto_dsa_memcmp = strtoul(env_str, NULL, 10);
-			if (errno)
-				dto_dsa_memcmp = 0;
+	LOG_TRACE("DTO Run Time: %ld ms\n", TS_NS(dto_start_time, dto_end_time)/1000000);
 
-			dto_dsa_memcmp = !!dto_dsa_memcmp;
+	// display stats
+	for (int t = 0; t < 2; ++t) {
+		if (t == 0)
+			LOG_TRACE("\n******** Number of Memory Operations ********\n");
+		else
+			LOG_TRACE("\n******** Average Memory Operation Latency (us)  ********\n");
+
+		LOG_TRACE("%25s    ", "");
+		for (int g = 0; g < MAX_STAT_GROUP; ++g) {
+			if (t == 0) {
+				if (g == DSA_FAIL_CODES)
+					LOG_TRACE("<***** %-13s *****> ", stat_group_names[g]);
+				else
+					LOG_TRACE("<*************** %-13s ***************> ", stat_group_names[g]);
+			} else {
+				if (g != DSA_FAIL_CODES)
+					LOG_TRACE("<******** %-13s ********> ", stat_group_names[g]);
+
+			}
 		}
+		LOG_TRACE("\n");
 
-		env_str = getenv("DTO_OVERLAPPING_MEMMOVE_ACTION");
-		if (env_str != NULL) {
-			errno = 0;
-			dto_overlapping_memmove_action = strtoul(env_str, NULL, 10);
-			if (errno)
-				dto_overlapping_memmove_action = OVERLAPPING_CPU;
+		LOG_TRACE("%-25s -- ", "Byte Range");
+		for (int g = 0; g < MAX_STAT_GROUP - 1; ++g) {
+			for (int o = 0; o < MAX_MEMOP; ++o)
+				LOG_TRACE("%-8s ", memop_names[o]);
+			if (t == 0)
+				LOG_TRACE("%-12s ", "bytes");
 		}
+		if (t == 0)
+			for (int o = 1; o < MAX_FAILURES; ++o)
+				LOG_TRACE("%-6s ", failure_names[o]);
+		LOG_TRACE("\n");
 
-#ifdef DTO_STATS_SUPPORT
-		env_str = getenv("DTO_COLLECT_STATS");
-		if (env_str != NULL) {
-			errno = 0;
-			collect_stats = strtoul(env_str, NULL, 10);
-			if (errno)
-				collect_stats = 0;
+		for (int b = 0; b < HIST_NO_BUCKETS; ++b) {
+			bool empty = true;
 
-			collect_stats = !!collect_stats;
+			for (int g = 0; g < MAX_STAT_GROUP; ++g) {
+				for (int o = 0; o < MAX_MEMOP; ++o) {
+					if (st->op_counter[b][g][o] != 0) {
+						empty = false;
+						break;
+					}
+				}
+				if (!empty)
+					break;
+			}
+			if (empty)
+				continue;
+
+			if (b < (HIST_NO_BUCKETS-1))
+				LOG_TRACE("%12lu-%-12lu -- ", hist_bucket_start(b), hist_bucket_start(b + 1) - 1);
+			else
+				LOG_TRACE("%12s>=%-11lu -- ", "", hist_bucket_start(b));
+
+			for (int g = 0; g < MAX_STAT_GROUP - 1; ++g) {
+				for (int o = 0; o < MAX_MEMOP; ++o) {
+					if (t == 0) {
+						LOG_TRACE("%-8llu ", st->op_counter[b][g][o]);
+						continue;
+					}
+					if (st->op_counter[b][g][o] != 0) {
+						double avg_us = ((double) st->lat_counter[b][g][o])/(((double) st->op_counter[b][g][o]) * 1000.0);
+
+						LOG_TRACE("%-8.2f ", avg_us);
+					} else {
+						LOG_TRACE("%-8d ", 0);
+					}
+				}
+				if (t == 0)
+					LOG_TRACE("%-12llu ", st->bytes_counter[b][g]);
+			}
+			if (t == 0)
+				for (int o = 1; o < MAX_FAILURES; ++o)
+					LOG_TRACE("%-6llu ", st->fail_counter[b][o]);
+			LOG_TRACE("\n");
 		}
+	}
 
-		if (collect_stats) {
-			clock_gettime(CLOCK_BOOTTIME, &dto_start_time);
-			/* Change the log level to 'trace' so that the
-			 * stats can be logged
-			 */
-			log_level = LOG_LEVEL_TRACE;
+	LOG_TRACE("\n******** Memory Operation Latency Percentiles (us) ********\n");
+	LOG_TRACE("%-14s %-4s %-12s %-10s %-10s %-10s %-10s %-10s %-10s\n", "Group", "Op", "Count",
+		"avg", "p50", "p90", "p99", "p999", "max");
+	for (int g = 0; g < MAX_STAT_GROUP - 1; ++g) {
+		for (int o = 0; o < MAX_MEMOP; ++o) {
+			uint64_t count = 0;
+
+			for (int b = 0; b < HIST_NO_BUCKETS; ++b)
+				count += st->lat_hist[g][o][b];
+			if (count == 0)
+				continue;
+
+			uint64_t total = 0;
+
+			for (int b = 0; b < HIST_NO_BUCKETS; ++b)
+				total += st->lat_counter[b][g][o];
+
+			LOG_TRACE("%-14s %-4s %-12lu %-10.2f %-10.2f %-10.2f %-10.2f %-10.2f %-10.2f\n",
+				stat_group_names[g], memop_names[o], count, total / (count * 1000.0),
+				lat_percentile(st, g, o, count, 50) / 1000.0,
+				lat_percentile(st, g, o, count, 90) / 1000.0,
+				lat_percentile(st, g, o, count, 99) / 1000.0,
+				lat_percentile(st, g, o, count, 99.9) / 1000.0,
+				st->lat_max[g][o] / 1000.0);
 		}
-#endif
+	}
 
-		/* Register fork handler for the child process */
-		if (!fork_handler_registered) {
-			/* If pthread_atfork fails, and process calls fork,
-			 * the child may crash when using DSA offload. Dont
-			 * take that risk and disable DSA offload for parent
-			 * as well.
-			 */
-			if (!pthread_atfork(NULL, NULL, child))
-				fork_handler_registered = 1;
-			else {
-				LOG_ERROR("Setting fork() handler failed. "
-					"Falling back to using CPUs.\n");
-				use_std_lib_calls = 1;
+	if (auto_adjust_knobs) {
+		LOG_TRACE("\n******** Auto Tuning Per Size Class ********\n");
+		LOG_TRACE("%-4s %-14s %-8s %-9s %-12s %-12s %-10s\n", "Op", "Size", "cpu %", "cpu only",
+			"cpu B/cycle", "dsa B/cycle", "samples");
+		for (int o = 0; o < MAX_MEMOP; ++o) {
+			for (int c = 0; c < DTO_TUNE_CLASSES; ++c) {
+				struct dto_tune *t = &dto_tune[o][c];
+
+				if (t->samples == 0 && !t->cpu_only)
+					continue;
+				LOG_TRACE("%-4s >=%-12lu %-8u %-9s %-12.2f %-12.2f %-10lu\n", memop_names[o],
+					1UL << (c + DTO_TUNE_MIN_SHIFT), t->cpu_fraction, t->cpu_only ? "yes" : "no",
+					t->cpu_rate, t->dsa_rate, t->samples);
 			}
 		}
+	}
 
-		// initialize DSA
-		if (!use_std_lib_calls) {
-			// check environment variables
-			env_str = getenv("DTO_MIN_BYTES");
+	LOG_TRACE("\n******** DSA Usage Per WQ ********\n");
+	LOG_TRACE("%-24s %-8s %-12s %-16s %-10s %-12s %-12s %-10s\n", "WQ", "Device", "Descs", "Bytes",
+		"Retries", "In flight", "Cycles/KB", "Retry rate");
+	for (int j = 0; st->wq_descs != NULL && j < num_wqs + num_dwqs; j++) {
+		int i = wq_index(j);
 
-			if (env_str != NULL) {
-				errno = 0;
-				dsa_min_size = strtoul(env_str, NULL, 10);
-				if (errno)
-					dsa_min_size = DTO_DEFAULT_MIN_SIZE;
-			}
+		LOG_TRACE("%-24s dsa%-5d %-12llu %-16llu %-10llu %-12llu %-12.1f %-10.3f%s%s\n", wqs[i].wq_path,
+			wqs[i].dev_id, st->wq_descs[i], st->wq_bytes[i], st->wq_retries[i],
+			(unsigned long long)wqs[i].inflight, wqs[i].cost * 1024, wqs[i].retry_rate,
+			wqs[i].dedicated ? " dedicated" : "", wqs[i].retired ? " retired" : "");
+	}
 
-			double cpu_size_fraction_float = 0.0;
-			env_str = getenv("DTO_CPU_SIZE_FRACTION");
+	LOG_TRACE("\n******** Page Fault Recovery ********\n");
+	LOG_TRACE("Resumes: %llu, Pre-touched jobs: %llu, Bytes recovered on DSA: %llu, "
+		"Bytes completed on CPU: %llu\n", st->pf_resumes, st->pf_pretouches,
+		st->pf_dsa_bytes, st->pf_cpu_bytes);
+
+	LOG_TRACE("\n******** Overlapping Memmove ********\n");
+	LOG_TRACE("%-14s %-12s %-16s\n", "Group", "Calls", "Bytes");
+	for (int g = 0; g < MAX_STAT_GROUP - 1; ++g)
+		LOG_TRACE("%-14s %-12llu %-16llu\n", stat_group_names[g], st->overlap_calls[g],
+			st->overlap_bytes[g]);
+
+	LOG_TRACE("\n******** DSA Cache Control ********\n");
+	LOG_TRACE("%-4s %-12s %-16s %-12s %-16s\n", "Op", "CC=1 ops", "CC=1 bytes", "CC=0 ops", "CC=0 bytes");
+	for (int o = 0; o < MAX_MEMOP; ++o) {
+		if (st->cc_ops[o][0] + st->cc_ops[o][1])
+			LOG_TRACE("%-4s %-12llu %-16llu %-12llu %-16llu\n", memop_names[o], st->cc_ops[o][1],
+				st->cc_bytes[o][1], st->cc_ops[o][0], st->cc_bytes[o][0]);
+	}
 
-			if (env_str != NULL) {
-				errno = 0;
-				cpu_size_fraction_float = strtod(env_str, NULL);
+	if (wait_method == WAIT_HYBRID) {
+		LOG_TRACE("\n******** Hybrid Wait ********\n");
+		LOG_TRACE("DSA throughput: %.2f bytes/cycle\n", dto_wait_rate);
+		LOG_TRACE("%-8s %-12s %-16s\n", "Phase", "Waits", "Cycles");
+		for (int p = 0; p < MAX_WAIT_PHASE; ++p)
+			LOG_TRACE("%-8s %-12llu %-16llu\n", wait_phase_names[p], st->wait_phases[p],
+				st->wait_cycles[p]);
+	}
 
-				if (errno || cpu_size_fraction_float < 0 || cpu_size_fraction_float >= 1) {
-					LOG_ERROR("Invalid DTO_CPU_SIZE_FRACTION %s, "
-						"Must be >= 0 and < 1. "
-						"Falling back to default 0.0\n", env_str);
-					cpu_size_fraction_float = 0.0;
-				}
-				/* Use only 2 digits after decimal point */
-				cpu_size_fraction = cpu_size_fraction_float * 100;
-			}
+	LOG_TRACE("\n******** Other Entry Points ********\n");
+	LOG_TRACE("%-22s %-12s %-16s\n", "Function", "Calls", "Bytes");
+	for (int e = 0; e < MAX_ENTRY; e++) {
+		if (st->entry_calls[e])
+			LOG_TRACE("%-22s %-12llu %-16llu\n", entry_names[e], st->entry_calls[e],
+				st->entry_bytes[e]);
+	}
+}
 
-			env_str = getenv("DTO_AUTO_ADJUST_KNOBS");
+/* WQs are added by rescans, and the slot of a retired WQ may be reused */
+static void shm_set_wqs(struct dto_shm_stats *shm)
+{
+	shm->num_wqs = num_wqs + num_dwqs < DTO_SHM_MAX_WQS ? num_wqs + num_dwqs : DTO_SHM_MAX_WQS;
+	for (int i = 0; i < shm->num_wqs; i++) {
+		struct dto_wq *wq = &wqs[wq_index(i)];
 
-			if (env_str != NULL) {
-				errno = 0;
-				auto_adjust_knobs = strtoul(env_str, NULL, 10);
-				if (errno)
-					auto_adjust_knobs = 1;
+		snprintf(shm->wqs[i].name, DTO_SHM_WQ_NAME_LEN, "%.*s", DTO_SHM_WQ_NAME_LEN - 1, wq->wq_path);
+		shm->wqs[i].dev_id = wq->dev_id;
+	}
+}
 
-				auto_adjust_knobs = !!auto_adjust_knobs;
-			}
+/* Publish the stats to the shared memory segment once a second. See dto-stat.h */
+static void *stats_shm_worker(void *arg)
+{
+	static struct dto_stats report;
+	struct dto_shm_stats *shm = arg;
+	uint64_t prev_ops[DTO_SHM_MAX_GROUP] = {0};
+	uint64_t prev_bytes[DTO_SHM_MAX_GROUP] = {0};
+	struct timespec ts = { .tv_sec = 1 };
+
+	while (shm_running) {
+		struct dto_stats *st = &report;
+		struct dto_shm_sample *sample;
+		struct timespec now;
+
+		nanosleep(&ts, NULL);
+		if (!shm_running)
+			break;
 
-			if (numa_available() != -1) {
-				env_str = getenv("DTO_IS_NUMA_AWARE");
-				if (env_str != NULL) {
-					errno = 0;
-					is_numa_aware = strtoul(env_str, NULL, 10);
-					if (errno || is_numa_aware >= NA_LAST_ENTRY) {
-						is_numa_aware = NA_NONE;
-					}
-				}
-			}
+		sum_stats(st);
+		clock_gettime(CLOCK_REALTIME, &now);
 
-			env_str = getenv("DTO_UMWAIT_DELAY");
+		++shm->seq;
+		atomic_thread_fence(memory_order_release);
 
-			if (env_str != NULL) {
-				errno = 0;
-				dto_umwait_delay = strtoul(env_str, NULL, 10);
-				if (errno || dto_umwait_delay == 0)
-					dto_umwait_delay = UMWAIT_DELAY_DEFAULT;
+		for (int g = 0; g < DTO_SHM_MAX_GROUP; g++) {
+			uint64_t bytes = 0;
+
+			for (int o = 0; o < DTO_SHM_MAX_OP; o++) {
+				uint64_t ops = 0;
+
+				for (int b = 0; b < HIST_NO_BUCKETS; b++)
+					ops += st->op_counter[b][g][o];
+				shm->ops[g][o] = ops;
 			}
+			for (int b = 0; b < HIST_NO_BUCKETS; b++)
+				bytes += st->bytes_counter[b][g];
+			shm->bytes[g] = bytes;
+		}
+		for (int f = 0; f < DTO_SHM_MAX_FAILS; f++) {
+			uint64_t fails = 0;
 
-			if (dsa_init()) {
-				LOG_ERROR("Didn't find any usable DSAs. Falling back to using CPUs.\n");
-				use_std_lib_calls = 1;
+			for (int b = 0; b < HIST_NO_BUCKETS; b++)
+				fails += st->fail_counter[b][f + 1];
+			shm->fails[f] = fails;
+		}
+		shm->cpu_size_fraction = cpu_size_fraction;
+		shm->dsa_min_size = dsa_min_size;
+		shm->auto_tuned = auto_adjust_knobs;
+		for (int o = 0; auto_adjust_knobs && o < DTO_SHM_MAX_OP; o++) {
+			for (int c = 0; c < DTO_SHM_TUNE_CLASSES; c++) {
+				shm->tune_cpu_fraction[o][c] = dto_tune[o][c].cpu_fraction;
+				shm->tune_cpu_only[o][c] = dto_tune[o][c].cpu_only;
 			}
+		}
+		shm_set_wqs(shm);
+		for (int i = 0; st->wq_descs != NULL && i < shm->num_wqs; i++) {
+			shm->wqs[i].descs = st->wq_descs[wq_index(i)];
+			shm->wqs[i].bytes = st->wq_bytes[wq_index(i)];
+		}
 
-                        // calculate the wait time for TPAUSE
-                        if (wait_method == WAIT_TPAUSE) {
-    			        unsigned int num, den, freq;
-    			        unsigned int empty;
-    			        unsigned long long tmp;
-    			        __get_cpuid( 0x15, &den, &num, &freq, &empty );
-    			        freq /= 1000;
-    			        LOG_TRACE( "Core Freq = %u kHz\n", freq );
-    			        LOG_TRACE( "TSC Mult  = %u\n", num );
-    			        LOG_TRACE( "TSC Den   = %u\n", den );
-    			        freq *= num;
-    			        freq /= den;
-    			        LOG_TRACE( "CPU freq = %u kHz\n", freq );
+		sample = &shm->samples[shm->num_samples % DTO_SHM_SAMPLES];
+		sample->time = now.tv_sec;
+		for (int g = 0; g < DTO_SHM_MAX_GROUP; g++) {
+			uint64_t ops = 0;
+
+			for (int o = 0; o < DTO_SHM_MAX_OP; o++)
+				ops += shm->ops[g][o];
+			sample->ops[g] = ops - prev_ops[g];
+			sample->bytes[g] = shm->bytes[g] - prev_bytes[g];
+			prev_ops[g] = ops;
+			prev_bytes[g] = shm->bytes[g];
+		}
+		++shm->num_samples;
+		shm->update_time = now.tv_sec;
+
+		atomic_thread_fence(memory_order_release);
+		++shm->seq;
+	}
+
+	return NULL;
+}
+
+static void init_stats_shm(void)
+{
+	struct dto_shm_stats *shm;
+	struct timespec now;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd, rc;
+
+	snprintf(shm_name, sizeof(shm_name), DTO_SHM_NAME_FMT, getpid());
+	fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		LOG_ERROR("shm_open %s failed: %s\n", shm_name, strerror(errno));
+		return;
+	}
+
+	if (ftruncate(fd, sizeof(*shm)) != 0) {
+		LOG_ERROR("ftruncate %s failed: %s\n", shm_name, strerror(errno));
+		goto fail;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		LOG_ERROR("mmap %s failed: %s\n", shm_name, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	shm->pid = getpid();
+	shm->start_time = now.tv_sec;
+	shm->update_time = now.tv_sec;
+	shm_set_wqs(shm);
+	shm->version = DTO_SHM_VERSION;
+	atomic_thread_fence(memory_order_release);
+	shm->magic = DTO_SHM_MAGIC;
+
+	shm_running = true;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, stats_shm_worker, shm);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		LOG_ERROR("stats publisher creation failed: %s\n", strerror(rc));
+		shm_running = false;
+		munmap(shm, sizeof(*shm));
+		shm_unlink(shm_name);
+		return;
+	}
+	shm_stats = shm;
+
+	LOG_TRACE("Publishing stats to shared memory %s\n", shm_name);
+	return;
+
+fail:
+	close(fd);
+	shm_unlink(shm_name);
+}
+
+static void cleanup_stats_shm(void)
+{
+	if (shm_stats == NULL)
+		return;
+
+	/* the publisher may still be running, so the segment stays mapped */
+	shm_running = false;
+	shm_unlink(shm_name);
+}
+#endif
+
+#define DTO_MAX_PARAM_LEN 16
+static void dto_get_param_string(int dir_fd, char *path, char *out)
+{
+	int fd;
+	char buffer[DTO_MAX_PARAM_LEN];
+	int bytes;
+
+	out[0] = '\0';
+	fd = openat(dir_fd, path, O_RDONLY);
+
+	if (fd < 0)
+		return;
+
+	bytes = read(fd, buffer, DTO_MAX_PARAM_LEN - 1);
+
+	if (bytes <= 0) {
+		close(fd);
+		return;
+	}
+
+	if (buffer[bytes - 1] == '\n')
+		buffer[bytes - 1] = '\0';
+	else
+		buffer[bytes] = '\0';
+
+	strncpy(out, buffer, DTO_MAX_PARAM_LEN);
+	close(fd);
+}
+
+static unsigned long long dto_get_param_ullong(int dir_fd, char *path, int *err)
+{
+	int fd;
+	char buffer[DTO_MAX_PARAM_LEN];
+	int bytes;
+	unsigned long long val;
+
+	fd = openat(dir_fd, path, O_RDONLY);
+
+	if (fd < 0) {
+		*err = -errno;
+		return -errno;
+	}
+
+	bytes = read(fd, buffer, DTO_MAX_PARAM_LEN - 1);
+
+	if (bytes <= 0) {
+		*err = -errno;
+		close(fd);
+		return -errno;
+	}
+
+	errno = 0;
+	val = strtoull(buffer, NULL, 0);
+
+	*err = -errno;
+	close(fd);
+
+	return val;
+}
+
+/* Cache of the numa node of buffers for buffer-centric numa awareness, so
+ * that move_pages() isn't called for every operation. Entries map a 2 MB
+ * extent to the node of the page that was looked up. This is only a hint for
+ * picking a DSA, so pages of an extent that are on other nodes and pages
+ * migrated since the lookup just cost some locality. Entries expire after
+ * NUMA_CACHE_TTL, and all entries are invalidated when the application
+ * itself calls munmap() or mbind(). The munmap() calls glibc makes internally
+ * (e.g. when free() releases an mmapped chunk) aren't intercepted, so memory
+ * that is freed and mapped again within the TTL may get a stale hint.
+ *
+ * Each entry packs the extent (26 bits, user addresses below 2^47), the
+ * cache generation (20 bits, so it doesn't wrap around to the generation of
+ * a live entry within the TTL), node + 1 (6 bits) and the lookup time
+ * (12 bits, in units of 2^26 TSC cycles) so it can be read and written
+ * atomically without locks. Buffers at higher addresses (5-level paging)
+ * and nodes above 62 aren't cached.
+ */
+#define NUMA_CACHE_EXTENT_SHIFT 21
+#define NUMA_CACHE_SIZE 1024
+#define NUMA_CACHE_TIME_SHIFT 26
+#define NUMA_CACHE_TTL 64	// ~0.5-1.5 s depending on the TSC frequency
+
+static atomic_ullong numa_cache[NUMA_CACHE_SIZE];
+static atomic_uint numa_cache_gen;
+
+static __always_inline int get_buffer_numa_node(void *buf)
+{
+	uint64_t extent = (uint64_t)buf >> NUMA_CACHE_EXTENT_SHIFT;
+	atomic_ullong *slot = &numa_cache[(extent ^ (extent >> 10)) % NUMA_CACHE_SIZE];
+	uint64_t entry = atomic_load_explicit(slot, memory_order_relaxed);
+	uint64_t now = (_rdtsc() >> NUMA_CACHE_TIME_SHIFT) & 0xFFF;
+	uint32_t gen = numa_cache_gen & 0xFFFFF;
+	int status[1] = {-1};
+
+	if ((entry >> 38) == extent &&
+		((entry >> 18) & 0xFFFFF) == gen &&
+		((now - entry) & 0xFFF) < NUMA_CACHE_TTL &&
+		((entry >> 12) & 0x3F) != 0)
+		return (int)((entry >> 12) & 0x3F) - 1;
+
+	// get numa node of memory pointed by buf
+	if (move_pages(0, 1, &buf, NULL, status, 0) != 0) {
+		LOG_ERROR("move_pages call error: %d - %s", errno, strerror(errno));
+		return -1;
+	}
+
+	/* pages that aren't populated yet (negative status) aren't cached */
+	if (status[0] >= 0 && status[0] < 0x3F && extent < (1ULL << 26)) {
+		entry = (extent << 38) | ((uint64_t)gen << 18) | ((uint64_t)(status[0] + 1) << 12) | now;
+		atomic_store_explicit(slot, entry, memory_order_relaxed);
+	}
+
+	// alternatively get_mempolicy can be used
+	// if (get_mempolicy(&numa_node, NULL, 0, (void *)buf, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+	// 	LOG_ERROR("get_mempolicy call error: %d - %s", errno, strerror(errno));
+	// }
+	return status[0];
+}
+
+static __always_inline  int get_numa_node(void* buf) {
+	int numa_node = -1;
+
+	switch (is_numa_aware) {
+        case NA_BUFFER_CENTRIC: {
+			if (buf != NULL) {
+				numa_node = get_buffer_numa_node(buf);
+			} else {
+				LOG_ERROR("NULL buffer delivered. Unable to detect numa node");
+			}
+		}
+		break;
+		case NA_CPU_CENTRIC: {
+			const int cpu = sched_getcpu();
+			if (cpu != -1) {
+				numa_node = numa_node_of_cpu(sched_getcpu());
+			}
+			else {
+				LOG_ERROR("sched_getcpu call error: %d - %s", errno, strerror(errno));
+			}
+		}
+		break;
+        default:
+		break;
+        }
+
+        return numa_node;
+}
+
+/* WQ slots. A scan looks each WQ it finds up with wq_find(), which marks the
+ * WQs in use with the scan generation, and adds the new ones to a slot from
+ * wq_alloc() with wq_add(). The WQs that a rescan doesn't find are retired.
+ */
+static struct dto_wq *wq_find(const char *path, bool dedicated)
+{
+	for (int j = 0; j < num_wqs + num_dwqs; j++) {
+		struct dto_wq *w = &wqs[wq_index(j)];
+
+		if (!w->retired && w->dedicated == dedicated && strcmp(w->wq_path, path) == 0) {
+			w->scan_gen = wq_scan_gen;
+			return w;
+		}
+	}
+
+	return NULL;
+}
+
+static void wq_unmap(struct dto_wq *w)
+{
+	if (w->wq_mmapped) {
+		munmap(w->wq_portal, 0x1000);
+		w->wq_mmapped = false;
+	}
+	if (w->wq_fd >= 0) {
+		close(w->wq_fd);
+		w->wq_fd = -1;
+	}
+}
+
+/* Returns a free slot for a new WQ, NULL if all slots are in use. The slot of
+ * a retired WQ is reused once no WQ table refers to it (see DTO_WQ_TABLES),
+ * no operation is in flight on it and no thread leases it. The slots of
+ * untracked WQs are never reused, as their operations can't be counted.
+ */
+static struct dto_wq *wq_alloc(bool dedicated)
+{
+	struct dto_wq *w;
+
+	for (int j = 0; j < num_wqs + num_dwqs; j++) {
+		w = &wqs[wq_index(j)];
+
+		if (w->retired && w->dedicated == dedicated && w->inflight == 0 && !w->untracked && !w->leased &&
+				(int32_t)(wq_table_gen - w->retire_gen) >= DTO_WQ_TABLES - 1) {
+			wq_unmap(w);
+			w->num_pending = 0;
+			return w;
+		}
+	}
+
+	if (num_wqs + num_dwqs == dto_max_wqs)
+		return NULL;
+
+	w = dedicated ? dwq_at(num_dwqs) : &wqs[num_wqs];
+	w->num_pending = 0;
+	return w;
+}
+
+/* Start using the WQ in slot w, filled in by the backend */
+static void wq_add(struct dto_wq *w)
+{
+	bool new_slot = w == (w->dedicated ? dwq_at(num_dwqs) : &wqs[num_wqs]);
+
+	w->inflight = 0;
+	w->untracked = false;
+	w->cost = 0;
+	w->retry_rate = 0;
+	w->leased = false;
+	w->num_pending = 0;
+	w->scan_gen = wq_scan_gen;
+	w->retired = false;
+	atomic_thread_fence(memory_order_release);
+	if (new_slot) {
+		if (w->dedicated)
+			++num_dwqs;
+		else
+			++num_wqs;
+	}
+	++wq_scan_changes;
+}
+
+/* Forget all WQs, e.g. when the initial scan fails */
+static void wq_remove_all(void)
+{
+	for (int j = 0; j < num_wqs + num_dwqs; j++)
+		wq_unmap(&wqs[wq_index(j)]);
+	num_wqs = 0;
+	num_dwqs = 0;
+}
+
+static bool test_write_syscall(struct dto_wq *wq)
+{
+	struct dsa_hw_desc desc = {0};
+	struct dsa_completion_record comp __attribute__((aligned(32)));
+	int retry = 0;
+
+	desc.opcode = DSA_OPCODE_NOOP;
+	desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	comp.status = 0;
+
+	desc.completion_addr = (unsigned long)&comp;
+
+	if (dsa_submit(wq, &desc) == SUCCESS) {
+		while (comp.status == 0 && retry++ < 10000)
+			_mm_pause();
+
+		if (comp.status == DSA_COMP_SUCCESS)
+			return true;
+	}
+
+	return false;
+}
+
+/* Open the device file of wq and map its portal. If the driver doesn't
+ * support mmap of the portal, test if it supports the write system call for
+ * work submission, and if yes, fall back to it.
+ */
+static int dsa_map_wq(struct dto_wq *wq)
+{
+	int rc;
+
+	// open DSA WQ
+	wq->wq_fd = open(wq->wq_path, O_RDWR);
+	if (wq->wq_fd < 0) {
+		LOG_ERROR("DSA WQ %s open error: %s\n", wq->wq_path, strerror(errno));
+		return -errno;
+	}
+
+	// map DSA WQ portal
+	wq->wq_portal = mmap(NULL, 0x1000, PROT_WRITE, MAP_SHARED | MAP_POPULATE, wq->wq_fd, 0);
+
+	if (wq->wq_portal == MAP_FAILED) {
+		rc = -errno;
+		wq->wq_mmapped = false;
+		if (!test_write_syscall(wq)) {
+			LOG_ERROR("mmap error for DSA wq: %s, error: %s\n", wq->wq_path, strerror(-rc));
+			close(wq->wq_fd);
+			wq->wq_fd = -1;
+			return rc;
+		}
+		/* the test descriptor has completed */
+		wq->num_pending = 0;
+	} else {
+		wq->wq_mmapped = true;
+		close(wq->wq_fd);
+		wq->wq_fd = -1;
+	}
+
+	return 0;
+}
+
+/* Number of engines of DSA device dsa_id in group group_id, 0 if unknown */
+static int dsa_count_engines(int dsa_id, int max_engines, int group_id)
+{
+	char file_path[PATH_MAX];
+	int num_engines = 0;
+	int dir_fd;
+	int rc;
+
+	for (int e = 0; e < max_engines; e++) {
+		snprintf(file_path, PATH_MAX, "/sys/bus/dsa/devices/engine%d.%d", dsa_id, e);
+
+		dir_fd = open(file_path, O_PATH);
+		if (dir_fd == -1)
+			continue;
+
+		if ((int)dto_get_param_ullong(dir_fd, "group_id", &rc) == group_id && rc == 0)
+			num_engines++;
+		close(dir_fd);
+	}
+
+	return num_engines;
+}
+
+/* Add the WQ wq (e.g. wq0.1) of DTO_WQ_LIST if it isn't in use yet. WQs that
+ * aren't enabled are skipped, a rescan adds them once they are. Rescans don't
+ * report devices and WQs that don't exist (anymore).
+ */
+static int dsa_add_listed_wq(const char *wq, bool rescan)
+{
+	char file_path[PATH_MAX];
+	char wq_mode[DTO_MAX_PARAM_LEN];
+	char wq_state[DTO_MAX_PARAM_LEN];
+	int dsa_id, wq_id;
+	int max_engines;
+	int group_id;
+	int dir_fd;
+	int rc;
+	struct dto_wq *w;
+	uint64_t gencap;
+	bool dedicated;
+
+	if (sscanf(wq, "wq%d.%d", &dsa_id, &wq_id) != 2) {
+		LOG_ERROR("Invalid WQ format %s\n", wq);
+		return -EINVAL;
+	}
+
+	snprintf(file_path, PATH_MAX, "/sys/bus/dsa/devices/dsa%d", dsa_id);
+
+	dir_fd = open(file_path, O_PATH);
+	if (dir_fd == -1) {
+		rc = -errno;
+		if (!rescan || rc != -ENOENT)
+			LOG_ERROR("dir %s open failed: %s\n", file_path, strerror(-rc));
+		return rc;
+	}
+
+	gencap = dto_get_param_ullong(dir_fd, "gen_cap", &rc);
+	if (rc) {
+		close(dir_fd);
+		return rc;
+	}
+
+	const int dev_numa_node = (int)dto_get_param_ullong(dir_fd, "numa_node", &rc);
+	if (rc) {
+		close(dir_fd);
+		return rc;
+	}
+
+	max_engines = (int)dto_get_param_ullong(dir_fd, "max_engines", &rc);
+	if (rc) {
+		max_engines = 0;
+		rc = 0;
+	}
+
+	close(dir_fd);
+
+	snprintf(file_path, PATH_MAX, "/sys/bus/dsa/devices/%s", wq);
+
+	dir_fd = open(file_path, O_PATH);
+	if (dir_fd == -1) {
+		rc = -errno;
+		if (!rescan || rc != -ENOENT)
+			LOG_ERROR("dir %s open failed: %s\n", file_path, strerror(-rc));
+		return rc;
+	}
+
+	dto_get_param_string(dir_fd, "mode", wq_mode);
+
+	if (wq_mode[0] == '\0') {
+		close(dir_fd);
+		return -ENOTSUP;
+	}
+
+	if (strcmp(wq_mode, "shared") == 0) {
+		dedicated = false;
+	} else if (strcmp(wq_mode, "dedicated") == 0) {
+		dedicated = true;
+	} else {
+		close(dir_fd);
+		return 0;
+	}
+
+	dto_get_param_string(dir_fd, "state", wq_state);
+	if (wq_state[0] != '\0' && strcmp(wq_state, "enabled") != 0) {
+		close(dir_fd);
+		return 0;
+	}
+
+	snprintf(file_path, PATH_MAX, "/dev/dsa/%s", wq);
+	if (wq_find(file_path, dedicated) != NULL) {
+		close(dir_fd);
+		return 0;
+	}
+
+	w = wq_alloc(dedicated);
+	if (w == NULL) {
+		close(dir_fd);
+		return -ENOSPC;
+	}
+
+	snprintf(w->wq_path, PATH_MAX, "%s", file_path);
+	w->dedicated = dedicated;
+	w->acc_wq = NULL;
+	w->dsa_gencap = gencap;
+
+	w->max_transfer_size = dto_get_param_ullong(dir_fd, "max_transfer_size", &rc);
+	if (rc) {
+		close(dir_fd);
+		return rc;
+	}
+
+	/* Older kernels don't expose max_batch_size. Don't use batches then */
+	w->max_batch_size = dto_get_param_ullong(dir_fd, "max_batch_size", &rc);
+	if (rc) {
+		w->max_batch_size = 0;
+		rc = 0;
+	}
+
+	w->block_on_fault = dto_get_param_ullong(dir_fd, "block_on_fault", &rc) != 0;
+	if (rc) {
+		w->block_on_fault = false;
+		rc = 0;
+	}
+
+	w->wq_size = dto_get_param_ullong(dir_fd, "size", &rc);
+	if (rc) {
+		close(dir_fd);
+		return rc;
+	}
+
+	/* a WQ that isn't in a group can't be enabled, but don't fail on it */
+	group_id = (int)dto_get_param_ullong(dir_fd, "group_id", &rc);
+	if (rc) {
+		group_id = -1;
+		rc = 0;
+	}
+	close(dir_fd);
+
+	rc = dsa_map_wq(w);
+	if (rc)
+		return rc;
+
+	w->dev_id = dsa_id;
+	w->numa_node = dev_numa_node;
+	w->group_id = group_id;
+	w->num_engines = group_id >= 0 ? dsa_count_engines(dsa_id, max_engines, group_id) : 0;
+	wq_add(w);
+
+	return 0;
+}
+
+/* Scan the WQs of DTO_WQ_LIST. Any error fails the initial scan, a rescan
+ * skips the WQs it can't use.
+ */
+static int dsa_scan_wq_list(char *wq_list, bool rescan)
+{
+	char *wq;
+	int rc;
+
+	for (wq = strtok(wq_list, ";"); wq != NULL; wq = strtok(NULL, ";")) {
+		rc = dsa_add_listed_wq(wq, rescan);
+		if (rc == -ENOSPC)
+			break;
+		if (rc && !rescan) {
+			wq_remove_all();
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/* Number of engines of device in group group_id */
+static int dsa_accfg_count_engines(struct accfg_device *device, int group_id)
+{
+	struct accfg_engine *engine;
+	int num_engines = 0;
+
+	accfg_engine_foreach(device, engine) {
+		if (accfg_engine_get_group_id(engine) == group_id)
+			num_engines++;
+	}
+
+	return num_engines;
+}
+
+/* Scan the enabled user WQs of the DSA devices, see dsa_scan_wq_list().
+ * All the devices are used, with all their WQs and engine groups.
+ */
+static int dsa_scan_accfg(bool rescan)
+{
+	char path[PATH_MAX];
+	struct accfg_device *device;
+	struct accfg_wq *wq;
+	struct accfg_ctx *dto_ctx = NULL;
+	int rc;
+
+	rc = accfg_new(&dto_ctx);
+	if (rc < 0)
+		return rc;
+
+	accfg_device_foreach(dto_ctx, device) {
+		enum accfg_device_state dstate;
+
+		/* use dsa devices only*/
+		if (strncmp(accfg_device_get_devname(device), "dsa", 3)!= 0)
+			continue;
+
+		/* Make sure that the device is enabled */
+		dstate = accfg_device_get_state(device);
+		if (dstate != ACCFG_DEVICE_ENABLED)
+			continue;
+
+		accfg_wq_foreach(device, wq) {
+			enum accfg_wq_state wstate;
+			enum accfg_wq_mode mode;
+			enum accfg_wq_type type;
+			struct dto_wq *w;
+			bool dedicated;
+
+			/* Get a workqueue that's enabled */
+			wstate = accfg_wq_get_state(wq);
+			if (wstate != ACCFG_WQ_ENABLED)
+				continue;
+
+			/* The wq type should be user */
+			type = accfg_wq_get_type(wq);
+			if (type != ACCFG_WQT_USER)
+				continue;
+
+			/* shared WQs serve all threads, dedicated WQs are leased */
+			mode = accfg_wq_get_mode(wq);
+			if (mode == ACCFG_WQ_SHARED)
+				dedicated = false;
+			else if (mode == ACCFG_WQ_DEDICATED)
+				dedicated = true;
+			else
+				continue;
+
+			rc = accfg_wq_get_user_dev_path(wq, path, PATH_MAX);
+			if (rc) {
+				LOG_ERROR("Error getting device path\n");
+				if (rescan)
+					continue;
+				goto fail_wq;
+			}
+
+			if (wq_find(path, dedicated) != NULL)
+				continue;
+
+			w = wq_alloc(dedicated);
+			if (w == NULL)
+				goto done;
+
+			snprintf(w->wq_path, PATH_MAX, "%s", path);
+			w->dedicated = dedicated;
+			w->wq_size = accfg_wq_get_size(wq);
+			w->max_transfer_size = accfg_wq_get_max_transfer_size(wq);
+			w->max_batch_size = accfg_wq_get_max_batch_size(wq);
+			w->block_on_fault = accfg_wq_get_block_on_fault(wq) > 0;
+
+			w->acc_wq = wq;
+			w->dsa_gencap = accfg_device_get_gen_cap(device);
+			w->dev_id = accfg_device_get_id(device);
+			w->numa_node = accfg_device_get_numa_node(device);
+			w->group_id = accfg_wq_get_group_id(wq);
+			w->num_engines = w->group_id >= 0 ? dsa_accfg_count_engines(device, w->group_id) : 0;
+
+			rc = dsa_map_wq(w);
+			if (rc) {
+				if (rescan)
+					continue;
+				goto fail_wq;
+			}
+
+			wq_add(w);
+		}
+	}
+
+done:
+	accfg_unref(dto_ctx);
+	return 0;
+
+fail_wq:
+	wq_remove_all();
+	accfg_unref(dto_ctx);
+	return rc;
+}
+
+/* Order the wqs so that consecutive entries are on different engine groups
+ * (a group of WQs and engines of a DSA device, which process descriptors
+ * independently of the other groups). Round r holds the r-th wq of each
+ * group, in the order the groups first appear. Uses 4 * n entries of
+ * wq_scratch. Returns the number of distinct groups.
+ */
+static uint32_t build_stripe_order(struct dto_wq **in, uint32_t n, struct dto_wq **out)
+{
+	int *group = wq_scratch;	// group of each wq
+	int *rank = group + n;		// index of each wq within its group
+	int *size = rank + n;		// wqs of each group
+	int *first = size + n;		// index in in[] of the first wq of each group
+	uint32_t num_groups = 0;
+	uint32_t i, g;
+
+	for (i = 0; i < n; i++) {
+		for (g = 0; g < num_groups; g++) {
+			struct dto_wq *w = in[first[g]];
+
+			if (w->dev_id == in[i]->dev_id && w->group_id == in[i]->group_id)
+				break;
+		}
+		if (g == num_groups) {
+			first[num_groups++] = i;
+			size[g] = 0;
+		}
+		group[i] = g;
+		rank[i] = size[g]++;
+	}
+
+	for (i = 0; i < n; i++) {
+		uint32_t pos = 0;
+
+		/* the wqs of the previous rounds and of the previous groups of this round */
+		for (g = 0; g < num_groups; g++) {
+			pos += size[g] < rank[i] ? size[g] : rank[i];
+			if (g < (uint32_t)group[i] && size[g] > rank[i])
+				pos++;
+		}
+		out[pos] = in[i];
+	}
+
+	return num_groups;
+}
+
+/* Build the table of the SWQs in use and publish it, see DTO_WQ_TABLES */
+static void publish_wq_table(void)
+{
+	struct dto_wq_table *t = &wq_tables[(wq_table_gen + 1) % DTO_WQ_TABLES];
+	struct dto_wq **in = wq_order;
+	struct dto_device *dev = NULL;
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < num_wqs; i++) {
+		if (!wqs[i].retired)
+			in[n++] = &wqs[i];
+	}
+	t->all.num_stripe_groups = build_stripe_order(in, n, t->all.wqs);
+	t->all.num_wqs = n;
+	t->all.next_wq = 0;
+
+	for (int node = 0; node < dto_num_nodes; node++) {
+		t->nodes[node].num_wqs = 0;
+		t->devices[node] = NULL;
+		if (!is_numa_aware)
+			continue;
+
+		n = 0;
+		for (uint32_t i = 0; i < t->all.num_wqs; i++) {
+			if (t->all.wqs[i]->numa_node == node)
+				in[n++] = t->all.wqs[i];
+		}
+		if (n == 0) {
+			/* nodes without a device share the list of the preceding node */
+			t->devices[node] = dev;
+			continue;
+		}
+
+		dev = &t->nodes[node];
+		dev->num_stripe_groups = build_stripe_order(in, n, dev->wqs);
+		dev->num_wqs = n;
+		dev->next_wq = 0;
+		t->devices[node] = dev;
+	}
+
+	t->gen = ++wq_table_gen;
+	atomic_store_explicit(&wq_table, t, memory_order_release);
+}
+
+/* Log the devices, engine groups, engines and WQs in use on each numa node */
+static void log_wq_topology(void)
+{
+	for (int node = 0; node < dto_num_nodes; node++) {
+		int devs = 0, groups = 0, engines = 0, swqs = 0, dwqs = 0;
+
+		for (uint32_t j = 0; j < num_wqs + num_dwqs; j++) {
+			struct dto_wq *w = &wqs[wq_index(j)];
+			bool new_dev = true, new_group = true;
+
+			if (w->retired || (w->numa_node != node && !(node == 0 && w->numa_node < 0)))
+				continue;
+
+			/* count a device and a group at their first WQ */
+			for (uint32_t k = 0; k < j; k++) {
+				struct dto_wq *o = &wqs[wq_index(k)];
+
+				if (o->retired || o->numa_node != w->numa_node || o->dev_id != w->dev_id)
+					continue;
+				new_dev = false;
+				if (o->group_id == w->group_id)
+					new_group = false;
+			}
+
+			devs += new_dev;
+			groups += new_group;
+			engines += new_group ? w->num_engines : 0;
+			swqs += !w->dedicated;
+			dwqs += w->dedicated;
+		}
+
+		if (devs != 0)
+			LOG_TRACE("numa node %d: devices: %d, groups: %d, engines: %d, swqs: %d, dwqs: %d\n",
+				node, devs, groups, engines, swqs, dwqs);
+	}
+}
+
+static int dsa_scan_wqs(bool rescan)
+{
+	const char *env_str;
+	char wq_list[256];
+
+	env_str = getenv("DTO_WQ_LIST");
+	if (env_str == NULL)
+		return dsa_scan_accfg(rescan);
+
+	strncpy(wq_list, env_str, sizeof(wq_list) - 1);
+	/* ensure wq_list is null terminated */
+	wq_list[sizeof(wq_list) - 1] = '\0';
+
+	return dsa_scan_wq_list(wq_list, rescan);
+}
+
+/* The WQs of DTO_WQ_LIST, or all the WQs the DSA devices support */
+static int dsa_max_wqs(void)
+{
+	const char *env_str;
+	struct accfg_device *device;
+	struct accfg_ctx *dto_ctx = NULL;
+	int n = 0;
+
+	env_str = getenv("DTO_WQ_LIST");
+	if (env_str != NULL) {
+		for (const char *p = env_str; *p != '\0'; p++)
+			n += *p == ';';
+		return n + 1;
+	}
+
+	if (accfg_new(&dto_ctx) < 0)
+		return 0;
+
+	accfg_device_foreach(dto_ctx, device) {
+		if (strncmp(accfg_device_get_devname(device), "dsa", 3) == 0)
+			n += accfg_device_get_max_work_queues(device);
+	}
+	accfg_unref(dto_ctx);
+
+	return n;
+}
+
+static int dsa_init_wqs(void)
+{
+	return dsa_scan_wqs(false);
+}
+
+static int dsa_rescan_wqs(void)
+{
+	return dsa_scan_wqs(true);
+}
+
+static void dsa_cleanup_wqs(void)
+{
+	// unmap and close wq portal
+	for (int j = 0; j < num_wqs + num_dwqs; j++)
+		wq_unmap(&wqs[wq_index(j)]);
+}
+
+static int dsa_backend_submit(struct dto_wq *wq, struct dsa_hw_desc *hw)
+{
+	return dsa_portal_submit(wq, hw);
+}
+
+static const struct dto_backend dsa_backend = {
+	.name = "dsa",
+	.max_wqs = dsa_max_wqs,
+	.init = dsa_init_wqs,
+	.rescan = dsa_rescan_wqs,
+	.submit = dsa_backend_submit,
+	.cleanup = dsa_cleanup_wqs,
+};
+
+/* CRC32C (Castagnoli) on CPU. The crc is the raw value, callers invert it
+ * before and after like DSA does with the seed and the result. If dest is
+ * not NULL the data is copied to dest in the same pass.
+ */
+#define CRC32C_POLY 0x82F63B78U
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) dto_unaligned_u64;
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, uint8_t *dest, const uint8_t *src, size_t n)
+{
+	uint64_t c = crc;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		uint64_t v = *(const dto_unaligned_u64 *)(src + i);
+
+		c = _mm_crc32_u64(c, v);
+		if (dest != NULL)
+			*(dto_unaligned_u64 *)(dest + i) = v;
+	}
+	for (; i < n; i++) {
+		c = _mm_crc32_u8((uint32_t)c, src[i]);
+		if (dest != NULL)
+			dest[i] = src[i];
+	}
+	return (uint32_t)c;
+}
+
+/* detect the crc32 instruction for the CPU CRC32C (CPUID.1:ECX[20]) */
+static void detect_crc32(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+		crc32_support = 1;
+}
+
+static uint32_t crc32c_cpu(uint32_t crc, uint8_t *dest, const uint8_t *src, size_t n)
+{
+	if (likely(crc32_support))
+		return crc32c_sse42(crc, dest, src, n);
+
+	for (size_t i = 0; i < n; i++) {
+		crc ^= src[i];
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		if (dest != NULL)
+			dest[i] = src[i];
+	}
+	return crc;
+}
+
+/* Software DSA emulator.
+ *
+ * Each emulated DSA device has one engine group, with one or more shared WQs
+ * that share a ring serviced by a worker thread (the engine). The worker executes the descriptors on CPU (using the std c lib
+ * functions) and writes real completion records, so DTO's submission,
+ * batching, striping, fallback, auto tuning and wait paths can be exercised
+ * on systems without DSA. Latency, bandwidth, page faults and WQ full
+ * (retry) conditions can be emulated. Dedicated WQs can be added to the
+ * devices; a descriptor submitted to a full dedicated WQ, which hardware
+ * would drop, is reported and completed with an error.
+ */
+#define EMUL_MAX_DEVICES 32
+#define EMUL_WQ_SIZE 128
+#define EMUL_DWQ_SIZE 16
+#define EMUL_MAX_TRANSFER_SIZE (2 * 1024 * 1024)
+#define EMUL_MAX_BATCH_SIZE 32
+#define EMUL_DEFAULT_LATENCY_NS 1000
+#define EMUL_SLEEP_THRESHOLD_NS 50000
+
+struct dto_emul_dev {
+	struct dsa_hw_desc ring[EMUL_WQ_SIZE] __attribute__((aligned(64)));
+	uint32_t ring_wq[EMUL_WQ_SIZE];	/* index in wqs[] of the submitter */
+	uint32_t head;		/* next descriptor to execute */
+	uint32_t tail;		/* next free ring entry */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t worker;
+	bool running;
+	uint64_t num_submits;
+	uint64_t num_descs;
+};
+
+static struct dto_emul_dev emul_devs[EMUL_MAX_DEVICES];
+static int emul_num_devs = 1;
+static int emul_num_wqs = 1;		// SWQs per device
+static uint64_t emul_latency_ns = EMUL_DEFAULT_LATENCY_NS;
+static uint64_t emul_bandwidth;		// MB/s per device, 0 - unlimited
+static uint64_t emul_pf_rate;		// page fault every Nth descriptor, 0 - never
+static uint64_t emul_retry_rate;	// reject every Nth submission, 0 - never
+static uint64_t emul_slowdown = 1;	// device 0 is this many times slower
+static uint32_t *emul_wq_queued;	// ring entries used per WQ, dto_max_wqs entries
+static uint64_t emul_num_dwqs;
+static bool emul_stop;
+
+static __always_inline uint64_t emul_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* the descriptor is copied without memcpy to avoid recursing into DTO */
+static __always_inline void emul_copy_desc(struct dsa_hw_desc *dst, const struct dsa_hw_desc *src)
+{
+	struct dsa_raw_desc *d = (struct dsa_raw_desc *)dst;
+	const struct dsa_raw_desc *s = (const struct dsa_raw_desc *)src;
+
+	for (int i = 0; i < 8; i++)
+		d->field[i] = s->field[i];
+}
+
+/* Delay completion of a descriptor started at start_ns according to the
+ * emulated latency and bandwidth. Device 0 can be slowed down, as if it
+ * was shared with another busy process.
+ */
+static void emul_delay(struct dto_emul_dev *dev, uint64_t start_ns, size_t bytes)
+{
+	uint64_t delay = emul_latency_ns;
+	uint64_t end, now;
+
+	if (emul_bandwidth)
+		delay += bytes * 1000 / emul_bandwidth;
+	if (dev == &emul_devs[0])
+		delay *= emul_slowdown;
+	end = start_ns + delay;
+
+	while ((now = emul_now_ns()) < end) {
+		if (end - now > EMUL_SLEEP_THRESHOLD_NS) {
+			uint64_t ns = end - now - EMUL_SLEEP_THRESHOLD_NS / 2;
+			struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+			nanosleep(&ts, NULL);
+		} else
+			_mm_pause();
+	}
+}
+
+static void emul_fill(uint8_t *dst, uint64_t pattern, size_t n)
+{
+	const uint8_t *p = (const uint8_t *)&pattern;
+	size_t i = 0;
+
+	if (pattern == (pattern & 0xFF) * 0x0101010101010101ULL) {
+		orig_memset(dst, p[0], n);
+		return;
+	}
+
+	for (; i + 8 <= n; i += 8)
+		*(uint64_t *)(dst + i) = pattern;
+	for (; i < n; i++)
+		dst[i] = p[i & 7];
+}
+
+/* Returns the offset of the first difference, or n if the buffers are equal */
+static size_t emul_compare(const uint8_t *s1, const uint8_t *s2, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4096 <= n; i += 4096)
+		if (orig_memcmp(s1 + i, s2 + i, 4096))
+			break;
+	for (; i < n; i++)
+		if (s1[i] != s2[i])
+			break;
+
+	return i;
+}
+
+static void emul_complete(struct dsa_hw_desc *hw, uint8_t status, uint8_t result,
+		uint32_t bytes_completed, uint64_t fault_addr, uint32_t crc)
+{
+	struct dsa_completion_record *comp = (struct dsa_completion_record *)hw->completion_addr;
+
+	if (!(hw->flags & IDXD_OP_FLAG_CRAV) || comp == NULL)
+		return;
+
+	comp->result = result;
+	comp->bytes_completed = bytes_completed;
+	comp->fault_addr = fault_addr;
+	if (hw->opcode == DSA_OPCODE_CRCGEN || hw->opcode == DSA_OPCODE_COPY_CRC)
+		comp->crc_val = crc;
+	/* status must become visible last */
+	atomic_thread_fence(memory_order_release);
+	comp->status = status;
+}
+
+static uint8_t emul_execute(struct dto_emul_dev *dev, struct dsa_hw_desc *hw, bool in_batch)
+{
+	uint64_t start = emul_now_ns();
+	uint32_t n = hw->xfer_size;
+	uint32_t done = n;
+	uint64_t fault_addr = 0;
+	uint8_t status = DSA_COMP_SUCCESS;
+	uint8_t result = 0;
+	uint32_t crc = 0;
+
+	switch (hw->opcode) {
+	case DSA_OPCODE_NOOP:
+		done = 0;
+		break;
+	case DSA_OPCODE_MEMMOVE:
+	case DSA_OPCODE_MEMFILL:
+	case DSA_OPCODE_COMPARE:
+		if (n > EMUL_MAX_TRANSFER_SIZE) {
+			status = DSA_COMP_XFER_ERANGE;
+			done = 0;
+			break;
+		}
+
+		/* inject a page fault half way through the transfer. With
+		 * block on fault the device resolves the fault itself.
+		 */
+		if (emul_pf_rate && (++dev->num_descs % emul_pf_rate) == 0 &&
+			!(hw->flags & IDXD_OP_FLAG_BOF)) {
+			done = (n / 2) & ~0xFFFU;
+			status = DSA_COMP_PAGE_FAULT_NOBOF;
+		}
+
+		if (hw->opcode == DSA_OPCODE_MEMMOVE) {
+			orig_memmove((void *)hw->dst_addr, (void *)hw->src_addr, done);
+			if (status != DSA_COMP_SUCCESS) {
+				status |= DSA_COMP_STATUS_WRITE;
+				fault_addr = hw->dst_addr + done;
+			}
+		} else if (hw->opcode == DSA_OPCODE_MEMFILL) {
+			emul_fill((uint8_t *)hw->dst_addr, hw->pattern, done);
+			if (status != DSA_COMP_SUCCESS) {
+				status |= DSA_COMP_STATUS_WRITE;
+				fault_addr = hw->dst_addr + done;
+			}
+		} else {
+			size_t diff = emul_compare((uint8_t *)hw->src_addr, (uint8_t *)hw->src2_addr, done);
+
+			if (diff < done) {
+				/* a mismatch before the fault completes the compare */
+				status = DSA_COMP_SUCCESS;
+				result = 1;
+				done = diff;
+			} else if (status != DSA_COMP_SUCCESS) {
+				fault_addr = hw->src_addr + done;
+			}
+		}
+		break;
+	case DSA_OPCODE_CRCGEN:
+	case DSA_OPCODE_COPY_CRC:
+		if (n > EMUL_MAX_TRANSFER_SIZE) {
+			status = DSA_COMP_XFER_ERANGE;
+			done = 0;
+			break;
+		}
+		/* the seed and the result are inverted, so CRCs can be chained */
+		crc = ~crc32c_cpu(~hw->crc_seed, hw->opcode == DSA_OPCODE_COPY_CRC ?
+			(uint8_t *)hw->dst_addr : NULL, (const uint8_t *)hw->src_addr, n);
+		break;
+	case DSA_OPCODE_BATCH: {
+		struct dsa_hw_desc *list = (struct dsa_hw_desc *)hw->desc_list_addr;
+		uint32_t count = hw->desc_count;
+
+		if (in_batch) {
+			status = DSA_COMP_BAD_OPCODE;
+			done = 0;
+			break;
+		}
+		if (count < 2 || count > EMUL_MAX_BATCH_SIZE) {
+			status = DSA_COMP_DESC_CNT_ERANGE;
+			done = 0;
+			break;
+		}
+		if (hw->desc_list_addr & 0x3F) {
+			status = DSA_COMP_DESCLIST_ALIGN;
+			done = 0;
+			break;
+		}
+
+		/* bytes completed of a batch is the number of descriptors processed.
+		 * A fenced descriptor after a failed one is abandoned with the
+		 * rest of the batch.
+		 */
+		for (done = 0; done < count; done++) {
+			struct dsa_hw_desc desc;
+
+			emul_copy_desc(&desc, &list[done]);
+			if ((desc.flags & IDXD_OP_FLAG_FENCE) && status != DSA_COMP_SUCCESS)
+				break;
+			if (emul_execute(dev, &desc, true) != DSA_COMP_SUCCESS)
+				status = DSA_COMP_BATCH_FAIL;
+		}
+		emul_complete(hw, status, 0, done, 0, 0);
+		return status;
+	}
+	default:
+		status = DSA_COMP_BAD_OPCODE;
+		done = 0;
+	}
+
+	emul_delay(dev, start, done);
+	emul_complete(hw, status, result, done, fault_addr, crc);
+
+	return status;
+}
+
+static void *emul_worker(void *arg)
+{
+	struct dto_emul_dev *dev = arg;
+	struct dsa_hw_desc desc;
+
+	pthread_mutex_lock(&dev->lock);
+	while (!emul_stop) {
+		if (dev->head == dev->tail) {
+			pthread_cond_wait(&dev->cond, &dev->lock);
+			continue;
+		}
+		emul_copy_desc(&desc, &dev->ring[dev->head % EMUL_WQ_SIZE]);
+		pthread_mutex_unlock(&dev->lock);
+
+		emul_execute(dev, &desc, false);
+
+		/* the ring entry is only released after execution, like a WQ slot */
+		pthread_mutex_lock(&dev->lock);
+		--emul_wq_queued[dev->ring_wq[dev->head % EMUL_WQ_SIZE]];
+		dev->head++;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return NULL;
+}
+
+static int emul_submit(struct dto_wq *wq, struct dsa_hw_desc *hw)
+{
+	struct dto_emul_dev *dev = &emul_devs[wq->dev_id];
+	int i = wq - wqs;
+	int ret = SUCCESS;
+
+	pthread_mutex_lock(&dev->lock);
+	if (wq->dedicated) {
+		/* MOVDIR64B can't be rejected */
+		if (emul_wq_queued[i] == (uint32_t)wq->wq_size ||
+				dev->tail - dev->head == EMUL_WQ_SIZE) {
+			pthread_mutex_unlock(&dev->lock);
+			LOG_ERROR("descriptor submitted to full dedicated WQ %s\n", wq->wq_path);
+			emul_complete(hw, DSA_COMP_HW_ERR1, 0, 0, 0, 0);
+			return SUCCESS;
+		}
+	} else if ((emul_retry_rate && (++dev->num_submits % emul_retry_rate) == 0) ||
+			dev->tail - dev->head == EMUL_WQ_SIZE) {
+		ret = RETRY;
+	}
+	if (ret == SUCCESS) {
+		emul_copy_desc(&dev->ring[dev->tail % EMUL_WQ_SIZE], hw);
+		dev->ring_wq[dev->tail % EMUL_WQ_SIZE] = i;
+		++emul_wq_queued[i];
+		dev->tail++;
+		pthread_cond_signal(&dev->cond);
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return ret;
+}
+
+static void emul_cleanup(void)
+{
+	emul_stop = true;
+
+	for (int i = 0; i < EMUL_MAX_DEVICES; i++) {
+		struct dto_emul_dev *dev = &emul_devs[i];
+
+		if (!dev->running)
+			continue;
+
+		pthread_mutex_lock(&dev->lock);
+		pthread_cond_broadcast(&dev->cond);
+		pthread_mutex_unlock(&dev->lock);
+
+		pthread_join(dev->worker, NULL);
+		dev->running = false;
+	}
+}
+
+static uint64_t emul_get_env(const char *name, uint64_t def)
+{
+	const char *env_str = getenv(name);
+	uint64_t val;
+
+	if (env_str == NULL)
+		return def;
+
+	errno = 0;
+	val = strtoull(env_str, NULL, 10);
+	if (errno)
+		return def;
+
+	return val;
+}
+
+static int emul_get_num_devs(void)
+{
+	int num_devs = emul_get_env("DTO_EMUL_DEVICES", 1);
+
+	return num_devs < 1 || num_devs > EMUL_MAX_DEVICES ? 1 : num_devs;
+}
+
+static int emul_get_num_wqs(void)
+{
+	int num = emul_get_env("DTO_EMUL_WQS", 1);
+
+	return num < 1 || num > EMUL_WQ_SIZE ? 1 : num;
+}
+
+static int emul_max_wqs(void)
+{
+	return emul_get_num_devs() * emul_get_num_wqs() + (int)emul_get_env("DTO_EMUL_DWQS", 0);
+}
+
+/* Find the emulated WQs. DTO_EMUL_DEVICES, DTO_EMUL_WQS and DTO_EMUL_DWQS are
+ * read again by rescans, so a test can add and remove devices by changing them. The worker
+ * of a removed device keeps running until exit.
+ */
+static int emul_scan(bool rescan)
+{
+	char path[PATH_MAX];
+	int num_nodes = 1;
+	int num_devs;
+	int rc;
+
+	if (is_numa_aware)
+		num_nodes = numa_num_configured_nodes();
+
+	num_devs = emul_get_num_devs();
+	emul_num_wqs = emul_get_num_wqs();
+
+	/* the WQs that don't fit in the topology are left out by wq_alloc() */
+	emul_num_dwqs = emul_get_env("DTO_EMUL_DWQS", 0);
+	if (emul_num_dwqs > dto_max_wqs)
+		emul_num_dwqs = dto_max_wqs;
+
+	for (int i = 0; i < num_devs; i++) {
+		struct dto_emul_dev *dev = &emul_devs[i];
+
+		if (dev->running)
+			continue;
+
+		dev->head = 0;
+		dev->tail = 0;
+		dev->num_submits = 0;
+		dev->num_descs = 0;
+		pthread_mutex_init(&dev->lock, NULL);
+		pthread_cond_init(&dev->cond, NULL);
+
+		rc = pthread_create(&dev->worker, NULL, emul_worker, dev);
+		if (rc) {
+			LOG_ERROR("emulator worker creation failed: %s\n", strerror(rc));
+			if (rescan) {
+				num_devs = i;
+				break;
+			}
+			emul_cleanup();
+			return -rc;
+		}
+		dev->running = true;
+	}
+	emul_num_devs = num_devs;
+
+	/* shared WQs, interleaved over the devices */
+	for (int i = 0; i < num_devs * emul_num_wqs; i++) {
+		struct dto_wq *wq;
+		int d = i % num_devs;
+
+		snprintf(path, PATH_MAX, "emulator/wq%d.%d", d, i / num_devs);
+		if (wq_find(path, false) != NULL)
+			continue;
+
+		wq = wq_alloc(false);
+		if (wq == NULL)
+			break;
+
+		snprintf(wq->wq_path, PATH_MAX, "%s", path);
+		wq->acc_wq = NULL;
+		wq->dsa_gencap = GENCAP_CC_MEMORY;
+		wq->wq_size = EMUL_WQ_SIZE;
+		wq->max_transfer_size = EMUL_MAX_TRANSFER_SIZE;
+		wq->max_batch_size = EMUL_MAX_BATCH_SIZE;
+		wq->block_on_fault = true;
+		wq->wq_fd = -1;
+		wq->wq_portal = NULL;
+		wq->wq_mmapped = false;
+		wq->dev_id = d;
+		/* spread the emulated devices over the numa nodes */
+		wq->numa_node = d % num_nodes;
+		wq->group_id = 0;
+		wq->num_engines = 1;
+		wq->dedicated = false;
+		wq_add(wq);
+	}
+
+	/* dedicated WQs, spread over the devices */
+	for (int i = 0; i < (int)emul_num_dwqs; i++) {
+		struct dto_wq *wq;
+		int d = i % num_devs;
+
+		snprintf(path, PATH_MAX, "emulator/wq%d.%d", d, emul_num_wqs + i / num_devs);
+		if (wq_find(path, true) != NULL)
+			continue;
+
+		wq = wq_alloc(true);
+		if (wq == NULL)
+			break;
+
+		snprintf(wq->wq_path, PATH_MAX, "%s", path);
+		wq->acc_wq = NULL;
+		wq->dsa_gencap = GENCAP_CC_MEMORY;
+		wq->wq_size = EMUL_DWQ_SIZE;
+		wq->max_transfer_size = EMUL_MAX_TRANSFER_SIZE;
+		wq->max_batch_size = EMUL_MAX_BATCH_SIZE;
+		wq->block_on_fault = true;
+		wq->wq_fd = -1;
+		wq->wq_portal = NULL;
+		wq->wq_mmapped = false;
+		wq->dev_id = d;
+		wq->numa_node = d % num_nodes;
+		wq->group_id = 0;
+		wq->num_engines = 1;
+		wq->dedicated = true;
+		wq_add(wq);
+	}
+
+	return 0;
+}
+
+static int emul_init(void)
+{
+	int rc;
+
+	emul_latency_ns = emul_get_env("DTO_EMUL_LATENCY_NS", EMUL_DEFAULT_LATENCY_NS);
+	emul_bandwidth = emul_get_env("DTO_EMUL_BANDWIDTH", 0);
+	emul_pf_rate = emul_get_env("DTO_EMUL_PF_RATE", 0);
+	emul_retry_rate = emul_get_env("DTO_EMUL_RETRY_RATE", 0);
+	emul_slowdown = emul_get_env("DTO_EMUL_SLOWDOWN", 1);
+	if (emul_slowdown == 0)
+		emul_slowdown = 1;
+
+	if (emul_wq_queued == NULL) {
+		void *p = mmap(NULL, dto_max_wqs * sizeof(*emul_wq_queued), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (p == MAP_FAILED) {
+			LOG_ERROR("emulator WQ counters allocation failed\n");
+			return -ENOMEM;
+		}
+		emul_wq_queued = p;
+	}
+
+	emul_stop = false;
+	for (uint32_t i = 0; i < dto_max_wqs; i++)
+		emul_wq_queued[i] = 0;
+	/* the workers of the parent don't exist in a child */
+	for (int i = 0; i < EMUL_MAX_DEVICES; i++)
+		emul_devs[i].running = false;
+
+	rc = emul_scan(false);
+	if (rc)
+		return rc;
+
+	LOG_TRACE("DSA emulator: devices: %d, wqs: %d, dwqs: %lu, latency: %lu ns, bandwidth: %lu MB/s, "
+		"pf_rate: %lu, retry_rate: %lu, slowdown: %lu\n", emul_num_devs, emul_num_wqs, emul_num_dwqs, emul_latency_ns,
+		emul_bandwidth, emul_pf_rate, emul_retry_rate, emul_slowdown);
+
+	return 0;
+}
+
+static int emul_rescan(void)
+{
+	return emul_scan(true);
+}
+
+static const struct dto_backend emul_backend = {
+	.name = "emulator",
+	.max_wqs = emul_max_wqs,
+	.init = emul_init,
+	.rescan = emul_rescan,
+	.submit = emul_submit,
+	.cleanup = emul_cleanup,
+};
+
+static void *wq_topology_alloc(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/* Size the WQ topology for the WQs the backend may find, see DTO_MIN_WQS.
+ * A child keeps the topology of its parent.
+ */
+static int init_wq_topology(void)
+{
+	const char *env_str;
+	uint32_t max_wqs = 0;
+
+	if (wqs != NULL)
+		return 0;
+
+	dto_num_nodes = numa_available() != -1 ? numa_max_node() + 1 : 1;
+
+	env_str = getenv("DTO_MAX_WQS");
+	if (env_str != NULL) {
+		errno = 0;
+		max_wqs = strtoul(env_str, NULL, 10);
+		if (errno || max_wqs == 0) {
+			LOG_ERROR("Invalid DTO_MAX_WQS %s\n", env_str);
+			max_wqs = 0;
+		}
+	}
+	if (max_wqs == 0) {
+		int n = dto_backend->max_wqs();
+
+		max_wqs = n > DTO_MIN_WQS ? n : DTO_MIN_WQS;
+	}
+	dto_max_wqs = max_wqs;
+
+	wqs = wq_topology_alloc(dto_max_wqs * sizeof(struct dto_wq));
+	wq_scratch = wq_topology_alloc(4 * dto_max_wqs * sizeof(int));
+	wq_order = wq_topology_alloc(dto_max_wqs * sizeof(struct dto_wq *));
+	if (wqs == NULL || wq_scratch == NULL || wq_order == NULL)
+		goto fail;
+
+	for (int i = 0; i < DTO_WQ_TABLES; i++) {
+		struct dto_wq_table *t = &wq_tables[i];
+
+		t->all.wqs = wq_topology_alloc(dto_max_wqs * sizeof(struct dto_wq *));
+		t->nodes = wq_topology_alloc(dto_num_nodes * sizeof(struct dto_device));
+		t->devices = wq_topology_alloc(dto_num_nodes * sizeof(struct dto_device *));
+		if (t->all.wqs == NULL || t->nodes == NULL || t->devices == NULL)
+			goto fail;
+
+		for (int node = 0; node < dto_num_nodes; node++) {
+			t->nodes[node].wqs = wq_topology_alloc(dto_max_wqs * sizeof(struct dto_wq *));
+			if (t->nodes[node].wqs == NULL)
+				goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	/* the allocated part is kept, offload stays disabled */
+	LOG_ERROR("WQ topology allocation for %u WQs and %d numa nodes failed\n",
+		dto_max_wqs, dto_num_nodes);
+	wqs = NULL;
+	dto_max_wqs = 0;
+	dto_num_nodes = 0;
+	return -ENOMEM;
+}
+
+static int dsa_init(void)
+{
+	unsigned int unused[2];
+	unsigned int leaf, waitpkg;
+	const char *env_str;
+	int rc;
+
+	/* detect waitpkg support (CPUID.(EAX=7,ECX=0):ECX[5]) */
+	leaf = 0;
+	waitpkg = 0;
+	if (__get_cpuid_count(7, 0, &leaf, unused, &waitpkg, unused + 1)) {
+		if (waitpkg & 0x20) {
+			LOG_TRACE("waitpkg supported\n");
+			waitpkg_support = 1;
+		}
+	}
+
+	env_str = getenv("DTO_WAIT_METHOD");
+	if (env_str != NULL) {
+		if (!strncmp(env_str, wait_names[WAIT_BUSYPOLL], strlen(wait_names[WAIT_BUSYPOLL]))) {
+			wait_method = WAIT_BUSYPOLL;
+		} else if (!strncmp(env_str, wait_names[WAIT_UMWAIT], strlen(wait_names[WAIT_UMWAIT]))) {
+			if (waitpkg_support) {
+				wait_method = WAIT_UMWAIT;
+			} else
+				LOG_ERROR("umwait not supported. Falling back to default wait method\n");
+		} else if (!strncmp(env_str, wait_names[WAIT_TPAUSE], strlen(wait_names[WAIT_TPAUSE]))) {
+		    if (waitpkg_support) {
+			wait_method = WAIT_TPAUSE;
+                    } else {
+			LOG_ERROR("tpause not supported. Falling back to busypoll\n");
+                        wait_method = WAIT_BUSYPOLL;
+                    }
+                } else if (!strncmp(env_str, wait_names[WAIT_HYBRID], strlen(wait_names[WAIT_HYBRID]))) {
+			/* without umwait, the middle phase busy polls */
+			wait_method = WAIT_HYBRID;
+		}
+	}
+
+	env_str = getenv("DTO_BACKEND");
+	if (env_str != NULL) {
+		if (!strcmp(env_str, emul_backend.name))
+			dto_backend = &emul_backend;
+		else if (strcmp(env_str, dsa_backend.name))
+			LOG_ERROR("Invalid DTO_BACKEND %s. Using %s\n", env_str, dsa_backend.name);
+	}
+
+	rc = init_wq_topology();
+	if (rc) {
+		dto_no_wqs = true;
+		return rc;
+	}
+
+	/* DSA offload is configured, a rescan can enable it later */
+	wq_rescan_enabled = true;
+	num_wqs = 0;
+	num_dwqs = 0;
+	++wq_scan_gen;
+
+	rc = dto_backend->init();
+	if (rc == 0 && num_wqs == 0) {
+		LOG_ERROR("No shared WQ found\n");
+		wq_remove_all();
+		rc = -EINVAL;
+	}
+	dto_no_wqs = rc != 0;
+	if (rc)
+		return rc;
+
+	publish_wq_table();
+	return 0;
+}
+
+static uint64_t dto_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Rescan the WQs: add the new ones, retire the ones the backend doesn't
+ * find anymore and publish a new WQ table if anything changed. Offload is
+ * disabled while there is no SWQ and enabled again when one is found.
+ * Rescans less than DTO_WQ_RESCAN_MIN_MS after the previous one are skipped.
+ * Returns the number of SWQs in use, -1 if DSA offload isn't configured.
+ */
+static int rescan_wqs(void)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&wq_rescan_lock);
+	if (!wq_rescan_enabled || wq_rescan_stop) {
+		pthread_mutex_unlock(&wq_rescan_lock);
+		return -1;
+	}
+
+	if (dto_now_ms() - wq_rescan_last_ms >= DTO_WQ_RESCAN_MIN_MS) {
+		++wq_scan_gen;
+		wq_scan_changes = 0;
+		dto_backend->rescan();
+
+		for (int j = 0; j < num_wqs + num_dwqs; j++) {
+			struct dto_wq *w = &wqs[wq_index(j)];
+
+			if (!w->retired && w->scan_gen != wq_scan_gen) {
+				LOG_TRACE("WQ %s retired\n", w->wq_path);
+				/* the next table published is the first without it */
+				w->retire_gen = wq_table_gen + 1;
+				w->retired = true;
+				++wq_scan_changes;
+			}
+		}
+
+		for (int i = 0; i < num_wqs; i++)
+			n += !wqs[i].retired;
+
+		if (n == 0) {
+			if (!dto_no_wqs)
+				LOG_ERROR("No shared WQ left. Falling back to using CPUs.\n");
+			dto_no_wqs = true;
+			use_std_lib_calls = 1;
+		} else if (wq_scan_changes != 0) {
+			publish_wq_table();
+			if (dto_no_wqs) {
+				dto_no_wqs = false;
+				use_std_lib_calls = 0;
+			}
+		}
+
+		if (wq_scan_changes != 0)
+			LOG_TRACE("WQ rescan: %u WQs added or retired, %d shared WQs in use, table %u\n",
+				wq_scan_changes, n, wq_table_gen);
+
+		/* the rate limit counts from the end of the scan */
+		wq_rescan_last_ms = dto_now_ms();
+	}
+
+	n = dto_no_wqs ? 0 : get_wq_table()->all.num_wqs;
+	pthread_mutex_unlock(&wq_rescan_lock);
+
+	return n;
+}
+
+static void *wq_rescan_worker(void *arg)
+{
+	struct timespec ts = {
+		.tv_sec = dto_wq_rescan_ms / 1000,
+		.tv_nsec = (dto_wq_rescan_ms % 1000) * 1000000
+	};
+
+	(void)arg;
+	while (wq_rescan_running) {
+		nanosleep(&ts, NULL);
+		if (!wq_rescan_running)
+			break;
+
+		rescan_wqs();
+	}
+
+	return NULL;
+}
+
+/* Start the thread that rescans the WQs every dto_wq_rescan_ms */
+static void start_wq_rescan(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int rc;
+
+	wq_rescan_running = true;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, wq_rescan_worker, NULL);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		LOG_ERROR("WQ rescan thread creation failed: %s\n", strerror(rc));
+		wq_rescan_running = false;
+		return;
+	}
+	/* so that it isn't taken for an application thread in DTO_DWQ_THREADS */
+	pthread_setname_np(thread, "dto_rescan");
+}
+
+/* TSC frequency in kHz, from CPUID leaf 0x15 or measured if it isn't enumerated */
+static uint64_t get_tsc_khz(void)
+{
+	unsigned int den, num, crystal, unused;
+	struct timespec st, et;
+	uint64_t start;
+
+	if (__get_cpuid(0x15, &den, &num, &crystal, &unused) && den && num && crystal)
+		return (uint64_t)crystal * num / den / 1000;
+
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	start = _rdtsc();
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &et);
+	} while (TS_NS(st, et) < NSEC_PER_MSEC);
+
+	return (_rdtsc() - start) * NSEC_PER_MSEC / TS_NS(st, et);
+}
+
+static int init_dto(void)
+{
+	uint8_t init_notcomplete = 0;
+
+	if (atomic_compare_exchange_strong(&dto_initializing, &init_notcomplete, 1)) {
+		char *env_str;
+
+		env_str = getenv("DTO_LOG_FILE");
+		if (env_str != NULL) {
+			char temp[PATH_MAX];
+			struct stat st;
+
+			strncpy(dto_log_path, env_str, PATH_MAX - 1);
+			/* ensure dto_log_path is null terminated */
+			dto_log_path[PATH_MAX - 1] = '\0';
+
+			snprintf(temp, sizeof(temp), ".%s.%d", __progname, getpid());
+			strncat(dto_log_path, temp, PATH_MAX - strlen(dto_log_path) - 1);
+
+			/* Open the log file only if it doesn't exist or if it is a regular file */
+			if (lstat(dto_log_path, &st) == -1 ||
+					(st.st_mode & S_IFMT) == S_IFREG)
+				log_fd = open(dto_log_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+			/* No need to handle the open() error. It will automatically fallback
+			 * to using standard output if log file open failed
+			 */
+		}
+
+		env_str = getenv("DTO_LOG_LEVEL");
+		if (env_str != NULL) {
+			errno = 0;
+			log_level = strtoul(env_str, NULL, 10);
+			if (errno)
+				log_level = LOG_LEVEL_FATAL;
+
+			if (log_level > LOG_LEVEL_TRACE)
+				log_level = LOG_LEVEL_TRACE;
+		}
+
+		/* the CRC APIs use it even when DSA offload is disabled */
+		detect_crc32();
+
+		// save std c lib function pointers
+		orig_memset = dlsym(RTLD_NEXT, "memset");
+		orig_memcpy = dlsym(RTLD_NEXT, "memcpy");
+		orig_memmove = dlsym(RTLD_NEXT, "memmove");
+		orig_memcmp = dlsym(RTLD_NEXT, "memcmp");
+		orig_munmap = dlsym(RTLD_NEXT, "munmap");
+		orig_mbind = dlsym(RTLD_NEXT, "mbind");
+		orig_wmemset = dlsym(RTLD_NEXT, "wmemset");
+		orig_calloc = dlsym(RTLD_NEXT, "calloc");
+		orig_realloc = dlsym(RTLD_NEXT, "realloc");
+
+		/* glibc's malloc is an alias of __libc_malloc */
+		dto_alloc_glibc = dlsym(RTLD_DEFAULT, "malloc") == dlsym(RTLD_DEFAULT, "__libc_malloc");
+
+		env_str = getenv("DTO_USESTDC_CALLS");
+		if (env_str != NULL) {
+			errno = 0;
+			use_std_lib_calls = strtoul(env_str, NULL, 10);
+			if (errno)
+				use_std_lib_calls = 0;
+
+			use_std_lib_calls = !!use_std_lib_calls;
+		}
+
+		env_str = getenv("DTO_DSA_MEMCPY");
+		if (env_str != NULL) {
+			errno = 0;
+			dto_dsa_memcpy = strtoul(env_str, NULL, 10);
+			if (errno)
+				dto_dsa_memcpy = 0;
+
+			dto_dsa_memcpy = !!dto_dsa_memcpy;
+		}
+
+		env_str = getenv("DTO_DSA_CC");
+		if (env_str != NULL) {
+			errno = 0;
+			dto_dsa_cc = strtoul(env_str, NULL, 10);
+			if (errno || dto_dsa_cc > DTO_CC_ADAPTIVE)
+				dto_dsa_cc = 0;
+		}
+
+		env_str = getenv("DTO_CC_MAX_BYTES");
+		if (env_str != NULL) {
+			errno = 0;
+			dto_cc_max_size = strtoul(env_str, NULL, 10);
+			if (errno)
+				dto_cc_max_size = DTO_DEFAULT_CC_MAX_SIZE;
+		}
+
+		if (dto_dsa_cc == DTO_CC_ADAPTIVE) {
+			long llc_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+
+			dto_llc_size = llc_size > 0 ? llc_size : 0;
+			env_str = getenv("DTO_CC_LLC_OCCUPANCY");
+			if (dto_llc_size)
+				llc_occupancy_fd = open(env_str != NULL ? env_str : DTO_CC_LLC_OCCUPANCY,
+					O_RDONLY | O_CLOEXEC);
+		}
+
+		env_str = getenv("DTO_CALLSITE_POLICY");
+		if (env_str != NULL) {
+			errno = 0;
+			dto_callsite_policy = strtoul(env_str, NULL, 10);
+			if (errno)
+				dto_callsite_policy = 0;
+
+			dto_callsite_policy = !!dto_callsite_policy;
+		}
+
+		env_str = getenv("DTO_DSA_MEMMOVE");
+		if (env_str != NULL) {
+			errno = 0;
+			dto_dsa_memmove = strtoul(env_str, NULL, 10);
+			if (errno)
+				dto_dsa_memmove = 0;
+
+			dto_dsa_memmove = !!dto_dsa_memmove;
+		}
+
+		env_str = getenv("DTO_DSA_MEMSET");
+		if (env_str != NULL) {
+			errno = 0;
+			dto_dsa_memset = strtoul(env_str, NULL, 10);
+			if (errno)
+				dto_dsa_memset = 0;
+
+			dto_dsa_memset = !!dto_dsa_memset;
+		}
+
+		env_str = getenv("DTO_DSA_MEMCMP");
+		if (env_str != NULL) {
+			errno = 0;
+			dto_dsa_memcmp = strtoul(env_str, NULL, 10);
+			if (errno)
+				dto_dsa_memcmp = 0;
+
+			dto_dsa_memcmp = !!dto_dsa_memcmp;
+		}
+
+		env_str = getenv("DTO_OVERLAPPING_MEMMOVE_ACTION");
+		if (env_str != NULL) {
+			errno = 0;
+			dto_overlapping_memmove_action = strtoul(env_str, NULL, 10);
+			if (errno)
+				dto_overlapping_memmove_action = OVERLAPPING_CPU;
+		}
+
+#ifdef DTO_STATS_SUPPORT
+		env_str = getenv("DTO_COLLECT_STATS");
+		if (env_str != NULL) {
+			errno = 0;
+			collect_stats = strtoul(env_str, NULL, 10);
+			if (errno)
+				collect_stats = 0;
+
+			collect_stats = !!collect_stats;
+		}
+
+		env_str = getenv("DTO_STATS_SHM");
+		if (env_str != NULL) {
+			errno = 0;
+			dto_stats_shm = strtoul(env_str, NULL, 10);
+			if (errno)
+				dto_stats_shm = 0;
+
+			dto_stats_shm = !!dto_stats_shm;
+		}
+
+		if (collect_stats) {
+			clock_gettime(CLOCK_BOOTTIME, &dto_start_time);
+			/* Change the log level to 'trace' so that the
+			 * stats can be logged
+			 */
+			log_level = LOG_LEVEL_TRACE;
+		}
+#endif
+
+		/* Register fork handler for the child process */
+		if (!fork_handler_registered) {
+			/* If pthread_atfork fails, and process calls fork,
+			 * the child may crash when using DSA offload. Dont
+			 * take that risk and disable DSA offload for parent
+			 * as well.
+			 */
+			if (!pthread_atfork(NULL, NULL, child))
+				fork_handler_registered = 1;
+			else {
+				LOG_ERROR("Setting fork() handler failed. "
+					"Falling back to using CPUs.\n");
+				use_std_lib_calls = 1;
+			}
+		}
+
+		// initialize DSA
+		if (!use_std_lib_calls) {
+			// check environment variables
+			env_str = getenv("DTO_MIN_BYTES");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dsa_min_size = strtoul(env_str, NULL, 10);
+				if (errno)
+					dsa_min_size = DTO_DEFAULT_MIN_SIZE;
+			}
+
+			double cpu_size_fraction_float = 0.0;
+			env_str = getenv("DTO_CPU_SIZE_FRACTION");
+
+			if (env_str != NULL) {
+				errno = 0;
+				cpu_size_fraction_float = strtod(env_str, NULL);
+
+				if (errno || cpu_size_fraction_float < 0 || cpu_size_fraction_float >= 1) {
+					LOG_ERROR("Invalid DTO_CPU_SIZE_FRACTION %s, "
+						"Must be >= 0 and < 1. "
+						"Falling back to default 0.0\n", env_str);
+					cpu_size_fraction_float = 0.0;
+				}
+				/* Use only 2 digits after decimal point */
+				cpu_size_fraction = cpu_size_fraction_float * 100;
+			}
+
+			env_str = getenv("DTO_AUTO_ADJUST_KNOBS");
+
+			if (env_str != NULL) {
+				errno = 0;
+				auto_adjust_knobs = strtoul(env_str, NULL, 10);
+				if (errno)
+					auto_adjust_knobs = 1;
+
+				auto_adjust_knobs = !!auto_adjust_knobs;
+			}
+			init_tune();
+
+			if (numa_available() != -1) {
+				env_str = getenv("DTO_IS_NUMA_AWARE");
+				if (env_str != NULL) {
+					errno = 0;
+					is_numa_aware = strtoul(env_str, NULL, 10);
+					if (errno || is_numa_aware >= NA_LAST_ENTRY) {
+						is_numa_aware = NA_NONE;
+					}
+				}
+			}
+
+			env_str = getenv("DTO_WQ_SELECTION");
+			if (env_str != NULL) {
+				errno = 0;
+				dto_wq_selection = strtoul(env_str, NULL, 10);
+				if (errno || dto_wq_selection >= WQ_SELECT_LAST_ENTRY)
+					dto_wq_selection = WQ_SELECT_LOAD;
+			}
+
+			env_str = getenv("DTO_DWQ_THREADS");
+			if (env_str != NULL) {
+				strncpy(dto_dwq_threads, env_str, sizeof(dto_dwq_threads) - 1);
+				dto_dwq_threads[sizeof(dto_dwq_threads) - 1] = '\0';
+			}
+
+			env_str = getenv("DTO_WQ_RESCAN_MS");
+			if (env_str != NULL) {
+				errno = 0;
+				dto_wq_rescan_ms = strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_wq_rescan_ms = 0;
+				else if (dto_wq_rescan_ms != 0 && dto_wq_rescan_ms < DTO_WQ_RESCAN_MIN_MS)
+					dto_wq_rescan_ms = DTO_WQ_RESCAN_MIN_MS;
+			}
+
+			env_str = getenv("DTO_SUBMIT_RETRIES");
+			if (env_str != NULL) {
+				errno = 0;
+				dto_submit_retries = strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_submit_retries = DTO_DEFAULT_SUBMIT_RETRIES;
+				if (dto_submit_retries > DTO_MAX_SUBMIT_RETRIES)
+					dto_submit_retries = DTO_MAX_SUBMIT_RETRIES;
+			}
+
+			env_str = getenv("DTO_SUBMIT_FAILOVER");
+			if (env_str != NULL) {
+				errno = 0;
+				dto_submit_failover = !!strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_submit_failover = true;
+			}
+
+			env_str = getenv("DTO_BATCH_SIZE");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_batch_size = strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_batch_size = DTO_MAX_BATCH_SIZE;
+				if (dto_batch_size > DTO_MAX_BATCH_SIZE)
+					dto_batch_size = DTO_MAX_BATCH_SIZE;
+			}
+
+			env_str = getenv("DTO_STRIPE_MIN_BYTES");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_stripe_min_size = strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_stripe_min_size = 0;
+			}
+
+			env_str = getenv("DTO_MAX_STRIPES");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_max_stripes = strtoul(env_str, NULL, 10);
+				if (errno || dto_max_stripes > DTO_MAX_STRIPES)
+					dto_max_stripes = DTO_MAX_STRIPES;
+			}
+
+			env_str = getenv("DTO_PF_RESUME");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_pf_resume = !!strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_pf_resume = true;
+			}
+
+			env_str = getenv("DTO_BOF_MIN_BYTES");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_bof_min_size = strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_bof_min_size = 0;
+			}
+
+			env_str = getenv("DTO_ALLOC_OFFLOAD");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_alloc_offload = !!strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_alloc_offload = false;
+				if (dto_alloc_offload && !dto_alloc_glibc) {
+					LOG_ERROR("calloc/realloc offload requires glibc malloc, disabled\n");
+					dto_alloc_offload = false;
+				}
+			}
+
+			env_str = getenv("DTO_ALLOC_MIN_BYTES");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_alloc_min_size = strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_alloc_min_size = DTO_DEFAULT_ALLOC_MIN_SIZE;
+			}
+
+			env_str = getenv("DTO_UMWAIT_DELAY");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_umwait_delay = strtoul(env_str, NULL, 10);
+				if (errno || dto_umwait_delay == 0)
+					dto_umwait_delay = UMWAIT_DELAY_DEFAULT;
+			}
+
+			env_str = getenv("DTO_WAIT_SPIN_NS");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_wait_spin_ns = strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_wait_spin_ns = DTO_DEFAULT_WAIT_SPIN_NS;
+			}
+
+			env_str = getenv("DTO_WAIT_YIELD_NS");
+
+			if (env_str != NULL) {
+				errno = 0;
+				dto_wait_yield_ns = strtoul(env_str, NULL, 10);
+				if (errno)
+					dto_wait_yield_ns = DTO_DEFAULT_WAIT_YIELD_NS;
+			}
+
+			if (dsa_init()) {
+				LOG_ERROR("Didn't find any usable DSAs. Falling back to using CPUs.\n");
+				use_std_lib_calls = 1;
+			}
+
+			/* dsa_init() parses DTO_WAIT_METHOD */
+			if (wait_method == WAIT_HYBRID) {
+				uint64_t tsc_khz = get_tsc_khz();
+
+				wait_spin_cycles = dto_wait_spin_ns * tsc_khz / 1000000;
+				wait_yield_cycles = dto_wait_yield_ns * tsc_khz / 1000000;
+				LOG_TRACE("TSC freq = %lu kHz, hybrid wait spin: %lu cycles, yield: %lu cycles\n",
+					tsc_khz, wait_spin_cycles, wait_yield_cycles);
+			}
+
+                        // calculate the wait time for TPAUSE
+                        if (wait_method == WAIT_TPAUSE) {
+    			        unsigned int num, den, freq;
+    			        unsigned int empty;
+    			        unsigned long long tmp;
+    			        __get_cpuid( 0x15, &den, &num, &freq, &empty );
+    			        freq /= 1000;
+    			        LOG_TRACE( "Core Freq = %u kHz\n", freq );
+    			        LOG_TRACE( "TSC Mult  = %u\n", num );
+    			        LOG_TRACE( "TSC Den   = %u\n", den );
+    			        freq *= num;
+    			        freq /= den;
+    			        LOG_TRACE( "CPU freq = %u kHz\n", freq );
+
+    			        LOG_TRACE( "Requested wait: %llu nsec\n", tpause_wait_time );
+    			        tmp = tpause_wait_time;
+    			        tmp *= freq;
+    			        tpause_wait_time = tmp / NSEC_PER_MSEC;
+    			        LOG_TRACE( "Requested wait duration: %llu cycles\n", tpause_wait_time );
+                        }
+    
+			// display configuration
+			LOG_TRACE("log_level: %d, collect_stats: %d, use_std_lib_calls: %d, dsa_min_size: %lu, "
+				"cpu_size_fraction: %.2f, wait_method: %s, auto_adjust_knobs: %d, numa_awareness: %s, dto_dsa_cc: %d, "
+				"batch_size: %u, stripe_min_size: %lu, max_stripes: %d, backend: %s, pf_resume: %d, bof_min_size: %lu, "
+				"alloc_offload: %d, alloc_min_size: %lu, callsite_policy: %d, cc_max_size: %lu, llc_size: %lu, "
+				"llc_occupancy: %s, wq_selection: %s, submit_retries: %u, submit_failover: %d, "
+				"dwqs: %u, dwq_threads: %s, wq_rescan_ms: %lu, max_wqs: %u\n",
+				log_level, collect_stats, use_std_lib_calls, dsa_min_size,
+				cpu_size_fraction_float, wait_names[wait_method], auto_adjust_knobs, numa_aware_names[is_numa_aware], dto_dsa_cc,
+				dto_batch_size, dto_stripe_min_size, dto_max_stripes, dto_backend->name, dto_pf_resume, dto_bof_min_size,
+				dto_alloc_offload, dto_alloc_min_size, dto_callsite_policy, dto_cc_max_size, dto_llc_size,
+				llc_occupancy_fd >= 0 ? "yes" : "no", wq_selection_names[dto_wq_selection],
+				dto_submit_retries, dto_submit_failover, num_dwqs, dto_dwq_threads, dto_wq_rescan_ms,
+				dto_max_wqs);
+			for (int j = 0; j < num_wqs + num_dwqs; j++) {
+				int i = wq_index(j);
+
+				LOG_TRACE("[%d] wq_path: %s, wq_size: %d, dsa_cap: %lx, max_batch_size: %u, dsa_id: %d, block_on_fault: %d, "
+					"mode: %s, group: %d, engines: %d\n", j, wqs[i].wq_path, wqs[i].wq_size, wqs[i].dsa_gencap,
+					wqs[i].max_batch_size, wqs[i].dev_id, wqs[i].block_on_fault,
+					wqs[i].dedicated ? "dedicated" : "shared", wqs[i].group_id, wqs[i].num_engines);
+			}
+			log_wq_topology();
+		}
+#ifdef DTO_STATS_SUPPORT
+		if (collect_stats && dto_stats_shm)
+			init_stats_shm();
+#endif
+		if (wq_rescan_enabled && dto_wq_rescan_ms != 0)
+			start_wq_rescan();
+		dto_initialized = 1;
+
+		return DTO_INITIALIZED;
+	}
+
+	return DTO_INITIALIZING;
+}
+
+static void cleanup_dto(void)
+{
+	/* a rescan in progress completes first */
+	wq_rescan_running = false;
+	pthread_mutex_lock(&wq_rescan_lock);
+	wq_rescan_stop = true;
+	pthread_mutex_unlock(&wq_rescan_lock);
+
+	dto_backend->cleanup();
+#ifdef DTO_STATS_SUPPORT
+	cleanup_stats_shm();
+	print_stats();
+#endif
+	if (dto_callsite_policy)
+		print_callsites();
+	if (log_fd != -1)
+		close(log_fd);
+}
+
+static struct dto_wq *get_thr_dwq(void);
+
+static __always_inline float wq_load(struct dto_wq *wq, size_t n)
+{
+	return (float)(wq->inflight + n) * wq->cost *
+		(1.0f + DTO_WQ_RETRY_WEIGHT * wq->retry_rate);
+}
+
+/* Pick a WQ of list for an operation of n bytes (see wq_selection) */
+static __always_inline struct dto_wq *select_wq(struct dto_wq **list, uint32_t num,
+	atomic_uint *next, size_t n)
+{
+	uint32_t i = (*next)++ % num;
+	struct dto_wq *a = list[i];
+	struct dto_wq *b;
+	uint32_t r;
+
+	if (dto_wq_selection != WQ_SELECT_LOAD || num == 1)
+		return a;
+
+	/* xorshift32, seeded per thread */
+	r = thr_wq_seed;
+	if (r == 0)
+		r = (uint32_t)_rdtsc() | 1;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	thr_wq_seed = r;
+
+	if ((r >> 16) % DTO_WQ_PROBE_INTERVAL == 0)
+		return a;
+
+	/* a random WQ other than a */
+	b = list[(i + 1 + r % (num - 1)) % num];
+
+	return wq_load(b, n) < wq_load(a, n) ? b : a;
+}
+
+static __always_inline struct dto_wq *get_wq(void *buf, size_t n)
+{
+	struct dto_wq* wq = NULL;
+	struct dto_wq_table *t;
+
+	/* threads that lease a DWQ use it */
+	if (unlikely(num_dwqs != 0)) {
+		wq = thr_dwq_checked && (thr_dwq == NULL || !thr_dwq->retired) ? thr_dwq : get_thr_dwq();
+		if (wq != NULL)
+			return wq;
+	}
+
+	t = get_wq_table();
+	if (is_numa_aware) {
+		int status[1] = {-1};
+
+		// get the numa node for the target DSA device
+		const int numa_node = get_numa_node(buf);
+		if (numa_node >= 0 && numa_node < dto_num_nodes) {
+			struct dto_device* dev = t->devices[numa_node];
+			if (dev != NULL &&
+				dev->num_wqs > 0) {
+				wq = select_wq(dev->wqs, dev->num_wqs, &dev->next_wq, n);
+			}
+		}
+	}
+
+	if (wq == NULL) {
+		wq = select_wq(t->all.wqs, t->all.num_wqs, &t->all.next_wq, n);
+	}
+
+	return wq;
+}
+
+static uint32_t dto_pf_now_ms(void);
+
+/* Entries of cc_written pack the lower 36 bits of the page number, the call
+ * site slot + 1 (0 if none) in 11 bits and the time in ms in the lower 17
+ * bits. Entries of cc_hot are packed like the pf_table entries.
+ */
+static __always_inline atomic_ullong *cc_entry(atomic_ullong *table, uint64_t page)
+{
+	return &table[(page ^ (page >> 8)) % DTO_CC_TABLE_SIZE];
+}
+
+static bool cc_is_hot(uint64_t page)
+{
+	uint64_t entry = *cc_entry(cc_hot, page);
+
+	if (entry == 0 || (entry >> 24) != (page & 0xFFFFFFFFFF))
+		return false;
+
+	return ((dto_pf_now_ms() - entry) & 0xFFFFFF) < DTO_CC_HOT_TTL_MS;
+}
+
+/* buf is the source of an intercepted call: check if DSA wrote it recently */
+static void cc_note_read(const void *buf)
+{
+	uint64_t page = (uint64_t)buf >> DTO_PAGE_SHIFT;
+	atomic_ullong *e = cc_entry(cc_written, page);
+	uint64_t entry = *e;
+	uint32_t slot, now;
+
+	if (entry == 0 || (entry >> 28) != (page & 0xFFFFFFFFF))
+		return;
+
+	now = dto_pf_now_ms();
+	if (((now - entry) & 0x1FFFF) >= DTO_CC_REUSE_MS)
+		return;
+
+	/* count each write once */
+	if (!atomic_compare_exchange_strong(e, &entry, 0))
+		return;
+
+	*cc_entry(cc_hot, page) = (page << 24) | (now & 0xFFFFFF);
+	slot = (entry >> 17) & 0x7FF;
+	if (slot)
+		dto_callsites[slot - 1].cc_reused++;
+}
+
+/* LLC occupancy hint from resctrl, refreshed by one thread at a time */
+static bool cc_llc_pressure(void)
+{
+	unsigned int last = llc_checked_ms;
+	unsigned int now;
+	char buf[32];
+	ssize_t len;
+
+	if (llc_occupancy_fd < 0)
+		return false;
+
+	now = dto_pf_now_ms();
+	if (now - last < DTO_CC_LLC_CHECK_MS ||
+		!atomic_compare_exchange_strong(&llc_checked_ms, &last, now))
+		return llc_pressure;
+
+	len = pread(llc_occupancy_fd, buf, sizeof(buf) - 1, 0);
+	if (len > 0) {
+		buf[len] = '\0';
+		llc_pressure = strtoull(buf, NULL, 10) * 100 > dto_llc_size * DTO_CC_LLC_PRESSURE_PCT;
+	}
+	return llc_pressure;
+}
+
+static bool cc_choose(const void *dest, size_t n)
+{
+	uint64_t page = (uint64_t)dest >> DTO_PAGE_SHIFT;
+	struct dto_callsite *cs = thr_callsite.cs;
+	uint32_t slot = 0;
+
+	if (cs != NULL) {
+		slot = cs - dto_callsites + 1;
+		cs->cc_writes++;
+	}
+	*cc_entry(cc_written, page) = ((page & 0xFFFFFFFFF) << 28) | ((uint64_t)slot << 17) |
+		(dto_pf_now_ms() & 0x1FFFF);
+
+	/* larger than the LLC can usefully hold */
+	if (dto_llc_size && n > dto_llc_size / 2)
+		return false;
+
+	if (cc_is_hot(page))
+		return true;
+	if (cs != NULL && cs->cc_writes >= DTO_CC_SITE_MIN_WRITES &&
+		cs->cc_reused * 100 >= cs->cc_writes * DTO_CC_SITE_REUSE_PCT)
+		return true;
+
+	if (n >= dto_cc_max_size)
+		return false;
+	return !cc_llc_pressure();
+}
+
+/* Cache control flag for an operation of n bytes writing dest */
+static __always_inline uint32_t dsa_cc_flag(struct dto_wq *wq, int op, const void *dest, size_t n)
+{
+	bool cc = dto_dsa_cc && (wq->dsa_gencap & GENCAP_CC_MEMORY);
+
+	if (cc && dto_dsa_cc == DTO_CC_ADAPTIVE)
+		cc = cc_choose(dest, n);
+
+#ifdef DTO_STATS_SUPPORT
+	if (unlikely(collect_stats)) {
+		struct dto_stats *st = get_thr_stats();
+
+		if (st != NULL) {
+			++st->cc_ops[op][cc];
+			st->cc_bytes[op][cc] += n;
+		}
+	}
+#endif
+	return cc ? IDXD_OP_FLAG_CC : 0;
+}
+
+static void dto_memset(void *s, int c, size_t n, int *result)
+{
+	uint64_t memset_pattern;
+	size_t cpu_size, dsa_size, cpu_fraction;
+	int num_stripes;
+	struct dto_wq *wq = get_wq(s, n);
+
+	for (int i = 0; i < 8; ++i)
+		((uint8_t *) &memset_pattern)[i] = (uint8_t) c;
+
+	thr_desc.opcode = DSA_OPCODE_MEMFILL;
+	thr_desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	thr_desc.flags |= dsa_cc_flag(wq, MEMSET, s, n);
+	if (dto_bof_min_size && n >= dto_bof_min_size && wq->block_on_fault)
+		thr_desc.flags |= IDXD_OP_FLAG_BOF;
+	thr_desc.completion_addr = (uint64_t)&thr_comp;
+	thr_desc.pattern = memset_pattern;
+
+	/* cpu_fraction guaranteed to be >= 0 and < 100 */
+	cpu_fraction = tune_cpu_fraction(MEMSET, n);
+	cpu_size = n * cpu_fraction / 100;
+	dsa_size = n - cpu_size;
+
+	thr_bytes_completed = 0;
+	num_stripes = get_stripes(wq, dsa_size);
+	if (dsa_size <= wq->max_transfer_size && num_stripes == 1) {
+		thr_desc.dst_addr = (uint64_t) s + cpu_size;
+		thr_desc.xfer_size = (uint32_t) dsa_size;
+		thr_comp.status = 0;
+		*result = dsa_submit(wq, &thr_desc);
+		if (likely(*result == SUCCESS)) {
+			if (cpu_size) {
+				orig_memset(s, c, cpu_size);
+				thr_bytes_completed = cpu_size;
+				tune_cpu_done(thr_comp.status != 0);
+			}
+			*result = dsa_wait(wq, &thr_desc, &thr_comp);
+		}
+		if (unlikely(thr_tune.active))
+			tune_update(MEMSET, n, cpu_size, dsa_size, *result);
+	} else {
+		size_t threshold;
+		/* each round submits up to one batch worth of descriptors per stripe */
+		threshold = get_job_capacity() * 100 / (100 - cpu_fraction);
+
+		do {
+			size_t len;
+
+			len = n <= threshold ? n : threshold;
+
+			cpu_size = len * cpu_fraction / 100;
+			dsa_size = len - cpu_size;
+
+			*result = dsa_submit_job(0, (uint64_t) s + cpu_size + thr_bytes_completed, dsa_size);
+			if (thr_batch.num_submitted) {
+				if (cpu_size) {
+					void *s1 = s + thr_bytes_completed;
+
+					orig_memset(s1, c, cpu_size);
+					thr_bytes_completed += cpu_size;
+					tune_cpu_done(dsa_job_done());
+				}
+				*result = dsa_wait_job(*result);
+			}
+			/* only the first round is measured */
+			if (unlikely(thr_tune.active))
+				tune_update(MEMSET, n, cpu_size, dsa_size, *result);
+
+			if (*result != SUCCESS)
+				break;
+			n -= len;
+			/* If remaining bytes are less than dsa_min_size,
+			 * dont submit to DSA. Instead, complete remaining
+			 * bytes on CPU
+			 */
+		} while (n >= dsa_min_size);
+	}
+}
+
+/* For overlapping src & dest buffers in memmove API, the job can only be split
+ * in copy order. See dto_memmove_overlapping().
+ */
+static bool is_overlapping_buffers (void *dest, const void *src, size_t n)
+{
+	if ((dest + n) < src || (src + n) < dest)
+		return false;
+
+	return true;
+}
+
+static __thread uint8_t *thr_overlap_bounce;
+static pthread_key_t overlap_key;
+static pthread_once_t overlap_key_once = PTHREAD_ONCE_INIT;
+
+static void put_overlap_bounce(void *arg)
+{
+	thr_overlap_bounce = NULL;
+	munmap(arg, DTO_OVERLAP_BOUNCE_SIZE);
+}
+
+static void create_overlap_key(void)
+{
+	pthread_key_create(&overlap_key, put_overlap_bounce);
+}
+
+static uint8_t *get_overlap_bounce(void)
+{
+	uint8_t *bounce = thr_overlap_bounce;
+
+	if (unlikely(bounce == NULL)) {
+		pthread_once(&overlap_key_once, create_overlap_key);
+
+		/* mmap'ed rather than malloc'ed for the same reason as the stats shards */
+		bounce = mmap(NULL, DTO_OVERLAP_BOUNCE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (bounce == MAP_FAILED)
+			return NULL;
+		thr_overlap_bounce = bounce;
+		pthread_setspecific(overlap_key, bounce);
+	}
+	return bounce;
+}
+
+/* Submit the copy order range [off, n) of the DSA portion [dest, dest + n) of
+ * an overlapping move as chunk sized descriptors, up to one batch. Every
+ * descriptor but the first is fenced, so it starts only after the previous
+ * one completed (and is abandoned if it failed). The descriptors are in
+ * ascending address order for an ascending move and descending otherwise.
+ * Returns the submission result; *count is the number of descriptors.
+ */
+static __always_inline int dsa_submit_overlap(struct dto_wq *wq, uint64_t src, uint64_t dst,
+	size_t off, size_t n, size_t chunk, bool ascending, uint32_t *count)
+{
+	uint32_t batch_size = get_batch_size(wq);
+	uint32_t i = 0;
+
+	while (off < n && i < batch_size) {
+		struct dsa_hw_desc *hw = &thr_batch.descs[i];
+		size_t len = n - off < chunk ? n - off : chunk;
+		size_t pos = ascending ? off : n - off - len;
+
+		hw->opcode = DSA_OPCODE_MEMMOVE;
+		hw->flags = thr_desc.flags;
+		if (i)
+			hw->flags |= IDXD_OP_FLAG_FENCE;
+		hw->completion_addr = (uint64_t)&thr_batch.comps[i];
+		hw->src_addr = src + pos;
+		hw->dst_addr = dst + pos;
+		hw->xfer_size = (uint32_t) len;
+		thr_batch.comps[i].status = 0;
+
+		off += len;
+		++i;
+	}
+	*count = i;
+
+	if (i == 1)
+		return dsa_submit(wq, &thr_batch.descs[0]);
+
+	thr_batch.desc[0].opcode = DSA_OPCODE_BATCH;
+	thr_batch.desc[0].flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	thr_batch.desc[0].completion_addr = (uint64_t)&thr_batch.comp[0];
+	thr_batch.desc[0].desc_list_addr = (uint64_t)&thr_batch.descs[0];
+	thr_batch.desc[0].desc_count = i;
+	thr_batch.comp[0].status = 0;
+
+	if (dsa_submit(wq, &thr_batch.desc[0]) != SUCCESS)
+		return RETRY;
+	return SUCCESS;
+}
+
+/* Wait for the descriptors submitted by dsa_submit_overlap() and add the
+ * bytes of the leading descriptors that completed to *done. A partially
+ * completed descriptor doesn't count: it is no larger than the distance of
+ * the move, so redoing it on CPU is safe.
+ */
+static __always_inline int dsa_wait_overlap(uint32_t count, size_t *done)
+{
+	uint32_t i;
+
+	dsa_wait_no_adjust(count == 1 ? &thr_batch.comps[0].status : &thr_batch.comp[0].status);
+
+	for (i = 0; i < count; i++) {
+		if (thr_batch.comps[i].status != DSA_COMP_SUCCESS)
+			break;
+		*done += thr_batch.descs[i].xfer_size;
+	}
+	if (i == count)
+		return SUCCESS;
+	if ((thr_batch.comps[i].status & DSA_COMP_STATUS_MASK) == DSA_COMP_PAGE_FAULT_NOBOF) {
+		thr_fault_addr = thr_batch.comps[i].fault_addr;
+		return PAGE_FAULT;
+	}
+	LOG_ERROR("overlapping move failed status %x desc %u status %x\n",
+		count == 1 ? thr_batch.comps[0].status : thr_batch.comp[0].status, i,
+		thr_batch.comps[i].status);
+	return FAIL_OTHERS;
+}
+
+/* Overlapping memmove. The move is processed in copy order (ascending
+ * addresses if dest is below src, descending otherwise) in chunks no larger
+ * than the distance d between the buffers. A chunk only overwrites source
+ * bytes of the chunk before it, so the chunks are submitted in fenced
+ * batches. The leading part in copy order goes to DSA. The trailing
+ * cpu_fraction is moved on CPU meanwhile, except its first d bytes whose
+ * source DSA's last chunk overwrites: they are saved to a bounce buffer
+ * first and stored once DSA has completed.
+ * On failure the rest of the move is completed on CPU. Returns with
+ * thr_bytes_completed = n, or 0 if nothing was done.
+ */
+static void dto_memmove_overlapping(void *dest, const void *src, size_t n, int *result)
+{
+	bool ascending = dest < src;
+	size_t d = ascending ? src - dest : dest - src;
+	size_t chunk, cpu_size, dsa_size, done = 0;
+	uint64_t dsa_src, dsa_dst;
+	uint8_t *bounce = NULL;
+	uint8_t *bounce_dest = NULL;
+	struct dto_wq *wq;
+	bool cpu_started = false;
+	uint32_t count;
+
+	*result = SUCCESS;
+	if (d < DTO_OVERLAP_MIN_DISTANCE)
+		return;
+
+	wq = get_wq(dest, n);
+	chunk = d < wq->max_transfer_size ? d : wq->max_transfer_size;
+
+	thr_desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	thr_desc.flags |= dsa_cc_flag(wq, MEMMOVE, dest, n);
+	if (dto_bof_min_size && n >= dto_bof_min_size && wq->block_on_fault)
+		thr_desc.flags |= IDXD_OP_FLAG_BOF;
+
+	/* cpu_fraction guaranteed to be >= 0 and < 100 */
+	cpu_size = n * tune_cpu_fraction(MEMMOVE, n) / 100;
+	if (cpu_size <= d || d > DTO_OVERLAP_BOUNCE_SIZE || (bounce = get_overlap_bounce()) == NULL)
+		cpu_size = 0;
+	dsa_size = n - cpu_size;
+
+	/* the DSA portion, at the start of the buffers if ascending */
+	dsa_src = (uint64_t) src + (ascending ? 0 : cpu_size);
+	dsa_dst = (uint64_t) dest + (ascending ? 0 : cpu_size);
+
+	do {
+		*result = dsa_submit_overlap(wq, dsa_src, dsa_dst, done, dsa_size, chunk, ascending, &count);
+		if (*result != SUCCESS)
+			break;
+
+		if (cpu_size && !cpu_started) {
+			const uint8_t *bounce_src;
+
+			if (ascending) {
+				bounce_dest = (uint8_t *)dest + dsa_size;
+				bounce_src = (const uint8_t *)src + dsa_size;
+				orig_memcpy(bounce, bounce_src, d);
+				orig_memmove(bounce_dest + d, bounce_src + d, cpu_size - d);
+			} else {
+				bounce_dest = (uint8_t *)dest + cpu_size - d;
+				bounce_src = (const uint8_t *)src + cpu_size - d;
+				orig_memcpy(bounce, bounce_src, d);
+				orig_memmove(dest, src, cpu_size - d);
+			}
+			cpu_started = true;
+		}
+
+		*result = dsa_wait_overlap(count, &done);
+		wq_load_done(wq);
+		if (*result != SUCCESS)
+			break;
+	} while (done < dsa_size);
+
+	if (*result != SUCCESS) {
+		if (done == 0 && !cpu_started)
+			return;
+		/* the source of the rest of the DSA portion is intact */
+		if (ascending)
+			orig_memmove((void *)(dsa_dst + done), (const void *)(dsa_src + done), dsa_size - done);
+		else
+			orig_memmove((void *)dsa_dst, (const void *)dsa_src, dsa_size - done);
+	}
+
+	if (cpu_started)
+		orig_memcpy(bounce_dest, bounce, d);
+
+	thr_bytes_completed = n;
+}
+
+static bool dto_memcpymove(void *dest, const void *src, size_t n, bool is_memcpy, int *result)
+{
+	struct dto_wq *wq;
+	size_t cpu_size, dsa_size, cpu_fraction;
+	int num_stripes;
+	int op = is_memcpy ? MEMCOPY : MEMMOVE;
+
+	thr_bytes_completed = 0;
+
+	if (!is_memcpy && is_overlapping_buffers(dest, src, n)) {
+		// If the action is to perform on CPU, return having done nothing and
+		// memmove will perform the copy and correctly attribute statistics to stdlib call group
+		if (dto_overlapping_memmove_action == OVERLAPPING_CPU)
+			*result = SUCCESS;
+		else
+			dto_memmove_overlapping(dest, src, n, result);
+		return true;
+	}
+
+	/* cpu_fraction guaranteed to be >= 0 and < 100 */
+	cpu_fraction = tune_cpu_fraction(op, n);
+	cpu_size = n * cpu_fraction / 100;
+	dsa_size = n - cpu_size;
+	wq = get_wq(dest, n);
+
+	thr_desc.opcode = DSA_OPCODE_MEMMOVE;
+	thr_desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	thr_desc.flags |= dsa_cc_flag(wq, op, dest, n);
+	if (dto_bof_min_size && n >= dto_bof_min_size && wq->block_on_fault)
+		thr_desc.flags |= IDXD_OP_FLAG_BOF;
+	thr_desc.completion_addr = (uint64_t)&thr_comp;
+
+	num_stripes = get_stripes(wq, dsa_size);
+
+	if (dsa_size <= wq->max_transfer_size && num_stripes == 1) {
+		thr_desc.src_addr = (uint64_t) src + cpu_size;
+		thr_desc.dst_addr = (uint64_t) dest + cpu_size;
+		thr_desc.xfer_size = (uint32_t) dsa_size;
+		thr_comp.status = 0;
+		*result = dsa_submit(wq, &thr_desc);
+		if (*result == SUCCESS) {
+			if (cpu_size) {
+				if (is_memcpy)
+					orig_memcpy(dest, src, cpu_size);
+				else
+					orig_memmove(dest, src, cpu_size);
+				thr_bytes_completed += cpu_size;
+				tune_cpu_done(thr_comp.status != 0);
+			}
+			*result = dsa_wait(wq, &thr_desc, &thr_comp);
+		}
+		if (unlikely(thr_tune.active))
+			tune_update(op, n, cpu_size, dsa_size, *result);
+	} else {
+		/* each round submits up to one batch worth of descriptors per stripe */
+		size_t threshold = get_job_capacity() * 100 / (100 - cpu_fraction);
+
+		do {
+			size_t len;
+
+			len = n <= threshold ? n : threshold;
+			cpu_size = len * cpu_fraction / 100;
+			dsa_size = len - cpu_size;
+
+			*result = dsa_submit_job((uint64_t) src + cpu_size + thr_bytes_completed,
+					(uint64_t) dest + cpu_size + thr_bytes_completed, dsa_size);
+			if (thr_batch.num_submitted) {
+				if (cpu_size) {
+					const void *src1 = src + thr_bytes_completed;
+					void *dest1 = dest + thr_bytes_completed;
+
+					if (is_memcpy)
+						orig_memcpy(dest1, src1, cpu_size);
+					else
+						orig_memmove(dest1, src1, cpu_size);
+					thr_bytes_completed += cpu_size;
+					tune_cpu_done(dsa_job_done());
+				}
+				*result = dsa_wait_job(*result);
+			}
+			/* only the first round is measured */
+			if (unlikely(thr_tune.active))
+				tune_update(op, n, cpu_size, dsa_size, *result);
+
+			if (*result != SUCCESS)
+				break;
+			n -= len;
+			/* If remaining bytes are less than dsa_min_size,
+			* dont submit to DSA. Instead, complete remaining
+			* bytes on CPU
+			*/
+		} while (n >= dsa_min_size);
+	}
+
+	return false;
+}
+
+/* Index of the first descriptor of the job submitted by dsa_submit_job()
+ * that found a mismatch within the leading prefix bytes the job completed,
+ * or -1. The stripes and their descriptors cover consecutive ranges.
+ */
+static int dsa_job_mismatch(size_t prefix)
+{
+	size_t off = 0;
+
+	for (int s = 0; s < thr_batch.num_submitted; s++) {
+		uint32_t end = thr_batch.first[s] + thr_batch.count[s];
+
+		for (uint32_t i = thr_batch.first[s]; i < end; i++) {
+			if (off >= prefix)
+				return -1;
+			if (thr_batch.comps[i].status == DSA_COMP_SUCCESS && thr_batch.comps[i].result)
+				return i;
+			off += thr_batch.descs[i].xfer_size;
+		}
+	}
+	return -1;
+}
+
+/* Compare the leading cpu_fraction of each round on CPU while DSA compares
+ * the rest. The DSA part of a round is submitted at once: as a single
+ * descriptor, or split into batches (and stripes) if it is larger than
+ * max_transfer_size, and the lowest mismatch among the completion records
+ * is used. A mismatch found by the CPU precedes any mismatch found by DSA.
+ * A DSA mismatch reports the offset of the difference in bytes_completed,
+ * the sign of the result is taken from the CPU compare from that offset.
+ * Returns the comparison result; thr_bytes_completed is n if a mismatch was
+ * found, otherwise the length of the prefix known to be equal.
+ */
+static int dto_memcmp(const void *s1, const void *s2, size_t n, int *result)
+{
+	struct dto_wq *wq = get_wq((void*)s2, n);
+	size_t cpu_size, dsa_size, cpu_fraction, threshold, done = 0;
+	int cmp_result = 0;
+	int num_stripes;
+	bool single;
+
+	thr_desc.opcode = DSA_OPCODE_COMPARE;
+	thr_desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	if (dto_bof_min_size && n >= dto_bof_min_size && wq->block_on_fault)
+		thr_desc.flags |= IDXD_OP_FLAG_BOF;
+	thr_desc.completion_addr = (uint64_t)&thr_comp;
+
+	/* cpu_fraction guaranteed to be >= 0 and < 100 */
+	cpu_fraction = tune_cpu_fraction(MEMCMP, n);
+	dsa_size = n - n * cpu_fraction / 100;
+
+	/* selects the stripes (or wq alone) that dsa_submit_job() uses */
+	num_stripes = get_stripes(wq, dsa_size);
+	single = dsa_size <= wq->max_transfer_size && num_stripes == 1;
+	if (single)
+		threshold = n;
+	else
+		/* each round submits up to one batch worth of descriptors per stripe */
+		threshold = get_job_capacity() * 100 / (100 - cpu_fraction);
+
+	do {
+		const uint8_t *t1 = (const uint8_t *)s1 + done;
+		const uint8_t *t2 = (const uint8_t *)s2 + done;
+		size_t len = n - done <= threshold ? n - done : threshold;
+		struct dsa_hw_desc *mismatch_desc = NULL;
+		struct dsa_completion_record *mismatch_comp = NULL;
+		int i;
+
+		cpu_size = len * cpu_fraction / 100;
+		dsa_size = len - cpu_size;
+		if (dsa_size == 0)
+			break;
+
+		thr_bytes_completed = 0;
+		if (single) {
+			thr_desc.src_addr = (uint64_t) t1 + cpu_size;
+			thr_desc.src2_addr = (uint64_t) t2 + cpu_size;
+			thr_desc.xfer_size = (uint32_t) dsa_size;
+			thr_comp.status = 0;
+			thr_comp.result = 0;
+
+			*result = dsa_submit(wq, &thr_desc);
+			if (*result != SUCCESS)
+				break;
+		} else {
+			*result = dsa_submit_job((uint64_t) t1 + cpu_size, (uint64_t) t2 + cpu_size, dsa_size);
+			if (thr_batch.num_submitted == 0)
+				break;
+		}
+
+		if (cpu_size) {
+			cmp_result = orig_memcmp(t1, t2, cpu_size);
+			tune_cpu_done(single ? thr_comp.status != 0 : dsa_job_done());
+		}
+
+		if (single) {
+			*result = dsa_wait(wq, &thr_desc, &thr_comp);
+			if (*result == SUCCESS && thr_comp.result) {
+				mismatch_desc = &thr_desc;
+				mismatch_comp = &thr_comp;
+			}
+		} else {
+			*result = dsa_wait_job(*result);
+			i = dsa_job_mismatch(thr_bytes_completed);
+			if (i >= 0) {
+				mismatch_desc = &thr_batch.descs[i];
+				mismatch_comp = &thr_batch.comps[i];
+			}
+		}
+
+		/* mismatches end the compare early and aren't measured */
+		if (unlikely(thr_tune.active))
+			tune_update(MEMCMP, n, cpu_size, dsa_size,
+				cmp_result || mismatch_desc ? FAIL_OTHERS : *result);
+
+		/* the compare is complete, whatever happened to the DSA part */
+		if (cmp_result != 0) {
+			*result = SUCCESS;
+			done = n;
+			break;
+		}
+
+		if (mismatch_desc != NULL) {
+			size_t off = mismatch_comp->bytes_completed < mismatch_desc->xfer_size ?
+				mismatch_comp->bytes_completed : 0;
+
+			cmp_result = orig_memcmp((const void *)(mismatch_desc->src_addr + off),
+				(const void *)(mismatch_desc->src2_addr + off), mismatch_desc->xfer_size - off);
+			*result = SUCCESS;
+			done = n;
+			break;
+		}
+
+		if (*result != SUCCESS) {
+			/* the CPU part and the prefix completed by DSA are equal */
+			done += cpu_size + thr_bytes_completed;
+			break;
+		}
+
+		done += len;
+		/* If remaining bytes are less than dsa_min_size,
+		 * dont submit to DSA. Instead, complete remaining
+		 * bytes on CPU
+		 */
+	} while (done < n && n - done >= dsa_min_size);
+
+	thr_bytes_completed = done;
+	return cmp_result;
+}
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* Fault in the pages of [start, end). Returns false if the range can't be
+ * populated, in which case the CPU fallback will hit the same fault.
+ */
+static bool dto_pf_populate(uint64_t start, uint64_t end, bool write)
+{
+	start &= ~(uint64_t)(DTO_PAGE_SIZE - 1);
+	if (start >= end)
+		return true;
+
+	if (madvise((void *)start, end - start, write ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0)
+		return true;
+
+	/* Kernels older than 5.14 don't support MADV_POPULATE_*. Touch the pages */
+	if (errno != EINVAL)
+		return false;
+
+	for (uint64_t p = start; p < end; p += DTO_PAGE_SIZE) {
+		if (write)
+			__atomic_fetch_add((uint8_t *)p, 0, __ATOMIC_RELAXED);
+		else
+			(void)*(volatile uint8_t *)p;
+	}
+	return true;
+}
+
+static uint32_t dto_pf_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Each pf_table entry packs the page number of a buffer that faulted in the
+ * upper 40 bits and the time of the fault in ms in the lower 24 bits.
+ */
+static inline atomic_ullong *pf_table_entry(uint64_t page)
+{
+	return &pf_table[(page ^ (page >> 8)) % DTO_PF_TABLE_SIZE];
+}
+
+static void dto_pf_learn(const void *buf)
+{
+	uint64_t page = (uint64_t)buf >> DTO_PAGE_SHIFT;
+
+	*pf_table_entry(page) = (page << 24) | (dto_pf_now_ms() & 0xFFFFFF);
+	pf_table_used = true;
+}
+
+static bool dto_pf_lookup(const void *buf)
+{
+	uint64_t page = (uint64_t)buf >> DTO_PAGE_SHIFT;
+	uint64_t entry = *pf_table_entry(page);
+
+	if (entry == 0 || (entry >> 24) != (page & 0xFFFFFFFFFF))
+		return false;
+
+	return ((dto_pf_now_ms() - entry) & 0xFFFFFF) < DTO_PF_TTL_MS;
+}
+
+/* Pre-fault the buffers of a job if they faulted recently */
+static void dto_pf_pretouch(void *dest, const void *src, size_t n, bool dest_write)
+{
+	bool touched = false;
+
+	if (likely(!pf_table_used))
+		return;
+
+	if (dest != NULL && dto_pf_lookup(dest)) {
+		dto_pf_populate((uint64_t)dest, (uint64_t)dest + n, dest_write);
+		touched = true;
+	}
+	if (src != NULL && dto_pf_lookup(src)) {
+		dto_pf_populate((uint64_t)src, (uint64_t)src + n, false);
+		touched = true;
+	}
+
+#ifdef DTO_STATS_SUPPORT
+	if (touched && collect_stats) {
+		struct dto_stats *st = get_thr_stats();
+
+		if (st != NULL)
+			++st->pf_pretouches;
+	}
+#else
+	(void)touched;
+#endif
+}
+
+/* Fault in the rest of the buffer that the faulting address belongs to */
+static bool dto_pf_fault_in(void *dest, const void *src, size_t done, size_t n, bool dest_write)
+{
+	uint64_t d = (uint64_t)dest, s = (uint64_t)src;
+
+	if (thr_fault_addr >= d + done && thr_fault_addr < d + n) {
+		dto_pf_learn(dest);
+		return dto_pf_populate(thr_fault_addr, d + n, dest_write);
+	}
+	if (src != NULL && thr_fault_addr >= s + done && thr_fault_addr < s + n) {
+		dto_pf_learn(src);
+		return dto_pf_populate(thr_fault_addr, s + n, false);
+	}
+	return false;
+}
+
+/* A job that page faulted has completed thr_bytes_completed bytes. Fault in
+ * the pages at the faulting address and resubmit the rest of the job to DSA
+ * instead of completing it on CPU. On return, thr_bytes_completed covers the
+ * bytes completed by all the attempts. For memcmp the comparison result is
+ * returned.
+ */
+static int dto_pf_recover(int op, void *dest, const void *src, int c, size_t n, int *result)
+{
+	size_t done = thr_bytes_completed;
+	int ret = 0;
+
+	for (int i = 0; i < DTO_PF_MAX_RESUMES; i++) {
+		if (*result != PAGE_FAULT || n - done < dsa_min_size)
+			break;
+
+		if (!dto_pf_fault_in(dest, src, done, n, op != MEMCMP))
+			break;
+
+		switch (op) {
+		case MEMSET:
+			dto_memset(dest + done, c, n - done, result);
+			break;
+		case MEMCOPY:
+		case MEMMOVE:
+			dto_memcpymove(dest + done, src + done, n - done, op == MEMCOPY, result);
+			break;
+		case MEMCMP:
+			ret = dto_memcmp(dest + done, src + done, n - done, result);
+			break;
+		}
+		done += thr_bytes_completed;
+
+#ifdef DTO_STATS_SUPPORT
+		if (collect_stats) {
+			struct dto_stats *st = get_thr_stats();
+
+			if (st != NULL) {
+				++st->pf_resumes;
+				st->pf_dsa_bytes += thr_bytes_completed;
+			}
+		}
+#endif
+	}
+
+#ifdef DTO_STATS_SUPPORT
+	if (collect_stats && *result == PAGE_FAULT) {
+		struct dto_stats *st = get_thr_stats();
+
+		if (st != NULL)
+			st->pf_cpu_bytes += n - done;
+	}
+#endif
+	thr_bytes_completed = done;
+	return ret;
+}
+
+/* The dto_internal_mem* APIs are used only when mem* APIs are
+ * called before DTO is properly initialized. So these
+ * implementations dont have to be performant
+ *
+ * The compiler must not turn their loops back into mem* calls, which would
+ * resolve to DTO's and recurse, or fuse calloc()'s malloc() and zeroing into
+ * a calloc() call.
+ */
+#define DTO_NO_MEM_CALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+static DTO_NO_MEM_CALLS void *dto_internal_memset(void *s1, int c, size_t n)
+{
+	char *dest = s1;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dest[i] = (char)c;
+
+	return s1;
+}
+
+static DTO_NO_MEM_CALLS void *dto_internal_memcpymove(void *dest, const void *src, size_t n)
+{
+	char *d = dest;
+	const char *s = (const char *)src;
+	ssize_t i;
+
+	if (s >= d) {
+		/* go from beginning to end */
+		for (i = 0; i < n; i++)
+			d[i] = s[i];
+	} else {
+		/* go from end to beginning */
+		for (i = n - 1; i >= 0; i--)
+			d[i] = s[i];
+	}
+
+	return dest;
+}
+
+static int dto_internal_memcmp(const void *s1, const void *s2, size_t n)
+{
+	const unsigned char *src1 = (const unsigned char *)s1;
+	const unsigned char *src2 = (const unsigned char *)s2;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (src1[i] != src2[i])
+			return src1[i] - src2[i];
+	}
+	return 0;
+}
+
+static void *dto_memset_call(void *s1, int c, size_t n, const void *caller)
+{
+	int result = 0;
+	void *ret = s1;
+	int use_orig_func = USE_ORIG_FUNC(n, dto_dsa_memset);
+#ifdef DTO_STATS_SUPPORT
+	struct timespec st, et;
+	size_t orig_n = n;
+#endif
+
+	if (unlikely(dto_initialized == 0)) {
+		/* If there are other constructors in the same binary,
+		 * they may run before DTO's constructor. Just use
+		 * internal CPU-based implementation if DTO is not
+		 * initialized yet.
+		 */
+		return dto_internal_memset(s1, c, n);
+	}
+
+	if (!use_orig_func && tune_use_cpu(MEMSET, n))
+		use_orig_func = 1;
+
+	if (!use_orig_func && dto_callsite_policy && callsite_use_cpu(caller, MEMSET, n))
+		use_orig_func = 1;
+
+	if (!use_orig_func) {
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+		dto_pf_pretouch(s1, NULL, n, true);
+		dto_memset(s1, c, n, &result);
+		if (unlikely(result == PAGE_FAULT) && dto_pf_resume)
+			dto_pf_recover(MEMSET, s1, NULL, c, n, &result);
+
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, MEMSET, n, false, thr_bytes_completed, result);
+#endif
+		if (thr_bytes_completed != n) {
+			/* fallback to std call if job is only partially completed */
+			use_orig_func = 1;
+			n -= thr_bytes_completed;
+			s1 = (void *)((uint64_t)s1 + thr_bytes_completed);
+		}
+	}
+
+	if (use_orig_func) {
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+
+		orig_memset(s1, c, n);
+
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, MEMSET, n, orig_n);
+#endif
+	}
+	callsite_done();
+	return ret;
+}
+
+static void *dto_memcpy_call(void *dest, const void *src, size_t n, const void *caller)
+{
+	int result = 0;
+	void *ret = dest;
+	int use_orig_func = USE_ORIG_FUNC(n, dto_dsa_memcpy);
+#ifdef DTO_STATS_SUPPORT
+	struct timespec st, et;
+	size_t orig_n = n;
+#endif
+
+	if (unlikely(dto_initialized == 0)) {
+		/* If there are other constructors in the same binary,
+		 * they may run before DTO's constructor. Just use
+		 * internal CPU-based implementation if DTO is not
+		 * initialized yet.
+		 */
+		return dto_internal_memcpymove(dest, src, n);
+	}
+
+	if (dto_dsa_cc == DTO_CC_ADAPTIVE)
+		cc_note_read(src);
+
+	if (!use_orig_func && tune_use_cpu(MEMCOPY, n))
+		use_orig_func = 1;
+
+	if (!use_orig_func && dto_callsite_policy && callsite_use_cpu(caller, MEMCOPY, n))
+		use_orig_func = 1;
+
+	if (!use_orig_func) {
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+		dto_pf_pretouch(dest, src, n, true);
+		dto_memcpymove(dest, src, n, 1, &result);
+		if (unlikely(result == PAGE_FAULT) && dto_pf_resume)
+			dto_pf_recover(MEMCOPY, dest, src, 0, n, &result);
+
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, MEMCOPY, n, false, thr_bytes_completed, result);
+#endif
+		if (thr_bytes_completed != n) {
+			/* fallback to std call if job is only partially completed */
+			use_orig_func = 1;
+			n -= thr_bytes_completed;
+			dest = (void *)((uint64_t)dest + thr_bytes_completed);
+			src = (const void *)((uint64_t)src + thr_bytes_completed);
+		}
+	}
+
+	if (use_orig_func) {
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+
+		orig_memcpy(dest, src, n);
+
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, MEMCOPY, n, orig_n);
+#endif
+	}
+	callsite_done();
+	return ret;
+}
+
+static void *dto_memmove_call(void *dest, const void *src, size_t n, const void *caller)
+{
+	int result = 0;
+	void *ret = dest;
+	int use_orig_func = USE_ORIG_FUNC(n, dto_dsa_memmove);
+	bool is_overlapping;
+#ifdef DTO_STATS_SUPPORT
+	struct timespec st, et;
+	size_t orig_n = n;
+#endif
+
+	if (unlikely(dto_initialized == 0)) {
+		/* If there are other constructors in the same binary,
+		 * they may run before DTO's constructor. Just use
+		 * internal CPU-based implementation if DTO is not
+		 * initialized yet.
+		 */
+		return dto_internal_memcpymove(dest, src, n);
+	}
+
+	if (dto_dsa_cc == DTO_CC_ADAPTIVE)
+		cc_note_read(src);
+
+	if (!use_orig_func && tune_use_cpu(MEMMOVE, n))
+		use_orig_func = 1;
+
+	if (!use_orig_func && dto_callsite_policy && callsite_use_cpu(caller, MEMMOVE, n))
+		use_orig_func = 1;
+
+	if (!use_orig_func) {
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+		dto_pf_pretouch(dest, src, n, true);
+		is_overlapping = dto_memcpymove(dest, src, n, 0, &result);
+		/* overlapping moves are completed by dto_memmove_overlapping() */
+		if (unlikely(result == PAGE_FAULT) && dto_pf_resume && !is_overlapping)
+			dto_pf_recover(MEMMOVE, dest, src, 0, n, &result);
+
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, MEMMOVE, n, is_overlapping, thr_bytes_completed, result);
+#endif
+		if (thr_bytes_completed != n) {
+			/* fallback to std call if job is only partially completed */
+			use_orig_func = 1;
+			n -= thr_bytes_completed;
+			dest = (void *)((uint64_t)dest + thr_bytes_completed);
+			src = (const void *)((uint64_t)src + thr_bytes_completed);
+		}
+	}
+
+	if (use_orig_func) {
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+
+		orig_memmove(dest, src, n);
+
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, MEMMOVE, n, orig_n);
+#endif
+	}
+	callsite_done();
+	return ret;
+}
+
+int memcmp(const void *s1, const void *s2, size_t n)
+{
+	int result = 0;
+	int ret;
+	int use_orig_func = USE_ORIG_FUNC(n, dto_dsa_memcmp);
+#ifdef DTO_STATS_SUPPORT
+	struct timespec st, et;
+	size_t orig_n = n;
+#endif
+
+	if (unlikely(dto_initialized == 0)) {
+		/* If there are other constructors in the same binary,
+		 * they may run before DTO's constructor. Just use
+		 * internal CPU-based implementation if DTO is not
+		 * initialized yet.
+		 */
+		return dto_internal_memcmp(s1, s2, n);
+	}
+
+	if (dto_dsa_cc == DTO_CC_ADAPTIVE) {
+		cc_note_read(s1);
+		cc_note_read(s2);
+	}
+
+	if (!use_orig_func && tune_use_cpu(MEMCMP, n))
+		use_orig_func = 1;
+
+	if (!use_orig_func && dto_callsite_policy && callsite_use_cpu(DTO_CALLER, MEMCMP, n))
+		use_orig_func = 1;
+
+	if (!use_orig_func) {
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+		dto_pf_pretouch((void *)s1, s2, n, false);
+		ret = dto_memcmp(s1, s2, n, &result);
+		if (unlikely(result == PAGE_FAULT) && dto_pf_resume)
+			ret = dto_pf_recover(MEMCMP, (void *)s1, s2, 0, n, &result);
+
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, MEMCMP, n, false, thr_bytes_completed, result);
+#endif
+		if (thr_bytes_completed != n) {
+			/* fallback to std call if job is only partially completed */
+			use_orig_func = 1;
+			n -= thr_bytes_completed;
+			s1 = (const void *)((uint64_t)s1 + thr_bytes_completed);
+			s2 = (const void *)((uint64_t)s2 + thr_bytes_completed);
+		}
+	}
+
+	if (use_orig_func) {
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+
+		ret = orig_memcmp(s1, s2, n);
+
+#ifdef DTO_STATS_SUPPORT
+		DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, MEMCMP, n, orig_n);
+#endif
+	}
+	callsite_done();
+	return ret;
+}
+
+void *memset(void *s1, int c, size_t n)
+{
+	return dto_memset_call(s1, c, n, DTO_CALLER);
+}
+
+void *memcpy(void *dest, const void *src, size_t n)
+{
+	return dto_memcpy_call(dest, src, n, DTO_CALLER);
+}
+
+void *memmove(void *dest, const void *src, size_t n)
+{
+	return dto_memmove_call(dest, src, n, DTO_CALLER);
+}
+
+/* The fortified (_FORTIFY_SOURCE) and other variants of memset, memcpy and
+ * memmove are routed to the same dispatch, so that they are offloaded too.
+ */
+#ifdef DTO_STATS_SUPPORT
+#define DTO_ENTRY(e, n) DTO_COLLECT_ENTRY_STATS(collect_stats, e, n)
+#else
+#define DTO_ENTRY(e, n) do {} while (0)
+#endif
+
+extern void __chk_fail(void) __attribute__((__noreturn__));
+
+void *__memset_chk(void *s, int c, size_t n, size_t destlen)
+{
+	if (unlikely(destlen < n))
+		__chk_fail();
+	DTO_ENTRY(ENTRY_MEMSET_CHK, n);
+	return dto_memset_call(s, c, n, DTO_CALLER);
+}
+
+void bzero(void *s, size_t n)
+{
+	DTO_ENTRY(ENTRY_BZERO, n);
+	dto_memset_call(s, 0, n, DTO_CALLER);
+}
+
+void explicit_bzero(void *s, size_t n)
+{
+	DTO_ENTRY(ENTRY_EXPLICIT_BZERO, n);
+	dto_memset_call(s, 0, n, DTO_CALLER);
+	/* the stores must not be optimized away */
+	asm volatile("" : : "r"(s) : "memory");
+}
+
+void __explicit_bzero_chk(void *s, size_t n, size_t destlen)
+{
+	if (unlikely(destlen < n))
+		__chk_fail();
+	DTO_ENTRY(ENTRY_EXPLICIT_BZERO_CHK, n);
+	dto_memset_call(s, 0, n, DTO_CALLER);
+	asm volatile("" : : "r"(s) : "memory");
+}
+
+/* DSA fills with a byte pattern here, so only wide characters whose bytes
+ * are all equal (e.g., 0 or -1) can use the memset dispatch.
+ */
+static wchar_t *dto_wmemset(wchar_t *s, wchar_t c, size_t n, const void *caller)
+{
+	uint32_t b = (uint8_t)c;
+
+	if ((uint32_t)c == b * 0x01010101U)
+		return dto_memset_call(s, b, n * sizeof(wchar_t), caller);
+
+	if (unlikely(orig_wmemset == NULL)) {
+		for (size_t i = 0; i < n; i++)
+			s[i] = c;
+		return s;
+	}
+	return orig_wmemset(s, c, n);
+}
+
+wchar_t *wmemset(wchar_t *s, wchar_t c, size_t n)
+{
+	DTO_ENTRY(ENTRY_WMEMSET, n * sizeof(wchar_t));
+	return dto_wmemset(s, c, n, DTO_CALLER);
+}
+
+wchar_t *__wmemset_chk(wchar_t *s, wchar_t c, size_t n, size_t destlen)
+{
+	if (unlikely(destlen < n))
+		__chk_fail();
+	DTO_ENTRY(ENTRY_WMEMSET_CHK, n * sizeof(wchar_t));
+	return dto_wmemset(s, c, n, DTO_CALLER);
+}
+
+void *__memcpy_chk(void *dest, const void *src, size_t n, size_t destlen)
+{
+	if (unlikely(destlen < n))
+		__chk_fail();
+	DTO_ENTRY(ENTRY_MEMCPY_CHK, n);
+	return dto_memcpy_call(dest, src, n, DTO_CALLER);
+}
+
+void *mempcpy(void *dest, const void *src, size_t n)
+{
+	DTO_ENTRY(ENTRY_MEMPCPY, n);
+	return (uint8_t *)dto_memcpy_call(dest, src, n, DTO_CALLER) + n;
+}
+
+void *__mempcpy_chk(void *dest, const void *src, size_t n, size_t destlen)
+{
+	if (unlikely(destlen < n))
+		__chk_fail();
+	DTO_ENTRY(ENTRY_MEMPCPY_CHK, n);
+	return (uint8_t *)dto_memcpy_call(dest, src, n, DTO_CALLER) + n;
+}
+
+wchar_t *wmemcpy(wchar_t *dest, const wchar_t *src, size_t n)
+{
+	DTO_ENTRY(ENTRY_WMEMCPY, n * sizeof(wchar_t));
+	return dto_memcpy_call(dest, src, n * sizeof(wchar_t), DTO_CALLER);
+}
+
+wchar_t *__wmemcpy_chk(wchar_t *dest, const wchar_t *src, size_t n, size_t destlen)
+{
+	if (unlikely(destlen < n))
+		__chk_fail();
+	DTO_ENTRY(ENTRY_WMEMCPY_CHK, n * sizeof(wchar_t));
+	return dto_memcpy_call(dest, src, n * sizeof(wchar_t), DTO_CALLER);
+}
+
+void *__memmove_chk(void *dest, const void *src, size_t n, size_t destlen)
+{
+	if (unlikely(destlen < n))
+		__chk_fail();
+	DTO_ENTRY(ENTRY_MEMMOVE_CHK, n);
+	return dto_memmove_call(dest, src, n, DTO_CALLER);
+}
+
+void bcopy(const void *src, void *dest, size_t n)
+{
+	DTO_ENTRY(ENTRY_BCOPY, n);
+	dto_memmove_call(dest, src, n, DTO_CALLER);
+}
+
+wchar_t *wmemmove(wchar_t *dest, const wchar_t *src, size_t n)
+{
+	DTO_ENTRY(ENTRY_WMEMMOVE, n * sizeof(wchar_t));
+	return dto_memmove_call(dest, src, n * sizeof(wchar_t), DTO_CALLER);
+}
+
+wchar_t *__wmemmove_chk(wchar_t *dest, const wchar_t *src, size_t n, size_t destlen)
+{
+	if (unlikely(destlen < n))
+		__chk_fail();
+	DTO_ENTRY(ENTRY_WMEMMOVE_CHK, n * sizeof(wchar_t));
+	return dto_memmove_call(dest, src, n * sizeof(wchar_t), DTO_CALLER);
+}
+
+/* calloc() and realloc() are intercepted so that the zeroing and copying of
+ * large blocks, which glibc does internally, can be offloaded
+ * (DTO_ALLOC_OFFLOAD=1). The blocks are allocated with malloc() and released
+ * with free(), which are not intercepted, so that they always come from the
+ * application's allocator. This also avoids the recursion hazard described
+ * at DTO_MIN_WQS: dlsym() may call calloc() while DTO resolves orig_calloc, in
+ * which case the block is allocated with malloc() and zeroed on CPU.
+ *
+ * Reading the chunk header requires glibc's malloc, so the offload is only
+ * enabled with it. Fresh mmap'ed chunks are already zero and are grown with
+ * mremap() by glibc's realloc(), so they are left to glibc. So are chunks
+ * that glibc can grow in place, without copying, see glibc_chunk_can_grow().
+ */
+#define GLIBC_CHUNK_PREV_INUSE 0x1
+#define GLIBC_CHUNK_IS_MMAPPED 0x2
+#define GLIBC_CHUNK_NON_MAIN_ARENA 0x4
+#define GLIBC_CHUNK_FLAGS 0x7
+#define GLIBC_CHUNK_MIN_SIZE (4 * sizeof(size_t))
+#define GLIBC_CHUNK_ALIGN_MASK (2 * sizeof(size_t) - 1)
+
+static __always_inline bool glibc_chunk_is_mmapped(void *p)
+{
+	return ((const size_t *)p)[-1] & GLIBC_CHUNK_IS_MMAPPED;
+}
+
+/* Whether glibc's realloc() may grow the chunk of p to size bytes in place,
+ * by merging the following chunk if it is free or the top chunk. Only the
+ * main arena's heap, which ends at the program break, is walked: the top
+ * chunk is recognized by its end, and the chunk after a free one is read for
+ * its PREV_INUSE flag. Chunks of other arenas are assumed to grow in place.
+ */
+static bool glibc_chunk_can_grow(void *p, size_t size)
+{
+	size_t hdr = ((const size_t *)p)[-1];
+	char *next = (char *)p - 2 * sizeof(size_t) + (hdr & ~GLIBC_CHUNK_FLAGS);
+	size_t next_size, nb;
+
+	if (hdr & GLIBC_CHUNK_NON_MAIN_ARENA)
+		return true;
+
+	next_size = ((const size_t *)next)[1] & ~GLIBC_CHUNK_FLAGS;
+	if (next + next_size + 2 * sizeof(size_t) > (char *)sbrk(0))
+		return true;	// the top chunk, or not in the heap
+
+	if (((const size_t *)(next + next_size))[1] & GLIBC_CHUNK_PREV_INUSE)
+		return false;
+
+	/* the chunk size glibc needs for size bytes */
+	nb = (size + sizeof(size_t) + GLIBC_CHUNK_ALIGN_MASK) & ~GLIBC_CHUNK_ALIGN_MASK;
+	if (nb < GLIBC_CHUNK_MIN_SIZE)
+		nb = GLIBC_CHUNK_MIN_SIZE;
+
+	return (hdr & ~GLIBC_CHUNK_FLAGS) + next_size >= nb;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	size_t n;
+	void *p;
+
+	if (unlikely(__builtin_mul_overflow(nmemb, size, &n))) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
-    			        LOG_TRACE( "Requested wait: %llu nsec\n", tpause_wait_time );
-    			        tmp = tpause_wait_time;
-    			        tmp *= freq;
-    			        tpause_wait_time = tmp / NSEC_PER_MSEC;
-    			        LOG_TRACE( "Requested wait duration: %llu cycles\n", tpause_wait_time );
-                        }
-    
-			// display configuration
-			LOG_TRACE("log_level: %d, collect_stats: %d, use_std_lib_calls: %d, dsa_min_size: %lu, "
-				"cpu_size_fraction: %.2f, wait_method: %s, auto_adjust_knobs: %d, numa_awareness: %s, dto_dsa_cc: %d\n",
-				log_level, collect_stats, use_std_lib_calls, dsa_min_size,
-				cpu_size_fraction_float, wait_names[wait_method], auto_adjust_knobs, numa_aware_names[is_numa_aware], dto_dsa_cc);
-			for (int i = 0; i < num_wqs; i++)
-				LOG_TRACE("[%d] wq_path: %s, wq_size: %d, dsa_cap: %lx\n", i,
-					wqs[i].wq_path, wqs[i].wq_size, wqs[i].dsa_gencap);
-		}
-		dto_initialized = 1;
+	if (likely(orig_calloc != NULL) && (!dto_alloc_offload || n < dto_alloc_min_size))
+		return orig_calloc(nmemb, size);
 
-		return DTO_INITIALIZED;
+	p = malloc(n);
+	if (p == NULL)
+		return NULL;
+
+	if (unlikely(orig_calloc == NULL)) {
+		dto_internal_memset(p, 0, n);
+		return p;
 	}
 
-	return DTO_INITIALIZING;
+	if (!glibc_chunk_is_mmapped(p)) {
+		DTO_ENTRY(ENTRY_CALLOC, n);
+		dto_memset_call(p, 0, n, DTO_CALLER);
+	}
+	return p;
 }
 
-static void cleanup_dto(void)
+void *realloc(void *ptr, size_t size)
 {
-	// unmap and close wq portal
-	for (int i = 0; i < num_wqs; i++) {
-		if (wqs[i].wq_mmapped) {
-			munmap(wqs[i].wq_portal, 0x1000);
-			wqs[i].wq_mmapped = false;
+	size_t old_size;
+	void *p;
+
+	if (likely(orig_realloc != NULL) && (!dto_alloc_offload || ptr == NULL || size == 0 ||
+			glibc_chunk_is_mmapped(ptr)))
+		return orig_realloc(ptr, size);
+
+	if (unlikely(orig_realloc == NULL)) {
+		if (ptr == NULL)
+			return malloc(size);
+		if (size == 0) {
+			free(ptr);
+			return NULL;
 		}
-			close(wqs[i].wq_fd);
 	}
-#ifdef DTO_STATS_SUPPORT
-	print_stats();
-#endif
-	if (log_fd != -1)
-		close(log_fd);
 
-	cleanup_devices();
-}
+	old_size = malloc_usable_size(ptr);
 
-static __always_inline  struct dto_wq *get_wq(void* buf)
-{
-	struct dto_wq* wq = NULL;
+	/* shrinking and growing in place don't copy, small copies aren't worth offloading */
+	if (likely(orig_realloc != NULL) && (size <= old_size || old_size < dto_alloc_min_size ||
+			glibc_chunk_can_grow(ptr, size)))
+		return orig_realloc(ptr, size);
 
-	if (is_numa_aware) {
-		int status[1] = {-1};
+	p = malloc(size);
+	if (p == NULL)
+		return NULL;
 
-		// get the numa node for the target DSA device
-		const int numa_node = get_numa_node(buf);
-		if (numa_node >= 0 && numa_node < MAX_NUMA_NODES) {
-			struct dto_device* dev = devices[numa_node];
-			if (dev != NULL &&
-				dev->num_wqs > 0) {
-				wq = dev->wqs[dev->next_wq++ % dev->num_wqs];
-			}
-		}
-	}
+	if (old_size > size)
+		old_size = size;
 
-	if (wq == NULL) {
-		wq = &wqs[next_wq++ % num_wqs];
+	if (unlikely(orig_realloc == NULL)) {
+		dto_internal_memcpymove(p, ptr, old_size);
+	} else {
+		DTO_ENTRY(ENTRY_REALLOC, old_size);
+		dto_memcpy_call(p, ptr, old_size, DTO_CALLER);
 	}
+	free(ptr);
 
-	return wq;
+	return p;
 }
 
-static void dto_memset(void *s, int c, size_t n, int *result)
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
 {
-	uint64_t memset_pattern;
-	size_t cpu_size, dsa_size;
-	struct dto_wq *wq = get_wq(s);
+	size_t n;
 
-	for (int i = 0; i < 8; ++i)
-		((uint8_t *) &memset_pattern)[i] = (uint8_t) c;
+	if (unlikely(__builtin_mul_overflow(nmemb, size, &n))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, n);
+}
 
-	thr_desc.opcode = DSA_OPCODE_MEMFILL;
-	thr_desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
-	if (dto_dsa_cc && (wq->dsa_gencap & GENCAP_CC_MEMORY))
-		thr_desc.flags |= IDXD_OP_FLAG_CC;
-	thr_desc.completion_addr = (uint64_t)&thr_comp;
-	thr_desc.pattern = memset_pattern;
+/* CRC APIs (dto.h). Buffers larger than max_transfer_size are processed in
+ * chunks, each seeded with the CRC of the previous ones. Chunks that DSA
+ * can't complete are done on the CPU.
+ */
+static uint32_t dto_crc(uint32_t crc, uint8_t *dest, const uint8_t *src, size_t n)
+{
+	struct dto_wq *wq;
+	size_t off = 0;
 
-	/* cpu_size_fraction guaranteed to be >= 0 and < 100 */
-	cpu_size = n * cpu_size_fraction / 100;
-	dsa_size = n - cpu_size;
+	if (unlikely(dto_initialized == 0) || USE_ORIG_FUNC(n, 1))
+		return ~crc32c_cpu(~crc, dest, src, n);
 
-	thr_bytes_completed = 0;
-	if (dsa_size <= wq->max_transfer_size) {
-		thr_desc.dst_addr = (uint64_t) s + cpu_size;
-		thr_desc.xfer_size = (uint32_t) dsa_size;
-		thr_comp.status = 0;
-		*result = dsa_submit(wq, &thr_desc);
-		if (likely(*result == SUCCESS)) {
-			if (cpu_size) {
-				orig_memset(s, c, cpu_size);
-				thr_bytes_completed = cpu_size;
-			}
-			*result = dsa_wait(wq, &thr_desc, &thr_comp.status);
-		}
-	} else {
-		uint32_t threshold;
-		size_t current_cpu_size_fraction = cpu_size_fraction;  // the cpu_size_fraction might be changed by the auto tune algorithm 
-		threshold = wq->max_transfer_size * 100 / (100 - current_cpu_size_fraction);
+	wq = get_wq(dest != NULL ? dest : (void *)src, n);
 
-		do {
-			size_t len;
+	thr_crc_desc.opcode = dest != NULL ? DSA_OPCODE_COPY_CRC : DSA_OPCODE_CRCGEN;
+	thr_crc_desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	if (dest != NULL)
+		thr_crc_desc.flags |= dsa_cc_flag(wq, MEMCOPY, dest, n);
+	thr_crc_desc.completion_addr = (uint64_t)&thr_comp;
 
-			len = n <= threshold ? n : threshold;
+	while (off < n) {
+		size_t len = n - off < wq->max_transfer_size ? n - off : wq->max_transfer_size;
 
-			cpu_size = len * current_cpu_size_fraction / 100;
-			dsa_size = len - cpu_size;
+		thr_crc_desc.src_addr = (uint64_t)src + off;
+		thr_crc_desc.dst_addr = dest != NULL ? (uint64_t)dest + off : 0;
+		thr_crc_desc.xfer_size = (uint32_t) len;
+		thr_crc_desc.crc_seed = crc;
 
-			thr_desc.dst_addr = (uint64_t) s + cpu_size + thr_bytes_completed;
-			thr_desc.xfer_size = (uint32_t) dsa_size;
-			thr_comp.status = 0;
-			*result = dsa_submit(wq, &thr_desc);
-			if (*result == SUCCESS) {
-				if (cpu_size) {
-					void *s1 = s + thr_bytes_completed;
+		thr_bytes_completed = 0;
+		if (dsa_execute(wq, &thr_crc_desc, &thr_comp) == SUCCESS)
+			crc = (uint32_t)thr_comp.crc_val;
+		else
+			crc = ~crc32c_cpu(~crc, dest != NULL ? dest + off : NULL, src + off, len);
+		off += len;
+	}
 
-					orig_memset(s1, c, cpu_size);
-					thr_bytes_completed += cpu_size;
-				}
-				*result = dsa_wait(wq, &thr_desc, &thr_comp.status);
-			}
+	return crc;
+}
 
-			if (*result != SUCCESS)
-				break;
-			n -= len;
-			/* If remaining bytes are less than dsa_min_size,
-			 * dont submit to DSA. Instead, complete remaining
-			 * bytes on CPU
-			 */
-		} while (n >= dsa_min_size);
-	}
+uint32_t dto_crc32c(uint32_t crc, const void *buf, size_t n)
+{
+	DTO_ENTRY(ENTRY_CRC32C, n);
+	return dto_crc(crc, NULL, buf, n);
+}
+
+uint32_t dto_memcpy_crc(uint32_t crc, void *dest, const void *src, size_t n)
+{
+	DTO_ENTRY(ENTRY_MEMCPY_CRC, n);
+	return dto_crc(crc, dest, src, n);
 }
 
-/* For overlapping src & dest buffers in memmove API, we can't split the memmove
- * job. Otherwise, it may lead to incorrect copy operation.
+/* Asynchronous API (dto.h). Each thread that uses it gets a pool of
+ * DTO_ASYNC_MAX_OPS handles, each with its own descriptors and completion
+ * records, so that several operations can be in flight at once. An operation
+ * larger than max_transfer_size is split into a batch; what doesn't fit into
+ * one batch is done on the CPU by dto_wait(). Operations that are done on the
+ * CPU at submission return dto_async_done.
  */
-static bool is_overlapping_buffers (void *dest, const void *src, size_t n)
+struct dto_handle {
+	struct dsa_hw_desc desc __attribute__((aligned(64)));
+	struct dsa_hw_desc descs[DTO_MAX_BATCH_SIZE] __attribute__((aligned(64)));
+	struct dsa_completion_record comp __attribute__((aligned(32)));
+	struct dsa_completion_record comps[DTO_MAX_BATCH_SIZE] __attribute__((aligned(32)));
+	bool in_use;
+	int op;
+	uint32_t num_descs;	/* more than 1: desc is a batch of descs */
+	uint8_t *dest;		/* s1 of memcmp */
+	const uint8_t *src;	/* s2 of memcmp */
+	int c;
+	int *cmp_result;
+	size_t n;
+	size_t dsa_n;		/* bytes submitted to DSA */
+	size_t chunk;		/* bytes per descriptor */
+	struct dto_wq *wq;
+#ifdef DTO_STATS_SUPPORT
+	struct timespec start;
+#endif
+};
+
+struct dto_async_pool {
+	struct dto_handle ops[DTO_ASYNC_MAX_OPS];
+	unsigned int next;
+};
+
+static struct dto_handle dto_async_done;
+static __thread struct dto_async_pool *thr_async_pool;
+static pthread_key_t async_key;
+static pthread_once_t async_key_once = PTHREAD_ONCE_INIT;
+
+/* The device may still write to the completion records of operations that
+ * the thread didn't wait for, so wait for them before unmapping the pool.
+ */
+static void put_async_pool(void *arg)
 {
-	if ((dest + n) < src || (src + n) < dest)
-		return false;
+	struct dto_async_pool *pool = arg;
 
-	return true;
+	for (int i = 0; i < DTO_ASYNC_MAX_OPS; i++) {
+		if (pool->ops[i].in_use) {
+			dsa_wait_no_adjust(&pool->ops[i].comp.status);
+			wq_load_done(pool->ops[i].wq);
+		}
+	}
+	thr_async_pool = NULL;
+	munmap(pool, sizeof(*pool));
 }
 
-static bool dto_memcpymove(void *dest, const void *src, size_t n, bool is_memcpy, int *result)
+static void create_async_key(void)
 {
-	struct dto_wq *wq;
-	size_t cpu_size, dsa_size;
-	bool is_overlapping;
+	pthread_key_create(&async_key, put_async_pool);
+}
 
-	thr_bytes_completed = 0;
+static struct dto_handle *get_async_handle(void)
+{
+	struct dto_async_pool *pool = thr_async_pool;
 
-	if (!is_memcpy && is_overlapping_buffers(dest, src, n)) {
-		cpu_size = 0;
-		is_overlapping = true;
-	} else {
-		/* cpu_size_fraction guaranteed to be >= 0 and < 1 */
-		cpu_size = n * cpu_size_fraction / 100;
-		is_overlapping = false;
-	}
+	if (unlikely(pool == NULL)) {
+		pthread_once(&async_key_once, create_async_key);
 
-	// If this is an overlapping memmove and the action is to perform on CPU, return having done nothing and
-	// memmove will perform the copy and correctly attribute statistics to stdlib call group
-	if (is_overlapping && dto_overlapping_memmove_action == OVERLAPPING_CPU) {
-		*result = SUCCESS;
-		return true;
+		/* mmap'ed rather than malloc'ed for the same reason as the stats shards */
+		pool = mmap(NULL, sizeof(*pool), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pool == MAP_FAILED)
+			return NULL;
+		thr_async_pool = pool;
+		pthread_setspecific(async_key, pool);
 	}
 
-	dsa_size = n - cpu_size;
-	wq = get_wq(dest);
+	for (int i = 0; i < DTO_ASYNC_MAX_OPS; i++) {
+		struct dto_handle *h = &pool->ops[pool->next++ % DTO_ASYNC_MAX_OPS];
 
-	thr_desc.opcode = DSA_OPCODE_MEMMOVE;
-	thr_desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
-	if (dto_dsa_cc && (wq->dsa_gencap & GENCAP_CC_MEMORY))
-		thr_desc.flags |= IDXD_OP_FLAG_CC;
-	thr_desc.completion_addr = (uint64_t)&thr_comp;
+		if (!h->in_use)
+			return h;
+	}
+	return NULL;
+}
 
-	if (dsa_size <= wq->max_transfer_size) {
-		thr_desc.src_addr = (uint64_t) src + cpu_size;
-		thr_desc.dst_addr = (uint64_t) dest + cpu_size;
-		thr_desc.xfer_size = (uint32_t) dsa_size;
-		thr_comp.status = 0;
-		if (is_overlapping) {
-			*result = dsa_execute(wq, &thr_desc, &thr_comp.status);
-		} else {
-			*result = dsa_submit(wq, &thr_desc);
-			if (*result == SUCCESS) {
-				if (cpu_size) {
-					if (is_memcpy)
-						orig_memcpy(dest, src, cpu_size);
-					else
-						orig_memmove(dest, src, cpu_size);
-					thr_bytes_completed += cpu_size;
-				}
-				*result = dsa_wait(wq, &thr_desc, &thr_comp.status);
-			}
-		}
-	} else {
-		uint32_t threshold;
-		size_t current_cpu_size_fraction = cpu_size_fraction;  // the cpu_size_fraction might be changed by the auto tune algorithm 
-		if (is_overlapping) {
-			threshold = wq->max_transfer_size;
-		} else {
-			threshold = wq->max_transfer_size * 100 / (100 - current_cpu_size_fraction);
+static void dto_async_cpu(int op, uint8_t *dest, const uint8_t *src, int c, size_t n, int *cmp_result)
+{
+	switch (op) {
+	case MEMSET:
+		orig_memset(dest, c, n);
+		break;
+	case MEMCOPY:
+		orig_memcpy(dest, src, n);
+		break;
+	case MEMCMP:
+		*cmp_result = orig_memcmp(dest, src, n);
+		break;
+	}
+}
+
+static int dto_async_submit(struct dto_handle *h, int op, void *dest, const void *src, int c, size_t n)
+{
+	struct dto_wq *wq = get_wq(op == MEMCMP ? (void *)src : dest, n);
+	uint32_t max_descs = get_batch_size(wq);
+	uint32_t flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	uint64_t pattern = 0;
+	size_t off = 0;
+	uint32_t i;
+
+	if (op == MEMSET) {
+		for (i = 0; i < 8; ++i)
+			((uint8_t *) &pattern)[i] = (uint8_t) c;
+	}
+	if (op != MEMCMP)
+		flags |= dsa_cc_flag(wq, op, dest, n);
+
+	h->chunk = wq->max_transfer_size;
+	h->wq = wq;
+	for (i = 0; i < max_descs && off < n; i++) {
+		size_t len = n - off < h->chunk ? n - off : h->chunk;
+		struct dsa_hw_desc *hw = &h->descs[i];
+
+		switch (op) {
+		case MEMSET:
+			hw->opcode = DSA_OPCODE_MEMFILL;
+			hw->pattern = pattern;
+			hw->dst_addr = (uint64_t)dest + off;
+			break;
+		case MEMCOPY:
+			hw->opcode = DSA_OPCODE_MEMMOVE;
+			hw->src_addr = (uint64_t)src + off;
+			hw->dst_addr = (uint64_t)dest + off;
+			break;
+		case MEMCMP:
+			hw->opcode = DSA_OPCODE_COMPARE;
+			hw->src_addr = (uint64_t)dest + off;
+			hw->src2_addr = (uint64_t)src + off;
+			break;
 		}
+		hw->flags = flags;
+		hw->completion_addr = (uint64_t)&h->comps[i];
+		hw->xfer_size = (uint32_t) len;
+		h->comps[i].status = 0;
+		off += len;
+	}
+	h->num_descs = i;
+	h->dsa_n = off;
 
-		do {
-			size_t len;
+	h->comp.status = 0;
+	if (h->num_descs == 1) {
+		h->descs[0].completion_addr = (uint64_t)&h->comp;
+		return dsa_submit(wq, &h->descs[0]);
+	}
 
-			len = n <= threshold ? n : threshold;
+	h->desc.opcode = DSA_OPCODE_BATCH;
+	h->desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	h->desc.desc_list_addr = (uint64_t)h->descs;
+	h->desc.desc_count = h->num_descs;
+	h->desc.completion_addr = (uint64_t)&h->comp;
 
-			if (!is_overlapping)
-				cpu_size = len * current_cpu_size_fraction / 100;
+	return dsa_submit(wq, &h->desc);
+}
 
-			dsa_size = len - cpu_size;
+static struct dto_handle *dto_async(int op, void *dest, const void *src, int c, size_t n,
+	int *cmp_result, int use_orig_func)
+{
+	struct dto_handle *h = NULL;
+	int ret = FAIL_OTHERS;
+#ifdef DTO_STATS_SUPPORT
+	struct timespec st, et;
+#endif
 
-			thr_desc.src_addr = (uint64_t) src + cpu_size + thr_bytes_completed;
-			thr_desc.dst_addr = (uint64_t) dest + cpu_size + thr_bytes_completed;
-			thr_desc.xfer_size = (uint32_t) dsa_size;
-			thr_comp.status = 0;
-			if (is_overlapping){
-				*result = dsa_execute(wq, &thr_desc, &thr_comp.status);
-			} else {
-				*result = dsa_submit(wq, &thr_desc);
-				if (*result == SUCCESS) {
-					if (cpu_size) {
-						const void *src1 = src + thr_bytes_completed;
-						void *dest1 = dest + thr_bytes_completed;
-
-						if (is_memcpy)
-							orig_memcpy(dest1, src1, cpu_size);
-						else
-							orig_memmove(dest1, src1, cpu_size);
-						thr_bytes_completed += cpu_size;
-					}
-					*result = dsa_wait(wq, &thr_desc, &thr_comp.status);
-				}
-			}
+#ifdef DTO_STATS_SUPPORT
+	DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+	if (!use_orig_func) {
+		h = get_async_handle();
+		if (h != NULL)
+			ret = dto_async_submit(h, op, dest, src, c, n);
+	}
 
-			if (*result != SUCCESS)
-				break;
-			n -= len;
-			/* If remaining bytes are less than dsa_min_size,
-			* dont submit to DSA. Instead, complete remaining
-			* bytes on CPU
-			*/
-		} while (n >= dsa_min_size);
+	if (ret == SUCCESS) {
+		h->in_use = true;
+		h->op = op;
+		h->dest = dest;
+		h->src = src;
+		h->c = c;
+		h->cmp_result = cmp_result;
+		h->n = n;
+#ifdef DTO_STATS_SUPPORT
+		h->start = st;
+#endif
+		return h;
 	}
 
-	return is_overlapping;
+#ifdef DTO_STATS_SUPPORT
+	if (h != NULL)
+		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, op, n, false, 0, ret);
+	DTO_COLLECT_STATS_START(collect_stats, st);
+#endif
+
+	dto_async_cpu(op, dest, src, c, n, cmp_result);
+
+#ifdef DTO_STATS_SUPPORT
+	DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, op, n, n);
+#endif
+	return &dto_async_done;
 }
 
-static int dto_memcmp(const void *s1, const void *s2, size_t n, int *result)
+/* Finish the parts that DSA didn't complete on the CPU */
+static void dto_async_complete(struct dto_handle *h)
 {
-	struct dto_wq *wq = get_wq((void*)s2);
-	int cmp_result = 0;
-	size_t orig_n = n;
+	size_t off = 0, cpu_bytes = 0;
+	int result = SUCCESS, cmp = 0;
+	uint32_t i;
+
+	for (i = 0; i < h->num_descs; i++) {
+		struct dsa_completion_record *comp = h->num_descs == 1 ? &h->comp : &h->comps[i];
+		size_t len = h->dsa_n - off < h->chunk ? h->dsa_n - off : h->chunk;
+		size_t done = len;
+
+		if (comp->status == DSA_COMP_SUCCESS) {
+			/* a compare mismatch completes with the offset of the difference */
+			if (h->op == MEMCMP && comp->result)
+				done = comp->bytes_completed < len ? comp->bytes_completed : 0;
+		} else if ((comp->status & DSA_COMP_STATUS_MASK) == DSA_COMP_PAGE_FAULT_NOBOF) {
+			done = comp->bytes_completed < len ? comp->bytes_completed : 0;
+			result = PAGE_FAULT;
+		} else {
+			if (comp->status != 0)
+				LOG_ERROR("failed status %x xfersz %lx\n", comp->status, len);
+			done = 0;
+			result = FAIL_OTHERS;
+		}
 
-	thr_desc.opcode = DSA_OPCODE_COMPARE;
-	thr_desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
-	thr_desc.completion_addr = (uint64_t)&thr_comp;
-	thr_comp.result = 0;
+		if (done < len) {
+			/* memcmp stops at the first chunk that differs */
+			if (h->op == MEMCMP) {
+				*h->cmp_result = orig_memcmp(h->dest + off + done, h->src + off + done, len - done);
+				cmp = *h->cmp_result;
+			} else {
+				dto_async_cpu(h->op, h->dest + off + done, h->src + off + done, h->c,
+					len - done, NULL);
+			}
+			cpu_bytes += len - done;
+			if (cmp != 0)
+				break;
+		}
+		off += len;
+	}
 
-	thr_bytes_completed = 0;
+	if (cmp == 0 && h->n > h->dsa_n) {
+		dto_async_cpu(h->op, h->dest + h->dsa_n, h->src + h->dsa_n, h->c, h->n - h->dsa_n,
+			h->cmp_result);
+		cpu_bytes += h->n - h->dsa_n;
+	} else if (cmp == 0 && h->op == MEMCMP) {
+		*h->cmp_result = 0;
+	}
 
-	if (n <= wq->max_transfer_size) {
-		thr_desc.src_addr = (uint64_t) s1;
-		thr_desc.src2_addr = (uint64_t) s2;
-		thr_desc.xfer_size = (uint32_t) n;
-		*result = dsa_execute(wq, &thr_desc, &thr_comp.status);
-	} else {
-		do {
-			size_t len;
+#ifdef DTO_STATS_SUPPORT
+	if (collect_stats) {
+		struct timespec et;
+		size_t dsa_bytes = h->n - cpu_bytes;
 
-			len = n <= wq->max_transfer_size ? n : wq->max_transfer_size;
+		clock_gettime(CLOCK_BOOTTIME, &et);
+		if (result != SUCCESS)
+			update_stats(h->op, h->n, false, dsa_bytes, TS_NS(h->start, et), DSA_CALL_FAILED, result);
+		else
+			update_stats(h->op, h->n, false, dsa_bytes, TS_NS(h->start, et), DSA_CALL_SUCCESS, 0);
+	}
+#else
+	(void)result;
+#endif
+}
 
-			thr_desc.src_addr = (uint64_t) s1 + thr_bytes_completed;
-			thr_desc.src2_addr = (uint64_t) s2 + thr_bytes_completed;
-			thr_desc.xfer_size = (uint32_t) len;
-			*result = dsa_execute(wq, &thr_desc, &thr_comp.status);
+dto_handle_t dto_memcpy_async(void *dest, const void *src, size_t n)
+{
+	if (unlikely(dto_initialized == 0)) {
+		dto_internal_memcpymove(dest, src, n);
+		return &dto_async_done;
+	}
+	return dto_async(MEMCOPY, dest, src, 0, n, NULL, USE_ORIG_FUNC(n, dto_dsa_memcpy));
+}
 
-			if (*result != SUCCESS || thr_comp.result)
-				break;
+dto_handle_t dto_memset_async(void *s, int c, size_t n)
+{
+	if (unlikely(dto_initialized == 0)) {
+		dto_internal_memset(s, c, n);
+		return &dto_async_done;
+	}
+	return dto_async(MEMSET, s, NULL, c, n, NULL, USE_ORIG_FUNC(n, dto_dsa_memset));
+}
 
-			n -= len;
-			/* If remaining bytes are less than dsa_min_size,
-			 * dont submit to DSA. Instead, complete remaining
-			 * bytes on CPU
-			 */
-		} while (n >= dsa_min_size);
+dto_handle_t dto_memcmp_async(const void *s1, const void *s2, size_t n, int *result)
+{
+	if (unlikely(dto_initialized == 0)) {
+		*result = dto_internal_memcmp(s1, s2, n);
+		return &dto_async_done;
 	}
+	return dto_async(MEMCMP, (void *)s1, s2, 0, n, result, USE_ORIG_FUNC(n, dto_dsa_memcmp));
+}
 
-	if (thr_comp.result) {
-		/* cmp returned mismatch. determine the return value */
-		uint8_t *t1 = (uint8_t *)s1 + thr_bytes_completed;
-		uint8_t *t2 = (uint8_t *)s2 + thr_bytes_completed;
+int dto_test(dto_handle_t h)
+{
+	if (h == &dto_async_done)
+		return 1;
+	return *(volatile uint8_t *)&h->comp.status != 0;
+}
 
-		cmp_result = *t1 - *t2;
-		/* Inform the caller than the job is done even though
-		 * we didn't process all the bytes
-		 */
-		thr_bytes_completed = orig_n;
-	}
-	return cmp_result;
+int dto_wait(dto_handle_t h)
+{
+	if (h == &dto_async_done)
+		return 0;
+
+	dsa_wait_no_adjust(&h->comp.status);
+	wq_load_done(h->wq);
+	dto_async_complete(h);
+	h->in_use = false;
+	return 0;
 }
 
-/* The dto_internal_mem* APIs are used only when mem* APIs are
- * called before DTO is properly initialized. So these
- * implementations dont have to be performant
- */
-static void *dto_internal_memset(void *s1, int c, size_t n)
+int dto_wait_any(dto_handle_t *handles, int count)
 {
-	char *dest = s1;
-	size_t i;
+	for (;;) {
+		bool pending = false;
+
+		for (int i = 0; i < count; i++) {
+			if (handles[i] == NULL)
+				continue;
+			if (dto_test(handles[i])) {
+				dto_wait(handles[i]);
+				return i;
+			}
+			pending = true;
+		}
+		if (!pending)
+			return -1;
+
+		if (wait_method == WAIT_YIELD)
+			sched_yield();
+		else
+			_mm_pause();
+	}
+}
 
-	for (i = 0; i < n; i++)
-		dest[i] = (char)c;
+/* Scatter-gather API (dto.h). The elements are packed into batches that use
+ * the descriptors of the async handles, so that the per-descriptor submission
+ * and wait cost is amortized over many small elements. The batches of one
+ * call are all submitted before waiting for the first one. If the pool runs
+ * out of handles the oldest batch is waited for and its handle reused.
+ */
+static void dto_sg_cpu_desc(struct dsa_hw_desc *hw, size_t done)
+{
+	size_t n = hw->xfer_size - done;
 
-	return s1;
+	if (hw->opcode == DSA_OPCODE_MEMFILL)
+		orig_memset((void *)(hw->dst_addr + done), (uint8_t)hw->pattern, n);
+	else
+		orig_memcpy((void *)(hw->dst_addr + done), (const void *)(hw->src_addr + done), n);
 }
 
-static void *dto_internal_memcpymove(void *dest, const void *src, size_t n)
+/* Wait for a batch and finish its failed descriptors on the CPU.
+ * Returns the number of bytes done on the CPU.
+ */
+static size_t dto_sg_wait(struct dto_handle *h, int *result)
 {
-	char *d = dest;
-	const char *s = (const char *)src;
-	ssize_t i;
+	size_t cpu_bytes = 0;
 
-	if (s >= d) {
-		/* go from beginning to end */
-		for (i = 0; i < n; i++)
-			d[i] = s[i];
-	} else {
-		/* go from end to beginning */
-		for (i = n - 1; i >= 0; i--)
-			d[i] = s[i];
-	}
+	dsa_wait_no_adjust(&h->comp.status);
+	wq_load_done(h->wq);
 
-	return dest;
-}
+	for (uint32_t i = 0; i < h->num_descs; i++) {
+		struct dsa_completion_record *comp = h->num_descs == 1 ? &h->comp : &h->comps[i];
+		size_t done = 0;
 
-static int dto_internal_memcmp(const void *s1, const void *s2, size_t n)
-{
-	const unsigned char *src1 = (const unsigned char *)s1;
-	const unsigned char *src2 = (const unsigned char *)s2;
-	size_t i;
+		if (comp->status == DSA_COMP_SUCCESS)
+			continue;
 
-	for (i = 0; i < n; i++) {
-		if (src1[i] != src2[i])
-			return src1[i] - src2[i];
+		if ((comp->status & DSA_COMP_STATUS_MASK) == DSA_COMP_PAGE_FAULT_NOBOF) {
+			done = comp->bytes_completed;
+			*result = PAGE_FAULT;
+		} else {
+			if (comp->status != 0)
+				LOG_ERROR("failed status %x xfersz %x\n", comp->status, h->descs[i].xfer_size);
+			*result = FAIL_OTHERS;
+		}
+		dto_sg_cpu_desc(&h->descs[i], done);
+		cpu_bytes += h->descs[i].xfer_size - done;
 	}
-	return 0;
+	h->in_use = false;
+
+	return cpu_bytes;
 }
 
-void *memset(void *s1, int c, size_t n)
+static int dto_sg(int op, void *const dest[], const void *const src[], int c,
+	const size_t len[], size_t count)
 {
-	int result = 0;
-	void *ret = s1;
-	int use_orig_func = USE_ORIG_FUNC(n, dto_dsa_memset);
+	struct dto_handle *inflight[DTO_ASYNC_MAX_OPS];
+	unsigned int first = 0, last = 0;
+	size_t i = 0, off = 0, total = 0, cpu_bytes = 0;
+	uint64_t pattern = 0;
+	uint32_t flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+	int result = SUCCESS;
+	int use_orig_func, use_dsa;
 #ifdef DTO_STATS_SUPPORT
 	struct timespec st, et;
-	size_t orig_n = n;
 #endif
 
+	for (size_t k = 0; k < count; k++)
+		total += len[k];
+
 	if (unlikely(dto_initialized == 0)) {
-		/* If there are other constructors in the same binary,
-		 * they may run before DTO's constructor. Just use
-		 * internal CPU-based implementation if DTO is not
-		 * initialized yet.
-		 */
-		return dto_internal_memset(s1, c, n);
+		for (size_t k = 0; k < count; k++) {
+			if (op == MEMSET)
+				dto_internal_memset(dest[k], c, len[k]);
+			else
+				dto_internal_memcpymove(dest[k], src[k], len[k]);
+		}
+		return 0;
 	}
 
-	if (!use_orig_func) {
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_START(collect_stats, st);
-#endif
-		dto_memset(s1, c, n, &result);
+	/* the elements are offloaded together, so the minimum size applies to the total */
+	use_dsa = op == MEMSET ? dto_dsa_memset : dto_dsa_memcpy;
+	use_orig_func = USE_ORIG_FUNC(total, use_dsa);
 
 #ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, MEMSET, n, false, thr_bytes_completed, result);
+	DTO_COLLECT_STATS_START(collect_stats, st);
 #endif
-		if (thr_bytes_completed != n) {
-			/* fallback to std call if job is only partially completed */
-			use_orig_func = 1;
-			n -= thr_bytes_completed;
-			s1 = (void *)((uint64_t)s1 + thr_bytes_completed);
+	for (int k = 0; k < 8; ++k)
+		((uint8_t *) &pattern)[k] = (uint8_t) c;
+
+	while (!use_orig_func && i < count) {
+		struct dto_handle *h = get_async_handle();
+		struct dsa_hw_desc *hw;
+		struct dto_wq *wq;
+		uint32_t max_descs, nd = 0;
+		size_t bytes = 0;
+		int ret;
+
+		if (h == NULL) {
+			/* the rest is done on CPU if the caller's async ops use the whole pool */
+			if (first == last)
+				break;
+			cpu_bytes += dto_sg_wait(inflight[first++ % DTO_ASYNC_MAX_OPS], &result);
+			continue;
+		}
+
+		wq = get_wq(dest[i], len[i]);
+		h->wq = wq;
+		max_descs = get_batch_size(wq);
+		flags = (flags & ~IDXD_OP_FLAG_CC) | dsa_cc_flag(wq, op, dest[i], len[i]);
+
+		while (nd < max_descs && i < count) {
+			size_t n = len[i] - off;
+
+			if (n > wq->max_transfer_size)
+				n = wq->max_transfer_size;
+
+			if (n > 0) {
+				hw = &h->descs[nd];
+				if (op == MEMSET) {
+					hw->opcode = DSA_OPCODE_MEMFILL;
+					hw->pattern = pattern;
+				} else {
+					hw->opcode = DSA_OPCODE_MEMMOVE;
+					hw->src_addr = (uint64_t)src[i] + off;
+				}
+				hw->flags = flags;
+				hw->completion_addr = (uint64_t)&h->comps[nd];
+				hw->dst_addr = (uint64_t)dest[i] + off;
+				hw->xfer_size = (uint32_t) n;
+				h->comps[nd].status = 0;
+				bytes += n;
+				off += n;
+				++nd;
+			}
+			if (off == len[i]) {
+				++i;
+				off = 0;
+			}
+		}
+		if (nd == 0)
+			break;
+
+		h->num_descs = nd;
+		h->comp.status = 0;
+		if (nd == 1) {
+			h->descs[0].completion_addr = (uint64_t)&h->comp;
+			hw = &h->descs[0];
+		} else {
+			h->desc.opcode = DSA_OPCODE_BATCH;
+			h->desc.flags = IDXD_OP_FLAG_CRAV | IDXD_OP_FLAG_RCR;
+			h->desc.desc_list_addr = (uint64_t)h->descs;
+			h->desc.desc_count = nd;
+			h->desc.completion_addr = (uint64_t)&h->comp;
+			hw = &h->desc;
+		}
+
+		/* a full WQ drains as our own batches complete */
+		while ((ret = dsa_submit(wq, hw)) == RETRY && first != last)
+			cpu_bytes += dto_sg_wait(inflight[first++ % DTO_ASYNC_MAX_OPS], &result);
+
+		if (ret != SUCCESS) {
+			for (uint32_t d = 0; d < nd; d++)
+				dto_sg_cpu_desc(&h->descs[d], 0);
+			cpu_bytes += bytes;
+			result = ret;
+			continue;
 		}
+		h->in_use = true;
+		h->op = op;
+		inflight[last++ % DTO_ASYNC_MAX_OPS] = h;
 	}
 
-	if (use_orig_func) {
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_START(collect_stats, st);
-#endif
+	for (; i < count; i++, off = 0) {
+		if (op == MEMSET)
+			orig_memset((uint8_t *)dest[i] + off, c, len[i] - off);
+		else
+			orig_memcpy((uint8_t *)dest[i] + off, (const uint8_t *)src[i] + off, len[i] - off);
+		cpu_bytes += len[i] - off;
+	}
 
-		orig_memset(s1, c, n);
+	while (first != last)
+		cpu_bytes += dto_sg_wait(inflight[first++ % DTO_ASYNC_MAX_OPS], &result);
 
 #ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, MEMSET, n, orig_n);
-#endif
+	if (cpu_bytes == total) {
+		DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, op, total, total);
+	} else {
+		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, op, total, false, total - cpu_bytes, result);
 	}
-	return ret;
+#endif
+	return 0;
 }
 
-void *memcpy(void *dest, const void *src, size_t n)
+int dto_memcpy_sg(void *const dest[], const void *const src[], const size_t len[], size_t count)
 {
-	int result = 0;
-	void *ret = dest;
-	int use_orig_func = USE_ORIG_FUNC(n, dto_dsa_memcpy);
-#ifdef DTO_STATS_SUPPORT
-	struct timespec st, et;
-	size_t orig_n = n;
-#endif
+	return dto_sg(MEMCOPY, dest, src, 0, len, count);
+}
 
-	if (unlikely(dto_initialized == 0)) {
-		/* If there are other constructors in the same binary,
-		 * they may run before DTO's constructor. Just use
-		 * internal CPU-based implementation if DTO is not
-		 * initialized yet.
-		 */
-		return dto_internal_memcpymove(dest, src, n);
-	}
+int dto_memset_sg(void *const dest[], int c, const size_t len[], size_t count)
+{
+	return dto_sg(MEMSET, dest, NULL, c, len, count);
+}
 
-	if (!use_orig_func) {
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_START(collect_stats, st);
-#endif
-		dto_memcpymove(dest, src, n, 1, &result);
+/* Dedicated WQ leases (dto.h). A thread gets a DWQ with dto_dwq_lease(), or
+ * at its first offloaded operation if its name is listed in DTO_DWQ_THREADS.
+ * The lease ends with dto_dwq_release() or when the thread exits.
+ */
+static pthread_key_t dwq_key;
+static pthread_once_t dwq_key_once = PTHREAD_ONCE_INIT;
 
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, MEMCOPY, n, false, thr_bytes_completed, result);
-#endif
-		if (thr_bytes_completed != n) {
-			/* fallback to std call if job is only partially completed */
-			use_orig_func = 1;
-			n -= thr_bytes_completed;
-			if (thr_comp.result == 0) {
-				dest = (void *)((uint64_t)dest + thr_bytes_completed);
-				src = (const void *)((uint64_t)src + thr_bytes_completed);
-			}
+/* Wait until the device is done with the descriptors the thread submitted
+ * to its DWQ. Synchronous operations have been waited for already, the
+ * thread's async operations are waited for without releasing their handles.
+ */
+static void dwq_drain(struct dto_wq *wq)
+{
+	if (thr_async_pool != NULL) {
+		for (int i = 0; i < DTO_ASYNC_MAX_OPS; i++) {
+			if (thr_async_pool->ops[i].in_use)
+				dsa_wait_no_adjust(&thr_async_pool->ops[i].comp.status);
 		}
 	}
+	wq->num_pending = 0;
+}
 
-	if (use_orig_func) {
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_START(collect_stats, st);
-#endif
+static void put_dwq(void *arg)
+{
+	struct dto_wq *wq = arg;
 
-		orig_memcpy(dest, src, n);
+	/* the next thread that leases the DWQ starts with an empty WQ */
+	if (wq->retired)
+		wq->num_pending = 0;
+	else
+		dwq_drain(wq);
+	thr_dwq = NULL;
+	atomic_store(&wq->leased, false);
+}
 
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, MEMCOPY, n, orig_n);
-#endif
-	}
-	return ret;
+static void create_dwq_key(void)
+{
+	pthread_key_create(&dwq_key, put_dwq);
 }
 
-void *memmove(void *dest, const void *src, size_t n)
+/* Lease a free DWQ, of the NUMA node of the calling thread's CPU if possible */
+static struct dto_wq *dwq_lease(void)
 {
-	int result = 0;
-	void *ret = dest;
-	int use_orig_func = USE_ORIG_FUNC(n, dto_dsa_memmove);
-	bool is_overlapping;
-#ifdef DTO_STATS_SUPPORT
-	struct timespec st, et;
-	size_t orig_n = n;
-#endif
+	int node = -1;
+	int cpu;
 
-	if (unlikely(dto_initialized == 0)) {
-		/* If there are other constructors in the same binary,
-		 * they may run before DTO's constructor. Just use
-		 * internal CPU-based implementation if DTO is not
-		 * initialized yet.
-		 */
-		return dto_internal_memcpymove(dest, src, n);
-	}
+	if (numa_available() != -1 && (cpu = sched_getcpu()) >= 0)
+		node = numa_node_of_cpu(cpu);
 
-	if (!use_orig_func) {
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_START(collect_stats, st);
-#endif
-		is_overlapping = dto_memcpymove(dest, src, n, 0, &result);
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < num_dwqs; i++) {
+			struct dto_wq *wq = dwq_at(i);
+			bool leased = false;
 
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, MEMMOVE, n, is_overlapping, thr_bytes_completed, result);
-#endif
-		if (thr_bytes_completed != n) {
-			/* fallback to std call if job is only partially completed */
-			use_orig_func = 1;
-			n -= thr_bytes_completed;
-			if (thr_comp.result == 0) {
-				dest = (void *)((uint64_t)dest + thr_bytes_completed);
-				src = (const void *)((uint64_t)src + thr_bytes_completed);
-			}
+			if ((pass == 0 && wq->numa_node != node) || wq->retired)
+				continue;
+			if (!atomic_compare_exchange_strong(&wq->leased, &leased, true))
+				continue;
+
+			wq->num_pending = 0;
+			pthread_once(&dwq_key_once, create_dwq_key);
+			pthread_setspecific(dwq_key, wq);
+			thr_dwq = wq;
+			LOG_TRACE("DWQ %s leased to thread %ld\n", wq->wq_path, syscall(SYS_gettid));
+			return wq;
 		}
 	}
 
-	if (use_orig_func) {
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_START(collect_stats, st);
-#endif
+	return NULL;
+}
 
-		orig_memmove(dest, src, n);
+/* Check if the name of the calling thread is listed in DTO_DWQ_THREADS: thread
+ * names separated by ';', an entry ending with '*' matches the names that start
+ * with the rest of it.
+ */
+static bool dwq_thread_listed(void)
+{
+	char name[16] = "";
+	const char *p = dto_dwq_threads;
 
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, MEMMOVE, n, orig_n);
-#endif
+	if (prctl(PR_GET_NAME, name) != 0)
+		return false;
+
+	while (*p != '\0') {
+		size_t len = strcspn(p, ";");
+
+		if (len > 0 && p[len - 1] == '*') {
+			if (strncmp(name, p, len - 1) == 0)
+				return true;
+		} else if (len > 0 && len == strlen(name) && strncmp(name, p, len) == 0) {
+			return true;
+		}
+
+		p += len;
+		if (*p == ';')
+			++p;
 	}
-	return ret;
+
+	return false;
 }
 
-int memcmp(const void *s1, const void *s2, size_t n)
+static struct dto_wq *get_thr_dwq(void)
 {
-	int result = 0;
-	int ret;
-	int use_orig_func = USE_ORIG_FUNC(n, dto_dsa_memcmp);
-#ifdef DTO_STATS_SUPPORT
-	struct timespec st, et;
-	size_t orig_n = n;
-#endif
+	/* a DWQ that was retired by a rescan is given up for another one */
+	if (thr_dwq != NULL && thr_dwq->retired) {
+		LOG_TRACE("DWQ %s retired, released by thread %ld\n", thr_dwq->wq_path, syscall(SYS_gettid));
+		pthread_setspecific(dwq_key, NULL);
+		put_dwq(thr_dwq);
+		thr_dwq_checked = false;
+	}
 
-	if (unlikely(dto_initialized == 0)) {
-		/* If there are other constructors in the same binary,
-		 * they may run before DTO's constructor. Just use
-		 * internal CPU-based implementation if DTO is not
-		 * initialized yet.
-		 */
-		return dto_internal_memcmp(s1, s2, n);
+	if (!thr_dwq_checked) {
+		thr_dwq_checked = true;
+		if (dto_dwq_threads[0] != '\0' && dwq_thread_listed())
+			dwq_lease();
 	}
+	return thr_dwq;
+}
 
-	if (!use_orig_func) {
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_START(collect_stats, st);
-#endif
-		ret = dto_memcmp(s1, s2, n, &result);
+int dto_dwq_lease(void)
+{
+	if (unlikely(dto_initialized == 0) || num_dwqs == 0)
+		return -1;
 
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_DSA_END(collect_stats, st, et, MEMCMP, n, false, thr_bytes_completed, result);
-#endif
-		if (thr_bytes_completed != n) {
-			/* fallback to std call if job is only partially completed */
-			use_orig_func = 1;
-			n -= thr_bytes_completed;
-			s1 = (const void *)((uint64_t)s1 + thr_bytes_completed);
-			s2 = (const void *)((uint64_t)s2 + thr_bytes_completed);
-		}
-	}
+	if (thr_dwq != NULL && thr_dwq->retired)
+		get_thr_dwq();
+	thr_dwq_checked = true;
+	if (thr_dwq != NULL || dwq_lease() != NULL)
+		return 0;
 
-	if (use_orig_func) {
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_START(collect_stats, st);
-#endif
+	return -1;
+}
 
-		ret = orig_memcmp(s1, s2, n);
+void dto_dwq_release(void)
+{
+	struct dto_wq *wq = thr_dwq;
 
-#ifdef DTO_STATS_SUPPORT
-		DTO_COLLECT_STATS_CPU_END(collect_stats, st, et, MEMCMP, n, orig_n);
-#endif
-	}
-	return ret;
+	if (wq == NULL)
+		return;
+
+	pthread_setspecific(dwq_key, NULL);
+	put_dwq(wq);
+}
+
+int dto_rescan_wqs(void)
+{
+	if (unlikely(dto_initialized == 0))
+		return -1;
+
+	return rescan_wqs();
+}
+
+/* munmap() and mbind() are intercepted only to invalidate the numa node cache */
+int munmap(void *addr, size_t length)
+{
+	if (is_numa_aware == NA_BUFFER_CENTRIC)
+		++numa_cache_gen;
+
+	if (unlikely(orig_munmap == NULL))
+		return syscall(SYS_munmap, addr, length);
+
+	return orig_munmap(addr, length);
+}
+
+long mbind(void *addr, unsigned long len, int mode, const unsigned long *nodemask,
+	unsigned long maxnode, unsigned int flags)
+{
+	if (is_numa_aware == NA_BUFFER_CENTRIC)
+		++numa_cache_gen;
+
+	if (unlikely(orig_mbind == NULL))
+		return syscall(SYS_mbind, addr, len, mode, nodemask, maxnode, flags);
+
+	return orig_mbind(addr, len, mode, nodemask, maxnode, flags);
 }
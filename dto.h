@@ -0,0 +1,97 @@
+/*******************************************************************************
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+
+/* Explicit asynchronous API of DTO. Applications that link with libdto (or
+ * look these symbols up with dlsym when it is preloaded) can start an
+ * operation, do other work and wait for its completion later.
+ *
+ * Each call returns a handle that must be passed to dto_wait() (directly or
+ * through dto_wait_any()) by the thread that started the operation. Up to
+ * DTO_ASYNC_MAX_OPS operations can be in flight per thread; further calls,
+ * calls below DTO_MIN_BYTES and calls that can't be submitted to DSA are done
+ * on the CPU before returning, and their handle is already complete. Page
+ * faults and other DSA errors are handled by dto_wait(), which finishes the
+ * operation on the CPU, so the result is always complete when it returns.
+ *
+ * The buffers must not be accessed until the operation is waited for.
+ * Handles don't survive fork(): the child must not wait for operations
+ * started by the parent.
+ */
+
+#ifndef DTO_H
+#define DTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DTO_ASYNC_MAX_OPS 32
+
+typedef struct dto_handle *dto_handle_t;
+
+dto_handle_t dto_memcpy_async(void *dest, const void *src, size_t n);
+dto_handle_t dto_memset_async(void *s, int c, size_t n);
+
+/* The memcmp() result is stored to *result by dto_wait() */
+dto_handle_t dto_memcmp_async(const void *s1, const void *s2, size_t n, int *result);
+
+/* Returns 1 if the operation has completed, i.e. dto_wait() won't block */
+int dto_test(dto_handle_t h);
+
+/* Waits for the operation to complete and releases the handle. Returns 0. */
+int dto_wait(dto_handle_t h);
+
+/* Waits until one of the count handles completes, releases it and returns
+ * its index. NULL entries are skipped. Returns -1 if all entries are NULL.
+ */
+int dto_wait_any(dto_handle_t *handles, int count);
+
+/* Scatter-gather variants of memcpy() and memset(): element i is dest[i],
+ * src[i] and len[i]. The elements are packed into DSA batches so that small
+ * elements benefit from the offload too; DTO_MIN_BYTES applies to the total
+ * length. Elements must not overlap. The calls are synchronous and return 0
+ * once every element is complete; elements that fault are completed on the CPU.
+ */
+int dto_memcpy_sg(void *const dest[], const void *const src[], const size_t len[], size_t count);
+int dto_memset_sg(void *const dest[], int c, const size_t len[], size_t count);
+
+/* CRC32C (Castagnoli polynomial, as used by iSCSI and many storage formats)
+ * of n bytes, using DSA's CRC generation. crc is the CRC of the preceding
+ * data, 0 for the first buffer, so a CRC can be computed piecewise:
+ * dto_crc32c(dto_crc32c(0, a, n1), b, n2) is the CRC of a followed by b.
+ */
+uint32_t dto_crc32c(uint32_t crc, const void *buf, size_t n);
+
+/* Copies n bytes like memcpy() and returns the CRC32C of the data, in a
+ * single pass over memory (DSA's copy with CRC).
+ */
+uint32_t dto_memcpy_crc(uint32_t crc, void *dest, const void *src, size_t n);
+
+/* Leases a dedicated WQ to the calling thread. Returns 0 if the thread holds
+ * one, -1 if there is no free dedicated WQ. The thread's operations, except
+ * the ones split into stripes, are then submitted to its dedicated WQ, and to
+ * the shared WQs when it is full. The lease is returned by dto_dwq_release()
+ * or when the thread exits; pending asynchronous operations are waited for.
+ */
+int dto_dwq_lease(void);
+void dto_dwq_release(void);
+
+/* Rescans the WQs: WQs that were enabled since are used from now on, WQs that
+ * are gone are retired. Offload resumes if it was disabled for lack of WQs.
+ * Rescans less than a second after the previous one (which may also have been
+ * done by the DTO_WQ_RESCAN_MS thread) return without scanning. Returns the
+ * number of shared WQs in use, -1 if DSA offload isn't configured.
+ */
+int dto_rescan_wqs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
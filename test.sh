@@ -37,6 +37,13 @@ export DTO_DSA_CC=1
 export LD_PRELOAD=./libdto.so.1.0
 /usr/bin/time ./dto-test-wodto
 
+# Check that hybrid waits go through the spin and umwait phases (umwait
+# needs a CPU with waitpkg), see the wait phases in the stats
+DTO_WAIT_METHOD=hybrid DTO_LOG_LEVEL=2 ./dto-test-wodto > hybrid.log
+for phase in spin umwait; do
+	grep -Eq "^$phase +[1-9]" hybrid.log || echo "hybrid wait never entered the $phase phase"
+done
+
 # Run dto-test with DTO library using "re-compile with DTO" method
 # (i.e., without LD_PRELOAD)
 #/usr/bin/time ./dto-test